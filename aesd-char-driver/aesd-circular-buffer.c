@@ -54,7 +54,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
         /* decrease the internal offset */
         char_offset_int -= buffer->entry[index].size;
 
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        index = aesd_circular_buffer_next(index);
         if (index == buffer->in_offs)
             done = true;
     }
@@ -62,16 +62,71 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     return NULL;
 }
 
+/**
+ * Collects the byte range [@param start, @param end) of @param buffer, counted like char_offset in
+ * aesd_circular_buffer_find_entry_offset_for_fpos, as a list of segments ready for writev or a kvec.
+ * Any necessary locking must be performed by caller, the segments point into the entries and are
+ * only valid until they are overwritten.
+ * @param segments receives up to @param max_segments buffptr/size pairs, in order
+ * @return the number of segments stored, 0 if @param start is past the data in the buffer. The range
+ * is cut short at the end of the buffer or when @param max_segments segments were stored.
+ */
+size_t aesd_circular_buffer_find_range(struct aesd_circular_buffer *buffer, size_t start, size_t end,
+                                       struct aesd_buffer_entry *segments, size_t max_segments)
+{
+    size_t remaining;
+    size_t nsegs = 0;
+    uint32_t held;
+    uint32_t ii;
+    uint8_t index;
+
+    if (buffer == NULL || segments == NULL || start >= end)
+        return 0;
+
+    remaining = end - start;
+    held = aesd_circular_buffer_count(buffer);
+    index = buffer->out_offs;
+    for (ii = 0; ii < held && nsegs < max_segments; ii++, index = aesd_circular_buffer_next(index))
+    {
+        const struct aesd_buffer_entry *entry = &buffer->entry[index];
+        size_t length;
+
+        /* skip the entries before the range */
+        if (start >= entry->size)
+        {
+            start -= entry->size;
+            continue;
+        }
+
+        length = entry->size - start;
+        if (length > remaining)
+            length = remaining;
+        segments[nsegs].buffptr = entry->buffptr + start;
+        segments[nsegs].size = length;
+        nsegs++;
+
+        remaining -= length;
+        if (remaining == 0)
+            break;
+        start = 0;
+    }
+
+    return nsegs;
+}
+
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
-* return a pointer to the entry if an entry was overwritten so the caller can free the memory
+* return the buffptr of the entry that was overwritten so the caller can free the memory, or NULL if
+* the buffer was not full
 */
-const struct aesd_buffer_entry *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry_evict(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    const char *overwritten = NULL;
+
     /* Check if the buffer is NULL */
     if (buffer == NULL)
         return NULL;
@@ -80,23 +135,135 @@ const struct aesd_buffer_entry *aesd_circular_buffer_add_entry(struct aesd_circu
     if (add_entry == NULL)
         return NULL;
 
-    /* save pointer to the old entry */
-    /* this should be NULL if it has not been written before */
-    const struct aesd_buffer_entry *old_entry = &buffer->entry[buffer->in_offs];
+    /* when full, in_offs is the oldest entry, keep its memory before the slot is reused */
+    if (buffer->full)
+        overwritten = buffer->entry[buffer->in_offs].buffptr;
 
     /* add new entry */
     buffer->entry[buffer->in_offs] = *add_entry;
 
     /* update write pointer and wrap around */
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = aesd_circular_buffer_next(buffer->in_offs);
 
     /* check if buffer is full, and advance the read pointer and wrap around */
     if (buffer->full)
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = aesd_circular_buffer_next(buffer->out_offs);
 
     /* update the full flag */
     buffer->full = (buffer->in_offs == buffer->out_offs);
 
+    return overwritten;
+}
+
+/**
+* Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
+* If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
+* new start location.
+* Any necessary locking must be handled by the caller
+* Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* return a pointer to the slot just written, which holds @param add_entry, or NULL if
+* @param buffer or @param add_entry is NULL. The overwritten entry is lost, callers that must free
+* its memory use aesd_circular_buffer_add_entry_evict instead
+*/
+const struct aesd_buffer_entry *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    uint8_t index;
+
+    /* Check if the buffer is NULL */
+    if (buffer == NULL)
+        return NULL;
+
+    /* Check if the add_entry is NULL */
+    if (add_entry == NULL)
+        return NULL;
+
+    index = buffer->in_offs;
+    aesd_circular_buffer_add_entry_evict(buffer, add_entry);
+    return &buffer->entry[index];
+}
+
+/**
+* Adds the @param count entries at @param entries to @param buffer in order, like as many calls to
+* aesd_circular_buffer_add_entry but updating in_offs, out_offs and full once.
+* Every entry dropped on the way is passed to @param evict if not NULL: the oldest entries of the
+* buffer that get overwritten, then the leading entries of a batch larger than the buffer which
+* would be overwritten by the rest of the batch and are never stored.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entries,
+                                      size_t count, aesd_circular_buffer_evict_fn evict, void *ctx)
+{
+    uint32_t held;
+    uint32_t overwritten;
+    uint32_t ii;
+    uint8_t index;
+
+    if (buffer == NULL || entries == NULL)
+        return;
+
+    /* every held entry is overwritten, keep the newest entries of the batch */
+    if (count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        size_t skipped = count - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+        held = aesd_circular_buffer_count(buffer);
+        index = buffer->out_offs;
+        for (ii = 0; evict && ii < held; ii++, index = aesd_circular_buffer_next(index))
+            evict(ctx, &buffer->entry[index]);
+        while (evict && skipped--)
+            evict(ctx, entries++);
+        if (!evict)
+            entries += count - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+        memcpy(buffer->entry, entries, sizeof(buffer->entry));
+        buffer->in_offs = 0;
+        buffer->out_offs = 0;
+        buffer->full = true;
+        return;
+    }
+
+    held = aesd_circular_buffer_count(buffer);
+    overwritten = (held + count > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) ?
+        held + count - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+
+    /* the oldest entries are overwritten in order, starting at out_offs */
+    index = buffer->out_offs;
+    for (ii = 0; evict && ii < overwritten; ii++, index = aesd_circular_buffer_next(index))
+        evict(ctx, &buffer->entry[index]);
+
+    index = buffer->in_offs;
+    for (ii = 0; ii < count; ii++, index = aesd_circular_buffer_next(index))
+        buffer->entry[index] = entries[ii];
+
+    buffer->in_offs = index;
+    buffer->out_offs = aesd_circular_buffer_advance(buffer->out_offs, overwritten);
+    buffer->full = (held + count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) || overwritten;
+}
+
+/**
+* Removes the oldest entry from @param buffer and advances buffer->out_offs to the next entry.
+* Any necessary locking must be handled by the caller
+* return a pointer to the removed entry so the caller can free the memory, it stays valid until
+* the next entry is added, or NULL if the buffer is empty
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *old_entry;
+
+    /* Check if the buffer is NULL */
+    if (buffer == NULL)
+        return NULL;
+
+    /* Check if the buffer is empty */
+    if (!buffer->full && buffer->in_offs == buffer->out_offs)
+        return NULL;
+
+    old_entry = &buffer->entry[buffer->out_offs];
+
+    /* advance the read pointer and wrap around */
+    buffer->out_offs = aesd_circular_buffer_next(buffer->out_offs);
+    buffer->full = false;
+
     return old_entry;
 }
 
@@ -51,13 +51,63 @@ struct aesd_circular_buffer
     bool full;
 };
 
+/**
+ * Called with each entry dropped from the buffer to make room for new ones, so the caller can
+ * free its buffptr. @param ctx is passed through from the add call.
+ */
+typedef void (*aesd_circular_buffer_evict_fn)(void *ctx, const struct aesd_buffer_entry *entry);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern size_t aesd_circular_buffer_find_range(struct aesd_circular_buffer *buffer, size_t start, size_t end,
+            struct aesd_buffer_entry *segments, size_t max_segments);
+
+/**
+ * Both add @param add_entry over the oldest entry when full. add_entry returns the slot just
+ * written, add_entry_evict returns the buffptr of the overwritten entry for the caller to free.
+ */
 extern const struct aesd_buffer_entry *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char *aesd_circular_buffer_add_entry_evict(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern void aesd_circular_buffer_add_entries(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *entries,
+            size_t count, aesd_circular_buffer_evict_fn evict, void *ctx);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+/**
+ * @return the index following @param index, wrapping around to 0 without the division a
+ * modulo by the non power of two AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED would cost
+ */
+static inline uint8_t aesd_circular_buffer_next(uint8_t index)
+{
+    return (index + 1 == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) ? 0 : index + 1;
+}
+
+/**
+ * @return the index @param count entries after @param index, @param count is at most
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ */
+static inline uint8_t aesd_circular_buffer_advance(uint8_t index, uint32_t count)
+{
+    uint32_t next = index + count;
+    return (next >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) ? next - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : next;
+}
+
+/**
+ * @return the number of entries held in @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    return (buffer->in_offs >= buffer->out_offs) ? buffer->in_offs - buffer->out_offs :
+        buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -77,6 +127,22 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
             index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
             index++, entryptr=&((buffer)->entry[index]))
 
+/**
+ * Like AESD_CIRCULAR_BUFFER_FOREACH but only visits the entries held in the buffer, from the
+ * oldest at out_offs to the newest
+ * @param ii is a uint32_t stack allocated value counting the entries visited
+ * Example usage:
+ * uint8_t index;
+ * uint32_t ii;
+ * AESD_CIRCULAR_BUFFER_FOREACH_LIVE(entry,&buffer,index,ii) {
+ *      total += entry->size;
+ * }
+ */
+#define AESD_CIRCULAR_BUFFER_FOREACH_LIVE(entryptr,buffer,index,ii) \
+    for((ii)=0, (index)=(buffer)->out_offs; \
+            (ii)<aesd_circular_buffer_count(buffer) && (((entryptr)=&((buffer)->entry[index])), 1); \
+            (ii)++, (index)=aesd_circular_buffer_next(index))
+
 
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
@@ -0,0 +1,463 @@
+/**
+ * @file aesd-engine.c
+ * @brief Line assembly, history and read logic of the aesdchar driver, shared by the kernel
+ * module and the user space benchmark
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#ifdef __KERNEL__
+#include <linux/mm.h> // For kvmalloc()
+#include <linux/string.h> // For memchr()
+#include <linux/errno.h>
+#include <linux/timekeeping.h> // For ktime_get_real_ns()
+#include "aesdchar_trace.h"
+
+#define aesd_alloc(size) kvmalloc(size, GFP_KERNEL)
+#define aesd_free(ptr) kvfree(ptr)
+#define aesd_now_ns() ktime_get_real_ns()
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#define aesd_alloc(size) malloc(size)
+#define aesd_free(ptr) free((void *)(ptr))
+static uint64_t aesd_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/* tracepoints only exist in the kernel */
+#define trace_aesd_commit(minor, seq, size, bytes_used) do { } while (0)
+#define trace_aesd_evict(minor, seq, size) do { } while (0)
+#endif
+
+#include "aesd-engine.h"
+
+/**
+ * Initializes an empty history in @param engine limited to @param max_bytes bytes,
+ * @param minor identifies it in tracepoints
+ */
+void aesd_engine_init(struct aesd_engine *engine, size_t max_bytes, unsigned int minor)
+{
+    memset(engine, 0, sizeof(struct aesd_engine));
+    aesd_circular_buffer_init(&engine->buffer);
+    aesd_engine_index_init(&engine->index);
+    engine->max_bytes = max_bytes;
+    engine->minor = minor;
+}
+
+
+/**
+ * Frees every entry held in the history of @param engine
+ */
+void aesd_engine_free(struct aesd_engine *engine)
+{
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &engine->buffer, index)
+    {
+        aesd_free(entry->buffptr);
+        entry->buffptr = NULL;
+        entry->size = 0;
+    }
+}
+
+
+/**
+ * @return the number of entries currently held in the history of @param engine
+ */
+uint32_t aesd_engine_count(const struct aesd_engine *engine)
+{
+    return aesd_circular_buffer_count(&engine->buffer);
+}
+
+
+/**
+ * Appends @param length bytes from @param data to the partial line kept in @param pending.
+ * A new line is allocated at its exact size, a line that keeps growing over several writes
+ * doubles its capacity so long lines are not copied over and over. Lines are allocated with
+ * kvmalloc which falls back to vmalloc for large lines instead of failing high order allocations.
+ * @return 0 on success, -ENOMEM if the line could not be grown
+ */
+int aesd_pending_append(struct aesd_pending *pending, const char *data, size_t length)
+{
+    struct aesd_buffer_entry *entry = &pending->entry;
+
+    if (entry->size + length > pending->capacity)
+    {
+        size_t capacity = length;
+        char *tmp;
+
+        if (entry->size)
+        {
+            capacity = entry->size + length;
+            if (capacity < 2 * pending->capacity)
+                capacity = 2 * pending->capacity;
+        }
+        tmp = aesd_alloc(capacity);
+        if (!tmp)
+            return -ENOMEM;
+
+        if (entry->size)
+            memcpy(tmp, entry->buffptr, entry->size);
+        aesd_free(entry->buffptr); /* free the old entry buffer */
+        entry->buffptr = tmp;
+        pending->capacity = capacity;
+    }
+
+    memcpy((char *)entry->buffptr + entry->size, data, length);
+    entry->size += length;
+    return 0;
+}
+
+
+/**
+ * Appends the data in @param data up to and including its first '\n' to @param pending, or
+ * all of it when there is none. The line is complete when aesd_pending_complete() is true.
+ * @return the number of bytes consumed, -ENOMEM if the line could not be grown
+ */
+ssize_t aesd_pending_feed(struct aesd_pending *pending, const char *data, size_t length)
+{
+    const char *newline = memchr(data, '\n', length);
+    size_t line_length = newline ? (size_t)(newline - data + 1) : length; /* include the '\n' */
+    int result = aesd_pending_append(pending, data, line_length);
+
+    return result ? result : (ssize_t)line_length;
+}
+
+
+/**
+ * Gives back the slack of a line in @param pending that was grown by doubling, before it is
+ * published. Done without dev->lock.
+ */
+void aesd_pending_trim(struct aesd_pending *pending)
+{
+    struct aesd_buffer_entry *entry = &pending->entry;
+
+    if (pending->capacity > entry->size + entry->size / 4)
+    {
+        char *tmp = aesd_alloc(entry->size);
+        if (tmp)
+        {
+            memcpy(tmp, entry->buffptr, entry->size);
+            aesd_free(entry->buffptr);
+            entry->buffptr = tmp;
+            pending->capacity = entry->size;
+        }
+    }
+}
+
+
+/**
+ * Called at the end of each write. Trailing '\0' bytes of a write are not part of the data, a
+ * partial line never ends in '\0' between writes so only bytes of this write are trimmed.
+ * An emptied line is freed.
+ */
+void aesd_pending_end_write(struct aesd_pending *pending)
+{
+    while (pending->entry.size > 0 && pending->entry.buffptr[pending->entry.size-1] == '\0')
+        pending->entry.size--;
+    if (pending->entry.size == 0 && pending->entry.buffptr)
+        aesd_pending_free(pending);
+}
+
+
+/**
+ * Frees the partial line in @param pending, if any
+ */
+void aesd_pending_free(struct aesd_pending *pending)
+{
+    aesd_free(pending->entry.buffptr);
+    pending->entry.buffptr = NULL;
+    pending->entry.size = 0;
+    pending->capacity = 0;
+}
+
+
+/**
+ * Drops the oldest entry of the history of @param engine and frees its memory.
+ * @return false if the history was already empty
+ */
+bool aesd_engine_evict_oldest(struct aesd_engine *engine)
+{
+    uint8_t index = engine->buffer.out_offs;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_remove_entry(&engine->buffer);
+
+    if (!entry)
+        return false;
+
+    aesd_engine_index_pop(&engine->index, NULL, NULL);
+    engine->bytes_used -= entry->size;
+    engine->evicted_bytes += entry->size;
+    engine->generation++;
+    engine->evicted_commit_ns = engine->stamp[index].commit_ns;
+    engine->evictions++;
+    trace_aesd_evict(engine->minor, engine->stamp[index].seq, entry->size);
+    aesd_free(entry->buffptr);
+    entry->buffptr = NULL;
+    entry->size = 0;
+    return true;
+}
+
+
+/**
+ * Evicts the oldest entries until the history of @param engine fits its byte budget, the
+ * newest entry is always kept even if it alone exceeds the budget.
+ * @return the number of entries evicted
+ */
+unsigned long aesd_engine_enforce_budget(struct aesd_engine *engine)
+{
+    unsigned long evicted = 0;
+
+    while (engine->max_bytes && engine->bytes_used > engine->max_bytes && aesd_engine_count(engine) > 1)
+    {
+        aesd_engine_evict_oldest(engine);
+        evicted++;
+    }
+    return evicted;
+}
+
+
+/**
+ * Adds the completed line held in @param pending to the history of @param engine, freeing
+ * the oldest line when it is overwritten. @param pending is reset for the next line.
+ * @return the entry of the line in the circular buffer
+ */
+const struct aesd_buffer_entry *aesd_engine_publish(struct aesd_engine *engine, struct aesd_pending *pending)
+{
+    struct aesd_circular_buffer *buffer = &engine->buffer;
+    struct aesd_buffer_entry *entry = &pending->entry;
+    uint8_t index;
+
+    /* when full, the slot at in_offs holds the oldest line which is about to be overwritten */
+    if (buffer->full)
+        aesd_engine_evict_oldest(engine);
+
+    index = buffer->in_offs;
+    engine->stamp[index].seq = engine->lines_committed;
+    engine->stamp[index].commit_ns = aesd_now_ns();
+    aesd_circular_buffer_add_entry(buffer, entry);
+    aesd_engine_index_push(&engine->index, entry->buffptr, entry->size, NULL);
+    engine->lines_committed++;
+    engine->bytes_used += entry->size;
+    aesd_engine_enforce_budget(engine);
+    trace_aesd_commit(engine->minor, engine->lines_committed - 1, entry->size, engine->bytes_used);
+    entry->buffptr = NULL;
+    entry->size = 0;
+    pending->capacity = 0;
+    return &buffer->entry[index];
+}
+
+
+/**
+ * Finds the entry holding @param pos, continuing from @param cursor when the last read
+ * stopped at @param pos and no entry was evicted since, so sequential reads don't search the
+ * index again. Appended lines don't move existing entries and keep the cursor valid.
+ * @return the entry with the offset of @param pos in @param entry_offset_byte_rtn, or NULL
+ */
+static struct aesd_buffer_entry *aesd_engine_cursor_find(struct aesd_engine *engine, struct aesd_read_cursor *cursor,
+                                                         int64_t pos, size_t *entry_offset_byte_rtn)
+{
+    int32_t ii;
+
+    if (cursor->valid && cursor->generation == engine->generation && cursor->pos == pos)
+    {
+        /* a cursor at the end of a full buffer aliases the oldest entry */
+        if (pos >= (int64_t)aesd_engine_size(engine))
+            return NULL;
+        *entry_offset_byte_rtn = cursor->offset;
+        return &engine->buffer.entry[cursor->index];
+    }
+
+    /* a binary search over the stream offsets instead of aesd_circular_buffer's walk */
+    ii = aesd_engine_index_find_offset(&engine->index, pos, entry_offset_byte_rtn);
+    if (ii < 0)
+        return NULL;
+    return &engine->buffer.entry[aesd_circular_buffer_advance(engine->buffer.out_offs, ii)];
+}
+
+
+/**
+ * Moves @param cursor past @param copied bytes read at @param offset of @param entry,
+ * stepping to the next entry once @param entry is exhausted.
+ * @return the entry to continue reading from, or NULL at the end of the history
+ */
+static struct aesd_buffer_entry *aesd_engine_cursor_advance(struct aesd_engine *engine, struct aesd_read_cursor *cursor,
+                                                            struct aesd_buffer_entry *entry, size_t *offset,
+                                                            size_t copied, int64_t pos)
+{
+    uint8_t index = entry - engine->buffer.entry;
+
+    *offset += copied;
+    if (*offset >= entry->size)
+    {
+        index = aesd_circular_buffer_next(index);
+        *offset = 0;
+    }
+
+    cursor->generation = engine->generation;
+    cursor->pos = pos;
+    cursor->offset = *offset;
+    cursor->index = index;
+    cursor->valid = true;
+
+    if (pos >= (int64_t)aesd_engine_size(engine))
+        return NULL;
+    return &engine->buffer.entry[index];
+}
+
+
+/**
+ * Reads up to @param count bytes of the history of @param engine at @param pos with
+ * @param copy, continuing from @param cursor and advancing @param pos past the data read.
+ * With AESD_FLAG_RECORD in @param flags only whole entries are read, preceded by their size
+ * with AESD_FLAG_RECORD_SIZES, and a @param pos inside an entry moves on to the next one.
+ * @return the number of bytes read, -EMSGSIZE if the next record doesn't fit in @param count,
+ *   -EOVERFLOW if its size prefix can't hold its size, -EFAULT if nothing could be copied
+ */
+ssize_t aesd_engine_read(struct aesd_engine *engine, struct aesd_read_cursor *cursor, int64_t *pos,
+                         size_t count, uint32_t flags, aesd_copy_fn copy, void *ctx)
+{
+    size_t offset = 0;
+    size_t total = 0;
+    ssize_t retval = 0;
+    struct aesd_buffer_entry *entry = aesd_engine_cursor_find(engine, cursor, *pos, &offset);
+
+    /* a record read after a seek into the middle of an entry starts at the next whole one */
+    if (entry != NULL && offset > 0 && (flags & AESD_FLAG_RECORD))
+    {
+        size_t skipped = entry->size - offset;
+
+        *pos += skipped;
+        entry = aesd_engine_cursor_advance(engine, cursor, entry, &offset, skipped, *pos);
+    }
+
+    while (entry != NULL && total < count)
+    {
+        size_t bytes_to_copy = entry->size - offset;
+
+        /* in record mode only whole entries are returned */
+        if (flags & AESD_FLAG_RECORD)
+        {
+            uint32_t record_size = bytes_to_copy;
+            size_t prefix = (flags & AESD_FLAG_RECORD_SIZES) ? sizeof(record_size) : 0;
+
+            /* the uint32_t prefix can't describe a larger entry, it is never returned truncated */
+            if (prefix && bytes_to_copy != (uint32_t)bytes_to_copy)
+            {
+                if (total == 0)
+                    retval = -EOVERFLOW;
+                break;
+            }
+            if (prefix + bytes_to_copy > count - total)
+            {
+                if (total == 0)
+                    retval = -EMSGSIZE; /* the buffer can't hold the next entry */
+                break;
+            }
+            /* a record copied in part is not returned, the next read starts at it again */
+            if ((prefix && copy(ctx, (const char *)&record_size, prefix) != prefix) ||
+                copy(ctx, entry->buffptr, bytes_to_copy) != bytes_to_copy)
+            {
+                if (total == 0)
+                    retval = -EFAULT;
+                break;
+            }
+            total += prefix + bytes_to_copy;
+            *pos += bytes_to_copy;
+            entry = aesd_engine_cursor_advance(engine, cursor, entry, &offset, bytes_to_copy, *pos);
+            continue;
+        }
+
+        if (bytes_to_copy + total > count)
+            bytes_to_copy = count - total;
+
+        size_t copied_bytes = copy(ctx, entry->buffptr + offset, bytes_to_copy);
+        total += copied_bytes;
+        *pos += copied_bytes;
+        if (copied_bytes != bytes_to_copy)
+        {
+            /* report the bytes copied so far, or a bad address if there were none */
+            if (total == 0)
+                retval = -EFAULT;
+            break;
+        }
+        entry = aesd_engine_cursor_advance(engine, cursor, entry, &offset, copied_bytes, *pos);
+    }
+
+    return retval ? retval : (ssize_t)total;
+}
+
+
+/**
+ * Computes in @param pos the position of byte @param write_cmd_offset of entry
+ * @param write_cmd, counted from the oldest entry in the history of @param engine.
+ * @return 0 on success, -EINVAL if there is no such entry or byte
+ */
+int aesd_engine_seekto(struct aesd_engine *engine, uint32_t write_cmd, uint32_t write_cmd_offset, int64_t *pos)
+{
+    const struct aesd_engine_index *index = &engine->index;
+    uint32_t slot;
+
+    if (write_cmd >= aesd_engine_count(engine))
+        return -EINVAL;
+
+    /* write_cmd counts from the oldest entry, whose stream offset is the position 0 */
+    slot = aesd_engine_index_slot(index, write_cmd);
+
+    /* the offset has to be within the write command */
+    if (write_cmd_offset >= index->size[slot])
+        return -EINVAL;
+
+    *pos = index->start[slot] - index->start[aesd_engine_index_slot(index, 0)] + write_cmd_offset;
+    return 0;
+}
+
+
+/**
+ * Finds the entry with the sequence number in @param seek, or the first entry committed at or
+ * after its time_ns when by_time is set, and fills in its seq, time_ns and f_pos.
+ * @return 0 on success, -ERANGE if the requested entry was already evicted,
+ *   -EINVAL if the sequence number was not committed yet
+ */
+int aesd_engine_seek_seq(struct aesd_engine *engine, struct aesd_seekseq *seek)
+{
+    uint32_t count = aesd_engine_count(engine);
+    uint64_t oldest_seq = engine->lines_committed - count;
+    uint64_t new_fpos = 0;
+    uint32_t ii;
+    uint8_t index;
+
+    if (seek->by_time)
+    {
+        /* anything at or before the newest evicted entry may be gone */
+        if (oldest_seq > 0 && seek->time_ns <= engine->evicted_commit_ns)
+            return -ERANGE;
+    }
+    else if (seek->seq < oldest_seq)
+        return -ERANGE;
+    else if (seek->seq > engine->lines_committed)
+        return -EINVAL;
+
+    index = engine->buffer.out_offs;
+    for (ii = 0; ii < count; ii++)
+    {
+        if (seek->by_time ? engine->stamp[index].commit_ns >= seek->time_ns : engine->stamp[index].seq == seek->seq)
+            break;
+        new_fpos += engine->buffer.entry[index].size;
+        index = aesd_circular_buffer_next(index);
+    }
+
+    /* ii == count is the end of the history */
+    seek->seq = (ii < count) ? engine->stamp[index].seq : engine->lines_committed;
+    seek->time_ns = (ii < count) ? engine->stamp[index].commit_ns : 0;
+    seek->f_pos = new_fpos;
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * aesd-engine.h
+ *
+ *  @brief Line assembly, history and read logic of the aesdchar driver. Like
+ *  aesd-circular-buffer.c it builds in the kernel module and in user space, where it can be
+ *  benchmarked and profiled without loading the module, see bench/.
+ *  None of these functions lock, the driver serializes access with dev->lock.
+ */
+
+#ifndef AESD_ENGINE_H
+#define AESD_ENGINE_H
+
+#include "aesd-circular-buffer.h"
+#include "aesd-ring.h"
+#include "aesd_ioctl.h"
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <sys/types.h> // ssize_t
+#endif
+
+struct aesd_pending
+{
+    struct aesd_buffer_entry entry; /* partial line, kvmalloc'ed */
+
+    size_t capacity; /* bytes allocated for entry.buffptr */
+};
+
+struct aesd_entry_stamp
+{
+    uint64_t seq; /* global sequence number, 0 for the first line ever committed */
+
+    uint64_t commit_ns; /* CLOCK_REALTIME of the commit in ns */
+};
+
+struct aesd_read_cursor
+{
+    uint64_t generation; /* engine->generation the cursor was taken at */
+
+    int64_t pos; /* file position the cursor describes */
+
+    size_t offset; /* offset of pos in buffer.entry[index] */
+
+    uint8_t index; /* entry holding pos, in_offs at the end of the history */
+
+    bool valid; /* false until the first read */
+};
+
+/* the smallest power of two holding AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries */
+#define AESD_ENGINE_INDEX_ORDER 4
+
+/*
+ * Offset index of the history, in step with buffer: live entry ii of the index is the entry
+ * ii places after buffer.out_offs. Its sizes and stream offsets are arrays of their own, so a
+ * position is found by a binary search that only touches the offsets instead of a walk over
+ * the entries, and a seek by entry is a subtraction.
+ */
+AESD_RING_DECLARE_SOA(aesd_engine_index, AESD_ENGINE_INDEX_ORDER)
+
+struct aesd_engine
+{
+    struct aesd_circular_buffer buffer; /* the circular buffer*/
+
+    struct aesd_entry_stamp stamp[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]; /* parallel to buffer.entry */
+
+    struct aesd_engine_index index; /* stream offsets of the entries, in step with buffer */
+
+    uint64_t lines_committed; /* number of complete lines added to buffer so far */
+
+    uint64_t evicted_bytes; /* number of bytes dropped from the start of the history so far */
+
+    uint64_t generation; /* bumped whenever an entry is evicted, invalidates read cursors */
+
+    uint64_t evicted_commit_ns; /* commit time of the newest entry evicted so far */
+
+    uint64_t evictions; /* lines dropped from the history to make room */
+
+    size_t bytes_used; /* bytes held in buffer, kept within max_bytes except for the newest entry */
+
+    size_t max_bytes; /* byte budget of the history, 0 for only the entry limit */
+
+    unsigned int minor; /* minor number of the device, for tracing */
+};
+
+/**
+ * Copies @param length bytes from @param src to the destination described by @param ctx,
+ * copy_to_iter in the driver, memcpy in user space.
+ * @return the number of bytes copied, less than @param length on a fault
+ */
+typedef size_t (*aesd_copy_fn)(void *ctx, const char *src, size_t length);
+
+extern void aesd_engine_init(struct aesd_engine *engine, size_t max_bytes, unsigned int minor);
+
+extern void aesd_engine_free(struct aesd_engine *engine);
+
+extern uint32_t aesd_engine_count(const struct aesd_engine *engine);
+
+extern int aesd_pending_append(struct aesd_pending *pending, const char *data, size_t length);
+
+extern ssize_t aesd_pending_feed(struct aesd_pending *pending, const char *data, size_t length);
+
+extern void aesd_pending_trim(struct aesd_pending *pending);
+
+extern void aesd_pending_end_write(struct aesd_pending *pending);
+
+extern void aesd_pending_free(struct aesd_pending *pending);
+
+extern bool aesd_engine_evict_oldest(struct aesd_engine *engine);
+
+extern unsigned long aesd_engine_enforce_budget(struct aesd_engine *engine);
+
+extern const struct aesd_buffer_entry *aesd_engine_publish(struct aesd_engine *engine, struct aesd_pending *pending);
+
+extern ssize_t aesd_engine_read(struct aesd_engine *engine, struct aesd_read_cursor *cursor, int64_t *pos,
+            size_t count, uint32_t flags, aesd_copy_fn copy, void *ctx);
+
+extern int aesd_engine_seekto(struct aesd_engine *engine, uint32_t write_cmd, uint32_t write_cmd_offset, int64_t *pos);
+
+extern int aesd_engine_seek_seq(struct aesd_engine *engine, struct aesd_seekseq *seek);
+
+/**
+ * @return the number of bytes currently held in the history of @param engine
+ */
+static inline size_t aesd_engine_size(const struct aesd_engine *engine)
+{
+    return engine->bytes_used;
+}
+
+/**
+ * @return true when the line in @param pending ends in '\n' and is ready to be published
+ */
+static inline bool aesd_pending_complete(const struct aesd_pending *pending)
+{
+    return pending->entry.size > 0 && pending->entry.buffptr[pending->entry.size - 1] == '\n';
+}
+
+#endif /* AESD_ENGINE_H */
@@ -0,0 +1,258 @@
+/*
+ * aesd-ring.h
+ *
+ *  @brief Type generic ring with a power of two capacity, generated by a macro for each element
+ *  type. The head and tail are free running counters so the ring needs no full flag, an index
+ *  is a mask away from its slot and the live entries are always tail .. head - 1.
+ *  Builds in the kernel and in user space, any necessary locking must be performed by caller.
+ *  aesdsocket's in-memory history (server/aesd_magic_ring.h) keeps its entry offsets in one,
+ *  through the copy in server/aesd-ring.h. Both copies must stay identical.
+ *
+ *  Example:
+ *  AESD_RING_DECLARE(line_ring, struct aesd_buffer_entry, 4)       // 16 entries
+ *  AESD_RING_DECLARE_FIND(line_ring, struct aesd_buffer_entry, size)
+ *
+ *  struct line_ring ring;
+ *  struct aesd_buffer_entry evicted, *entry;
+ *  uint32_t ii;
+ *  line_ring_init(&ring);
+ *  if (line_ring_push(&ring, &new_entry, &evicted))
+ *      free((void *)evicted.buffptr);
+ *  AESD_RING_FOREACH(entry, &ring, line_ring, ii)
+ *      printf("%.*s", (int)entry->size, entry->buffptr);
+ */
+
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/cache.h>
+#define AESD_RING_CACHE_ALIGNED ____cacheline_aligned
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#define AESD_RING_CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+
+/**
+ * Declares struct @param name holding up to 1 << @param order elements of @param type and its
+ * inline functions, all prefixed with @param name
+ */
+#define AESD_RING_DECLARE(name, type, order)                                            \
+struct name                                                                             \
+{                                                                                       \
+    type slot[1U << (order)];                                                           \
+    uint32_t head; /* number of elements pushed so far, the next slot is head & mask */ \
+    uint32_t tail; /* number of elements popped or overwritten so far */                \
+};                                                                                      \
+                                                                                        \
+static inline void name##_init(struct name *ring)                                       \
+{                                                                                       \
+    ring->head = 0;                                                                     \
+    ring->tail = 0;                                                                     \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_capacity(void)                                            \
+{                                                                                       \
+    return 1U << (order);                                                               \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_count(const struct name *ring)                            \
+{                                                                                       \
+    return ring->head - ring->tail;                                                     \
+}                                                                                       \
+                                                                                        \
+static inline bool name##_full(const struct name *ring)                                 \
+{                                                                                       \
+    return name##_count(ring) == (1U << (order));                                       \
+}                                                                                       \
+                                                                                        \
+/* the live element @param ii places after the oldest one, @param ii < count */        \
+static inline type *name##_at(struct name *ring, uint32_t ii)                           \
+{                                                                                       \
+    return &ring->slot[(ring->tail + ii) & ((1U << (order)) - 1)];                      \
+}                                                                                       \
+                                                                                        \
+/* adds @param item, overwriting the oldest element when full which is then copied to  \
+ * @param evicted if not NULL, returns true if an element was overwritten */           \
+static inline bool name##_push(struct name *ring, const type *item, type *evicted)      \
+{                                                                                       \
+    bool full = name##_full(ring);                                                      \
+                                                                                        \
+    if (full)                                                                           \
+    {                                                                                   \
+        if (evicted)                                                                    \
+            *evicted = *name##_at(ring, 0);                                             \
+        ring->tail++;                                                                   \
+    }                                                                                   \
+    ring->slot[ring->head & ((1U << (order)) - 1)] = *item;                             \
+    ring->head++;                                                                       \
+    return full;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* removes the oldest element into @param item if not NULL, false if empty */          \
+static inline bool name##_pop(struct name *ring, type *item)                            \
+{                                                                                       \
+    if (ring->head == ring->tail)                                                       \
+        return false;                                                                   \
+    if (item)                                                                           \
+        *item = *name##_at(ring, 0);                                                    \
+    ring->tail++;                                                                       \
+    return true;                                                                        \
+}
+
+/**
+ * Declares @param name _find_offset() for a ring of @param type elements whose length is in
+ * @param size_member, the equivalent of aesd_circular_buffer_find_entry_offset_for_fpos()
+ */
+#define AESD_RING_DECLARE_FIND(name, type, size_member)                                 \
+static inline type *name##_find_offset(struct name *ring, size_t char_offset,           \
+                                       size_t *entry_offset_byte_rtn)                   \
+{                                                                                       \
+    uint32_t count = name##_count(ring);                                                \
+    uint32_t ii;                                                                        \
+                                                                                        \
+    for (ii = 0; ii < count; ii++)                                                      \
+    {                                                                                   \
+        type *item = name##_at(ring, ii);                                               \
+        if (char_offset < item->size_member)                                            \
+        {                                                                               \
+            *entry_offset_byte_rtn = char_offset;                                       \
+            return item;                                                                \
+        }                                                                               \
+        char_offset -= item->size_member;                                               \
+    }                                                                                   \
+    return NULL;                                                                        \
+}
+
+/**
+ * Iterates @param ptr over the live elements of @param ring, a struct @param name, from the
+ * oldest to the newest, @param ii is a uint32_t used as the index
+ */
+#define AESD_RING_FOREACH(ptr, ring, name, ii) \
+    for ((ii) = 0; (ii) < name##_count(ring) && (((ptr) = name##_at((ring), (ii))), 1); (ii)++)
+
+/**
+ * Declares struct @param name, a ring of 1 << @param order buffptr/size entries kept as a
+ * structure of arrays, and its inline functions, all prefixed with @param name.
+ * The sizes and the stream offset of every entry are contiguous arrays of their own, apart from
+ * the pointers, so offset lookups and size sums only pull in the lines they need, and offset
+ * lookups are a binary search over the stream offsets instead of a walk.
+ * head and tail sit on their own cache lines so a producer and a consumer don't false share.
+ * Slot ii of the live entries is name_slot(ring, ii) in the ptr, size and start arrays.
+ */
+#define AESD_RING_DECLARE_SOA(name, order)                                              \
+struct name                                                                             \
+{                                                                                       \
+    uint32_t head AESD_RING_CACHE_ALIGNED; /* number of entries pushed so far */        \
+    uint64_t end; /* stream offset past the newest entry */                             \
+    uint32_t tail AESD_RING_CACHE_ALIGNED; /* number of entries popped or overwritten */\
+    size_t size[1U << (order)] AESD_RING_CACHE_ALIGNED;                                 \
+    uint64_t start[1U << (order)] AESD_RING_CACHE_ALIGNED; /* stream offset of entry */ \
+    const char *ptr[1U << (order)] AESD_RING_CACHE_ALIGNED;                             \
+};                                                                                      \
+                                                                                        \
+static inline void name##_init(struct name *ring)                                       \
+{                                                                                       \
+    ring->head = 0;                                                                     \
+    ring->tail = 0;                                                                     \
+    ring->end = 0;                                                                      \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_capacity(void)                                            \
+{                                                                                       \
+    return 1U << (order);                                                               \
+}                                                                                       \
+                                                                                        \
+static inline uint32_t name##_count(const struct name *ring)                            \
+{                                                                                       \
+    return ring->head - ring->tail;                                                     \
+}                                                                                       \
+                                                                                        \
+static inline bool name##_full(const struct name *ring)                                 \
+{                                                                                       \
+    return name##_count(ring) == (1U << (order));                                       \
+}                                                                                       \
+                                                                                        \
+/* the array index of the live entry @param ii places after the oldest one */          \
+static inline uint32_t name##_slot(const struct name *ring, uint32_t ii)                \
+{                                                                                       \
+    return (ring->tail + ii) & ((1U << (order)) - 1);                                   \
+}                                                                                       \
+                                                                                        \
+/* total size of the live entries, without walking them */                             \
+static inline uint64_t name##_bytes(const struct name *ring)                            \
+{                                                                                       \
+    if (ring->head == ring->tail)                                                       \
+        return 0;                                                                       \
+    return ring->end - ring->start[name##_slot(ring, 0)];                               \
+}                                                                                       \
+                                                                                        \
+/* adds @param buffptr of @param size bytes, overwriting the oldest entry when full     \
+ * whose buffptr is then stored in @param evicted if not NULL, returns true if an      \
+ * entry was overwritten */                                                            \
+static inline bool name##_push(struct name *ring, const char *buffptr, size_t size,     \
+                               const char **evicted)                                    \
+{                                                                                       \
+    uint32_t slot = ring->head & ((1U << (order)) - 1);                                 \
+    bool full = name##_full(ring);                                                      \
+                                                                                        \
+    if (full)                                                                           \
+    {                                                                                   \
+        if (evicted)                                                                    \
+            *evicted = ring->ptr[slot];                                                 \
+        ring->tail++;                                                                   \
+    }                                                                                   \
+    ring->ptr[slot] = buffptr;                                                          \
+    ring->size[slot] = size;                                                            \
+    ring->start[slot] = ring->end;                                                      \
+    ring->end += size;                                                                  \
+    ring->head++;                                                                       \
+    return full;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* removes the oldest entry into @param buffptr and @param size if not NULL,            \
+ * false if empty */                                                                   \
+static inline bool name##_pop(struct name *ring, const char **buffptr, size_t *size)    \
+{                                                                                       \
+    uint32_t slot = name##_slot(ring, 0);                                               \
+                                                                                        \
+    if (ring->head == ring->tail)                                                       \
+        return false;                                                                   \
+    if (buffptr)                                                                        \
+        *buffptr = ring->ptr[slot];                                                     \
+    if (size)                                                                           \
+        *size = ring->size[slot];                                                       \
+    ring->tail++;                                                                       \
+    return true;                                                                        \
+}                                                                                       \
+                                                                                        \
+/* the equivalent of aesd_circular_buffer_find_entry_offset_for_fpos(), returns the     \
+ * live index of the entry holding @param char_offset, counted from the oldest entry,  \
+ * with the offset within it in @param entry_offset_byte_rtn, or -1 */                 \
+static inline int32_t name##_find_offset(const struct name *ring, uint64_t char_offset, \
+                                         size_t *entry_offset_byte_rtn)                 \
+{                                                                                       \
+    uint32_t lo = 0;                                                                    \
+    uint32_t hi = name##_count(ring);                                                   \
+    uint64_t target;                                                                    \
+                                                                                        \
+    if (char_offset >= name##_bytes(ring))                                              \
+        return -1;                                                                      \
+    target = ring->start[name##_slot(ring, 0)] + char_offset;                           \
+    /* the last entry starting at or before target, start[] grows with the index */    \
+    while (hi - lo > 1)                                                                 \
+    {                                                                                   \
+        uint32_t mid = lo + (hi - lo) / 2;                                              \
+        if (ring->start[name##_slot(ring, mid)] <= target)                              \
+            lo = mid;                                                                   \
+        else                                                                            \
+            hi = mid;                                                                   \
+    }                                                                                   \
+    *entry_offset_byte_rtn = target - ring->start[name##_slot(ring, lo)];               \
+    return lo;                                                                          \
+}
+
+#endif /* AESD_RING_H */
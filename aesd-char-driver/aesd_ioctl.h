@@ -33,14 +33,162 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Layout of the first page of an mmap of the aesdchar device. The history ring follows the
+ * header page and may be mapped twice back to back (a mapping of one page + 2 * data_size bytes),
+ * so any window of the history is contiguous in memory starting one page + (start % data_size)
+ * into the mapping.
+ */
+struct aesd_mmap_header {
+    /**
+     * Incremented before and after every update, odd while an update is in progress.
+     * Readers should retry when it is odd or changed while they were copying.
+     */
+    uint32_t seq;
+    /**
+     * Size in bytes of the history ring, always a power of two
+     */
+    uint32_t data_size;
+    /**
+     * Running byte offset of the first byte of the current history, this is file position 0
+     * unless the history is larger than data_size
+     */
+    uint64_t start;
+    /**
+     * Running byte offset one past the last committed byte
+     */
+    uint64_t end;
+};
+
+/**
+ * Maximum number of entries held by an aesdchar device, equal to
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED in the driver
+ */
+#define AESD_ENTRY_TABLE_MAX 10
+
+/**
+ * Filled by AESDCHAR_IOCGENTRIES with the layout of the current history in one call
+ */
+struct aesd_entry_table {
+    /**
+     * Number of entries currently in the history
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Global sequence number of the oldest entry, the first line ever written is 0 and
+     * the newest entry is oldest_seq + count - 1
+     */
+    uint64_t oldest_seq;
+    /**
+     * Size in bytes of each entry, oldest first
+     */
+    uint64_t size[AESD_ENTRY_TABLE_MAX];
+    /**
+     * File position of the first byte of each entry, oldest first
+     */
+    uint64_t offset[AESD_ENTRY_TABLE_MAX];
+};
+
+/**
+ * Passed to AESDCHAR_IOCREADENTRIES to read a range of whole entries in one call
+ */
+struct aesd_read_entries {
+    /**
+     * Sequence number of the first entry to read, the call fails with ERANGE if it was evicted
+     */
+    uint64_t first_seq;
+    /**
+     * User space address of a struct iovec array, entries are copied back to back into it
+     */
+    uint64_t iov;
+    /**
+     * Number of elements in the iov array
+     */
+    uint32_t iovcnt;
+    /**
+     * Maximum number of entries to read
+     */
+    uint32_t count;
+    /**
+     * Set by the driver to the number of entries copied, an entry that does not fit
+     * completely in the remaining iovec space is not copied
+     */
+    uint32_t entries_read;
+    uint32_t reserved;
+    /**
+     * Set by the driver to the number of bytes copied
+     */
+    uint64_t bytes_read;
+};
+
+/**
+ * Passed to AESDCHAR_IOCSEEKSEQ to move the file position to the start of an entry identified
+ * by its global sequence number or by its commit time, which unlike struct aesd_seekto stay
+ * valid when older entries are evicted
+ */
+struct aesd_seekseq {
+    /**
+     * 0 to seek to the entry numbered seq, 1 to seek to the first entry committed at or after time_ns
+     */
+    uint32_t by_time;
+    uint32_t reserved;
+    /**
+     * Sequence number to seek to, seeking to the next sequence number to be committed positions
+     * the file at the end of the history. Set by the driver to the sequence number found.
+     */
+    uint64_t seq;
+    /**
+     * CLOCK_REALTIME in nanoseconds to seek to. Set by the driver to the commit time of the
+     * entry found, 0 when positioned at the end of the history.
+     */
+    uint64_t time_ns;
+    /**
+     * Set by the driver to the new file position
+     */
+    uint64_t f_pos;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+
+/**
+ * Flags for AESDCHAR_IOCSETFLAGS, they apply to the open file they are set on
+ */
+/**
+ * Tail mode: read() at the end of the history sleeps until the next complete line is
+ * committed instead of returning 0, or returns -EAGAIN if the file is O_NONBLOCK.
+ * The file position follows its data when old lines are dropped from the history.
+ */
+#define AESD_FLAG_TAIL (1 << 0)
+/**
+ * Record mode: read() returns whole entries only, as many as fit in the buffer, and fails with
+ * EMSGSIZE if the first one doesn't fit. A read from a position inside an entry starts at the
+ * next entry, and an entry that can't be copied whole is left for the next read.
+ */
+#define AESD_FLAG_RECORD (1 << 1)
+/**
+ * With AESD_FLAG_RECORD, each entry is preceded by its size as a native endian uint32_t so
+ * clients don't have to parse the data. The size prefix doesn't move the file position.
+ * Entries of UINT32_MAX bytes or less can be read this way, read() fails with EOVERFLOW
+ * when the next entry is larger.
+ */
+#define AESD_FLAG_RECORD_SIZES (1 << 2)
+
+// Set the AESD_FLAG_* flags of an open file, use command number 2
+#define AESDCHAR_IOCSETFLAGS _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Get the entry count, sizes, offsets and oldest sequence number, use command number 3
+#define AESDCHAR_IOCGENTRIES _IOR(AESD_IOC_MAGIC, 3, struct aesd_entry_table)
+// Read whole entries into an iovec array, use command number 4
+#define AESDCHAR_IOCREADENTRIES _IOWR(AESD_IOC_MAGIC, 4, struct aesd_read_entries)
+// Seek by sequence number or commit time, fails with ERANGE if the entry was evicted, use command number 5
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 5, struct aesd_seekseq)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
@@ -8,16 +8,19 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#include "aesd-circular-buffer.h"
+#include "aesd-engine.h"
+#include "aesd_ioctl.h"
 
 #ifdef __KERNEL__
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/device.h>
 #else
 #include <stdio.h>
 #endif
 
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with make DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -32,6 +35,17 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+struct aesd_stats
+{
+    uint64_t bytes_written; /* bytes accepted by write() */
+
+    uint64_t bytes_read; /* bytes returned by read() */
+
+    uint64_t lock_contended; /* lock acquisitions that had to wait */
+
+    uint64_t lock_wait_ns; /* total time spent waiting for the lock */
+};
+
 struct aesd_dev
 {
     /**
@@ -41,9 +55,40 @@ struct aesd_dev
 
     struct mutex lock; /* lock */
 
-    struct aesd_circular_buffer buffer; /* the circular buffer*/
+    struct aesd_engine engine; /* the history and its circular buffer */
+
+    struct aesd_pending carry; /* partial line left by a closed file, continued by the next writer */
+
+    void *mmap_area; /* header page followed by the history ring, see struct aesd_mmap_header */
+
+    struct aesd_mmap_header *mmap_header; /* first page of mmap_area */
+
+    char *mmap_data; /* history ring of mmap_pages pages, mirrors the circular buffer */
+
+    unsigned long mmap_pages; /* size of mmap_data in pages, a power of two */
+
+    wait_queue_head_t readq; /* tail readers waiting for the next complete line */
+
+    struct aesd_stats stats; /* protected by lock */
+
+    struct device *device; /* sysfs device exposing usage */
+
+    struct dentry *debugfs_dir; /* debugfs directory exposing stats */
+};
+
+struct aesd_file
+{
+    struct aesd_dev *dev; /* device this file was opened on */
+
+    uint32_t flags; /* AESD_FLAG_* set with AESDCHAR_IOCSETFLAGS */
+
+    uint64_t evicted_bytes; /* dev->engine.evicted_bytes when f_pos was last rebased, tail mode only */
+
+    struct mutex write_lock; /* serializes writers sharing this file */
+
+    struct aesd_pending pending; /* keep value until '/n', assembled without dev->lock */
 
-    struct aesd_buffer_entry entry; /* keep value until '/n' */
+    struct aesd_read_cursor cursor; /* where the last read stopped, protected by dev->lock */
 };
 
 
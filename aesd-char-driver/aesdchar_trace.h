@@ -0,0 +1,99 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints on the aesdchar hot paths, they cost a static branch when disabled.
+ *  Enable with: echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* a complete line was added to the history */
+TRACE_EVENT(aesd_commit,
+    TP_PROTO(int minor, u64 seq, size_t size, size_t bytes_used),
+    TP_ARGS(minor, seq, size, bytes_used),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u64, seq)
+        __field(size_t, size)
+        __field(size_t, bytes_used)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+        __entry->bytes_used = bytes_used;
+    ),
+    TP_printk("minor=%d seq=%llu size=%zu bytes_used=%zu",
+        __entry->minor, __entry->seq, __entry->size, __entry->bytes_used)
+);
+
+/* the oldest line was dropped from the history */
+TRACE_EVENT(aesd_evict,
+    TP_PROTO(int minor, u64 seq, size_t size),
+    TP_ARGS(minor, seq, size),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u64, seq)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+    TP_printk("minor=%d seq=%llu size=%zu",
+        __entry->minor, __entry->seq, __entry->size)
+);
+
+/* a read returned, copied may be a negative error */
+TRACE_EVENT(aesd_read,
+    TP_PROTO(int minor, loff_t pos, size_t count, ssize_t copied),
+    TP_ARGS(minor, pos, count, copied),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, copied)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->copied = copied;
+    ),
+    TP_printk("minor=%d pos=%lld count=%zu copied=%zd",
+        __entry->minor, __entry->pos, __entry->count, __entry->copied)
+);
+
+/* the file position was moved by llseek or one of the seek ioctls */
+TRACE_EVENT(aesd_seek,
+    TP_PROTO(int minor, unsigned int cmd, loff_t pos),
+    TP_ARGS(minor, cmd, pos),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, cmd)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->cmd = cmd;
+        __entry->pos = pos;
+    ),
+    TP_printk("minor=%d cmd=%#x pos=%lld",
+        __entry->minor, __entry->cmd, __entry->pos)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
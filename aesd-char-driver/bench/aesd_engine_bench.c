@@ -0,0 +1,492 @@
+/**
+ * @file aesd_engine_bench.c
+ * @brief Drives the aesdchar engine in user space with writes, reads and seeks, so the driver
+ * logic can be timed and profiled with perf or valgrind without loading the module.
+ *
+ * Lines follow a log-like length distribution, mostly short with a tail of large lines, and
+ * are written in a mix of small fragments, single lines and large batches, the way echo, dd
+ * and aesdsocket write to the device. The history is read back and checked against the lines
+ * written, so the benchmark fails when the engine breaks.
+ *
+ * Usage: aesd-engine-bench [-n lines] [-r read passes] [-k seeks] [-b max bytes] [-s seed]
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "aesd-engine.h"
+
+#define WRITE_MAX (64 * 1024) /* largest single write, the driver copies in chunks of this size */
+#define LINE_MAX_LENGTH (1024 * 1024) /* largest line generated */
+/* copies of the newest lines, one more than the history for the line being generated */
+#define TAIL_LINES (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 1)
+
+struct line_source
+{
+    uint64_t rng; /* xorshift64 state */
+
+    uint64_t line; /* number of the line being generated */
+
+    size_t length; /* length of the current line including its '\n' */
+
+    size_t done; /* bytes of the current line generated so far */
+
+    char *tail[TAIL_LINES]; /* copies of the newest lines */
+
+    size_t tail_size[TAIL_LINES];
+};
+
+struct copy_buffer
+{
+    char *data;
+
+    size_t used;
+};
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t next_random(struct line_source *src)
+{
+    src->rng ^= src->rng << 13;
+    src->rng ^= src->rng >> 7;
+    src->rng ^= src->rng << 17;
+    return src->rng;
+}
+
+
+/* random value in [low, high] */
+static size_t random_range(struct line_source *src, size_t low, size_t high)
+{
+    return low + next_random(src) % (high - low + 1);
+}
+
+
+/**
+ * Picks the length of the next line: 70% short log lines, 25% up to 1 KiB,
+ * 5% up to 16 KiB and one in a thousand between 64 KiB and 1 MiB
+ */
+static size_t next_line_length(struct line_source *src)
+{
+    unsigned int pick = next_random(src) % 1000;
+
+    if (pick < 700)
+        return random_range(src, 20, 120);
+    if (pick < 950)
+        return random_range(src, 121, 1024);
+    if (pick < 999)
+        return random_range(src, 1025, 16 * 1024);
+    return random_range(src, 64 * 1024, LINE_MAX_LENGTH);
+}
+
+
+/**
+ * Fills @param buf with the next @param length bytes of the line stream and keeps a copy of
+ * the newest lines for checking the history
+ */
+static void fill_lines(struct line_source *src, char *buf, size_t length)
+{
+    size_t ii;
+
+    for (ii = 0; ii < length; ii++)
+    {
+        unsigned int slot = src->line % TAIL_LINES;
+
+        if (src->done == 0)
+        {
+            src->length = next_line_length(src);
+            src->tail[slot] = realloc(src->tail[slot], src->length);
+            src->tail_size[slot] = src->length;
+            if (!src->tail[slot])
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        if (src->done + 1 == src->length)
+            buf[ii] = '\n';
+        else
+            buf[ii] = 'a' + (src->line + src->done) % 26;
+        src->tail[slot][src->done] = buf[ii];
+
+        if (++src->done == src->length)
+        {
+            src->done = 0;
+            src->line++;
+        }
+    }
+}
+
+
+/* aesd_copy_fn into a struct copy_buffer */
+static size_t copy_to_buffer(void *ctx, const char *src, size_t length)
+{
+    struct copy_buffer *dst = ctx;
+
+    memcpy(dst->data + dst->used, src, length);
+    dst->used += length;
+    return length;
+}
+
+
+struct budget_buffer
+{
+    struct copy_buffer buffer;
+
+    size_t budget; /* bytes copied before the copy faults */
+};
+
+
+/* aesd_copy_fn into a struct budget_buffer, copying short like copy_to_iter on a bad address */
+static size_t copy_with_budget(void *ctx, const char *src, size_t length)
+{
+    struct budget_buffer *dst = ctx;
+    size_t copied = length < dst->budget ? length : dst->budget;
+
+    copy_to_buffer(&dst->buffer, src, copied);
+    dst->budget -= copied;
+    return copied;
+}
+
+
+/**
+ * Writes @param length bytes of @param data the way aesd_write_iter does, publishing each
+ * completed line
+ * @return the number of lines published
+ */
+static unsigned long engine_write(struct aesd_engine *engine, struct aesd_pending *pending, const char *data, size_t length)
+{
+    unsigned long published = 0;
+    const char *ptr = data;
+    const char *end_ptr = data + length;
+
+    while (ptr < end_ptr)
+    {
+        ssize_t line_length = aesd_pending_feed(pending, ptr, end_ptr - ptr);
+        if (line_length < 0)
+        {
+            fprintf(stderr, "aesd_pending_feed: %s\n", strerror(-line_length));
+            exit(1);
+        }
+        if (aesd_pending_complete(pending))
+        {
+            aesd_pending_trim(pending);
+            aesd_engine_publish(engine, pending);
+            published++;
+        }
+        ptr += line_length;
+    }
+    aesd_pending_end_write(pending);
+    return published;
+}
+
+
+/**
+ * Picks the size of the next write: 30% fragments of up to 16 bytes, 40% single line sized
+ * writes and 30% batches of up to WRITE_MAX bytes
+ */
+static size_t next_write_size(struct line_source *src)
+{
+    unsigned int pick = next_random(src) % 10;
+
+    if (pick < 3)
+        return random_range(src, 1, 16);
+    if (pick < 7)
+        return random_range(src, 64, 512);
+    return random_range(src, 4096, WRITE_MAX);
+}
+
+
+/**
+ * Reads the whole history from position 0 with reads of @param read_size bytes
+ * @return the number of read calls
+ */
+static unsigned long engine_read_all(struct aesd_engine *engine, struct copy_buffer *out, size_t read_size, uint32_t flags)
+{
+    struct aesd_read_cursor cursor;
+    unsigned long calls = 0;
+    int64_t pos = 0;
+    ssize_t result;
+
+    memset(&cursor, 0, sizeof(cursor));
+    out->used = 0;
+    do {
+        result = aesd_engine_read(engine, &cursor, &pos, read_size, flags, copy_to_buffer, out);
+        calls++;
+    } while (result > 0);
+
+    if (result < 0)
+    {
+        fprintf(stderr, "aesd_engine_read: %s\n", strerror(-result));
+        exit(1);
+    }
+    return calls;
+}
+
+
+/**
+ * @return 0 when the data in @param out is the history expected from @param src
+ */
+static int check_history(struct aesd_engine *engine, struct line_source *src, const struct copy_buffer *out)
+{
+    uint32_t count = aesd_engine_count(engine);
+    size_t offset = 0;
+    uint64_t line;
+
+    if (out->used != aesd_engine_size(engine))
+    {
+        fprintf(stderr, "read %zu bytes, history holds %zu\n", out->used, aesd_engine_size(engine));
+        return -1;
+    }
+    for (line = src->line - count; line < src->line; line++)
+    {
+        unsigned int slot = line % TAIL_LINES;
+
+        if (offset + src->tail_size[slot] > out->used ||
+            memcmp(out->data + offset, src->tail[slot], src->tail_size[slot]) != 0)
+        {
+            fprintf(stderr, "line %llu does not match at offset %zu\n", (unsigned long long)line, offset);
+            return -1;
+        }
+        offset += src->tail_size[slot];
+    }
+    return 0;
+}
+
+
+/**
+ * Checks record reads of the two oldest entries of @param engine: a read from inside the oldest
+ * starts at the second, and a read that faults in the second returns only the oldest and
+ * leaves the position at the second
+ * @return 0 when record reads behave
+ */
+static int check_record_reads(struct aesd_engine *engine, char *data)
+{
+    const uint32_t flags = AESD_FLAG_RECORD | AESD_FLAG_RECORD_SIZES;
+    const struct aesd_buffer_entry *oldest = &engine->buffer.entry[engine->buffer.out_offs];
+    const struct aesd_buffer_entry *second = &engine->buffer.entry[aesd_circular_buffer_next(engine->buffer.out_offs)];
+    struct budget_buffer out = { { data, 0 }, SIZE_MAX };
+    struct aesd_read_cursor cursor;
+    uint32_t record_size;
+    int64_t pos = oldest->size - 1;
+    ssize_t result;
+    size_t fault;
+
+    memset(&cursor, 0, sizeof(cursor));
+    result = aesd_engine_read(engine, &cursor, &pos, LINE_MAX_LENGTH, flags, copy_with_budget, &out);
+    memcpy(&record_size, data, sizeof(record_size));
+    if (result < (ssize_t)(sizeof(record_size) + second->size) || record_size != second->size ||
+        memcmp(data + sizeof(record_size), second->buffptr, second->size) != 0)
+    {
+        fprintf(stderr, "record read inside an entry did not start at the next one\n");
+        return -1;
+    }
+
+    /* faults in the size prefix and in the data of the second record */
+    for (fault = 2; fault <= sizeof(record_size); fault += 2)
+    {
+        memset(&cursor, 0, sizeof(cursor));
+        pos = 0;
+        out.buffer.used = 0;
+        out.budget = sizeof(record_size) + oldest->size + fault;
+        result = aesd_engine_read(engine, &cursor, &pos, LINE_MAX_LENGTH, flags, copy_with_budget, &out);
+        if (result != (ssize_t)(sizeof(record_size) + oldest->size) || pos != (int64_t)oldest->size)
+        {
+            fprintf(stderr, "record read faulting %zu bytes into a record returned %zd at %lld\n", fault,
+                    result, (long long)pos);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void report(const char *phase, unsigned long ops, const char *unit, uint64_t bytes, uint64_t elapsed_ns)
+{
+    if (elapsed_ns == 0)
+        elapsed_ns = 1;
+    printf("%-14s %10lu %-6s %12llu bytes %10.3f ms %10.1f ns/%s %9.1f MB/s\n", phase, ops, unit,
+           (unsigned long long)bytes, elapsed_ns / 1e6, (double)elapsed_ns / (ops ? ops : 1), unit,
+           bytes * 1e3 / elapsed_ns);
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long lines = 200000;
+    unsigned long passes = 200;
+    unsigned long seeks = 1000000;
+    size_t max_bytes = 4 << 20;
+    struct line_source src;
+    struct aesd_engine engine;
+    struct aesd_pending pending;
+    struct copy_buffer out;
+    char *write_buffer;
+    uint64_t start;
+    uint64_t bytes;
+    unsigned long ops;
+    unsigned long ii;
+    int opt;
+
+    memset(&src, 0, sizeof(src));
+    src.rng = 0x9e3779b97f4a7c15ULL;
+
+    while ((opt = getopt(argc, argv, "n:r:k:b:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                lines = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                passes = strtoul(optarg, NULL, 0);
+                break;
+            case 'k':
+                seeks = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                max_bytes = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                src.rng = strtoull(optarg, NULL, 0) | 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n lines] [-r read passes] [-k seeks] [-b max bytes] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    aesd_engine_init(&engine, max_bytes, 0);
+    memset(&pending, 0, sizeof(pending));
+    write_buffer = malloc(WRITE_MAX);
+    /* the newest line is kept even when it alone exceeds the budget */
+    size_t out_size = max_bytes ? max_bytes + LINE_MAX_LENGTH : AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * LINE_MAX_LENGTH;
+    out.data = malloc(out_size);
+    if (!write_buffer || !out.data)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    /* writes, generating the data is not timed */
+    uint64_t elapsed = 0;
+    ops = 0;
+    bytes = 0;
+    while (src.line < lines)
+    {
+        size_t length = next_write_size(&src);
+
+        fill_lines(&src, write_buffer, length);
+        start = now_ns();
+        engine_write(&engine, &pending, write_buffer, length);
+        elapsed += now_ns() - start;
+        ops++;
+        bytes += length;
+    }
+    report("write", ops, "write", bytes, elapsed);
+    printf("%-14s %10llu lines, %llu evicted, %u in history, %zu bytes\n", "history",
+           (unsigned long long)engine.lines_committed, (unsigned long long)engine.evictions,
+           aesd_engine_count(&engine), aesd_engine_size(&engine));
+
+    /* reads of the whole history, byte at a time like dd bs=1, then page sized and in records */
+    static const struct {
+        const char *name;
+        size_t size;
+        uint32_t flags;
+    } reads[] = {
+        { "read bs=1", 1, 0 },
+        { "read bs=4096", 4096, 0 },
+        { "read records", LINE_MAX_LENGTH, AESD_FLAG_RECORD },
+    };
+    for (ii = 0; ii < sizeof(reads) / sizeof(reads[0]); ii++)
+    {
+        unsigned long pass;
+        unsigned long pass_count = reads[ii].size == 1 ? (passes + 9) / 10 : passes;
+
+        ops = 0;
+        bytes = 0;
+        start = now_ns();
+        for (pass = 0; pass < pass_count; pass++)
+        {
+            ops += engine_read_all(&engine, &out, reads[ii].size, reads[ii].flags);
+            bytes += out.used;
+        }
+        report(reads[ii].name, ops, "read", bytes, now_ns() - start);
+        if (check_history(&engine, &src, &out))
+            return 1;
+    }
+
+    /* seeks by entry and offset as AESDCHAR_IOCSEEKTO, each followed by a short read */
+    uint32_t count = aesd_engine_count(&engine);
+    if (count > 1 && check_record_reads(&engine, out.data))
+        return 1;
+    struct copy_buffer peek = { out.data, 0 };
+    ops = 0;
+    start = now_ns();
+    for (ii = 0; ii < seeks && count; ii++)
+    {
+        uint32_t write_cmd = next_random(&src) % count;
+        uint8_t index = aesd_circular_buffer_advance(engine.buffer.out_offs, write_cmd);
+        uint32_t offset = next_random(&src) % engine.buffer.entry[index].size;
+        struct aesd_read_cursor cursor;
+        int64_t pos;
+
+        if (aesd_engine_seekto(&engine, write_cmd, offset, &pos))
+        {
+            fprintf(stderr, "seekto %u %u failed\n", write_cmd, offset);
+            return 1;
+        }
+        memset(&cursor, 0, sizeof(cursor));
+        peek.used = 0;
+        aesd_engine_read(&engine, &cursor, &pos, 64, 0, copy_to_buffer, &peek);
+        if (peek.data[0] != engine.buffer.entry[index].buffptr[offset])
+        {
+            fprintf(stderr, "seekto %u %u read the wrong byte\n", write_cmd, offset);
+            return 1;
+        }
+        ops++;
+    }
+    report("seekto", ops, "seek", 0, now_ns() - start);
+
+    /* seeks by sequence number as AESDCHAR_IOCSEEKSEQ */
+    ops = 0;
+    start = now_ns();
+    for (ii = 0; ii < seeks && count; ii++)
+    {
+        struct aesd_seekseq seek;
+        uint64_t seq = engine.lines_committed - count + next_random(&src) % count;
+
+        memset(&seek, 0, sizeof(seek));
+        seek.seq = seq;
+        if (aesd_engine_seek_seq(&engine, &seek) || seek.seq != seq)
+        {
+            fprintf(stderr, "seek to seq %llu failed\n", (unsigned long long)seq);
+            return 1;
+        }
+        ops++;
+    }
+    report("seekseq", ops, "seek", 0, now_ns() - start);
+
+    aesd_pending_free(&pending);
+    aesd_engine_free(&engine);
+    for (ii = 0; ii < TAIL_LINES; ii++)
+        free(src.tail[ii]);
+    free(write_buffer);
+    free(out.data);
+    return 0;
+}
@@ -0,0 +1,350 @@
+/**
+ * @file aesd_ring_bench.c
+ * @brief Compares the generic power of two ring in aesd-ring.h with aesd_circular_buffer and
+ * with the modulo indexing aesd_circular_buffer used before, on adds that overwrite the oldest
+ * entry, offset lookups and iterations over the live entries. Also compares batch adds and range
+ * lookups of aesd_circular_buffer with the same work done one entry at a time.
+ *
+ * Usage: aesd-ring-bench [-i iterations]
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-ring.h"
+
+/* 16 entries, the power of two above AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED */
+AESD_RING_DECLARE(entry_ring, struct aesd_buffer_entry, 4)
+AESD_RING_DECLARE_FIND(entry_ring, struct aesd_buffer_entry, size)
+
+/* sink for results so the compiler keeps the loops */
+static volatile size_t sink;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+
+/**
+ * aesd_circular_buffer_find_entry_offset_for_fpos as it was with a modulo per step
+ */
+static struct aesd_buffer_entry *modulo_find(struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint8_t index = buffer->out_offs;
+
+    if (!buffer->full && buffer->in_offs == buffer->out_offs)
+        return NULL;
+    do {
+        if (char_offset < buffer->entry[index].size)
+        {
+            *entry_offset_byte_rtn = char_offset;
+            return &buffer->entry[index];
+        }
+        char_offset -= buffer->entry[index].size;
+        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    } while (index != buffer->in_offs);
+    return NULL;
+}
+
+
+/**
+ * aesd_circular_buffer_add_entry as it was with a modulo per step
+ */
+static void modulo_add(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    if (buffer->full)
+        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = (buffer->in_offs == buffer->out_offs);
+}
+
+
+/* eviction callback counting the bytes dropped from the buffer */
+static void count_evicted(void *ctx, const struct aesd_buffer_entry *entry)
+{
+    *(size_t *)ctx += entry->size;
+}
+
+
+/**
+ * Collects [start, end) of @param buffer with one offset lookup per segment, the way a replay
+ * walked the buffer without aesd_circular_buffer_find_range
+ */
+static size_t find_range_by_offset(struct aesd_circular_buffer *buffer, size_t start, size_t end,
+                                   struct aesd_buffer_entry *segments, size_t max_segments)
+{
+    size_t nsegs = 0;
+    size_t offset;
+
+    while (start < end && nsegs < max_segments)
+    {
+        struct aesd_buffer_entry *found = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, start, &offset);
+
+        if (!found)
+            break;
+        segments[nsegs].buffptr = found->buffptr + offset;
+        segments[nsegs].size = found->size - offset;
+        if (segments[nsegs].size > end - start)
+            segments[nsegs].size = end - start;
+        start += segments[nsegs].size;
+        nsegs++;
+    }
+    return nsegs;
+}
+
+
+static void report(const char *variant, const char *op, unsigned long ops, uint64_t elapsed_ns)
+{
+    printf("%-10s %-8s %10lu ops %10.3f ms %8.2f ns/op\n", variant, op, ops, elapsed_ns / 1e6,
+           (double)elapsed_ns / (ops ? ops : 1));
+}
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 10000000;
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer batch_buffer;
+    struct aesd_buffer_entry batch[4];
+    struct aesd_buffer_entry segments[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry expected[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t nsegs;
+    size_t evicted_single = 0;
+    size_t evicted_batch = 0;
+    const char *overwritten;
+    struct entry_ring ring;
+    struct aesd_buffer_entry entry = { "x", 0 };
+    struct aesd_buffer_entry *found;
+    size_t offset;
+    size_t total;
+    uint64_t start;
+    uint32_t rng;
+    unsigned long ii;
+    uint32_t jj;
+    uint8_t index;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if (opt != 'i')
+        {
+            fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+            return 1;
+        }
+        iterations = strtoul(optarg, NULL, 0);
+    }
+    /* enough adds to fill the ring for the check at the end */
+    if (iterations < entry_ring_capacity())
+        iterations = entry_ring_capacity();
+
+    /* adds, every one of them past the first few overwrites the oldest entry */
+    aesd_circular_buffer_init(&buffer);
+    rng = 1;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        entry.size = 1 + next_random(&rng) % 256;
+        modulo_add(&buffer, &entry);
+    }
+    report("modulo", "add", iterations, now_ns() - start);
+
+    aesd_circular_buffer_init(&buffer);
+    rng = 1;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        entry.size = 1 + next_random(&rng) % 256;
+        /* the oldest entry is returned once the buffer is full */
+        overwritten = aesd_circular_buffer_add_entry_evict(&buffer, &entry);
+        if (overwritten)
+            evicted_single++;
+    }
+    report("circular", "add", iterations, now_ns() - start);
+
+    /* the same entries in batches of 4 with one index update each */
+    aesd_circular_buffer_init(&batch_buffer);
+    rng = 1;
+    start = now_ns();
+    for (ii = 0; ii + 4 <= iterations; ii += 4)
+    {
+        for (jj = 0; jj < 4; jj++)
+        {
+            batch[jj] = entry;
+            batch[jj].size = 1 + next_random(&rng) % 256;
+        }
+        aesd_circular_buffer_add_entries(&batch_buffer, batch, 4, count_evicted, &evicted_batch);
+    }
+    for (; ii < iterations; ii++)
+    {
+        batch[0].size = 1 + next_random(&rng) % 256;
+        aesd_circular_buffer_add_entries(&batch_buffer, batch, 1, count_evicted, &evicted_batch);
+    }
+    report("circular", "addn", iterations, now_ns() - start);
+
+    /* both hold the newest entries and every other entry went through the callback */
+    if (evicted_single != iterations - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ||
+        aesd_circular_buffer_count(&batch_buffer) != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        fprintf(stderr, "aesd_circular_buffer adds overwrote %zu entries\n", evicted_single);
+        return 1;
+    }
+    AESD_CIRCULAR_BUFFER_FOREACH_LIVE(found, &buffer, index, jj)
+        expected[jj] = *found;
+    total = 0;
+    AESD_CIRCULAR_BUFFER_FOREACH_LIVE(found, &batch_buffer, index, jj)
+    {
+        if (found->size != expected[jj].size)
+        {
+            fprintf(stderr, "batch added entry %u differs from the single adds\n", jj);
+            return 1;
+        }
+        total += found->size;
+    }
+    rng = 1;
+    for (ii = 0; ii < iterations; ii++)
+        total -= 1 + next_random(&rng) % 256;
+    if (total + evicted_batch != 0)
+    {
+        fprintf(stderr, "batch adds evicted %zu bytes\n", evicted_batch);
+        return 1;
+    }
+
+    entry_ring_init(&ring);
+    rng = 1;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        entry.size = 1 + next_random(&rng) % 256;
+        entry_ring_push(&ring, &entry, NULL);
+    }
+    report("ring", "add", iterations, now_ns() - start);
+
+    /* lookups of random offsets in the history, about half way in on average */
+    rng = 2;
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        found = modulo_find(&buffer, next_random(&rng) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 128), &offset);
+        total += found ? offset : 0;
+    }
+    report("modulo", "find", iterations, now_ns() - start);
+    sink = total;
+
+    rng = 2;
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, next_random(&rng) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 128), &offset);
+        total += found ? offset : 0;
+    }
+    report("circular", "find", iterations, now_ns() - start);
+    if (total != sink)
+    {
+        fprintf(stderr, "aesd_circular_buffer lookups differ from the modulo version\n");
+        return 1;
+    }
+
+    /* ranges of about 300 bytes, as the segments a writev would send */
+    rng = 3;
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        offset = next_random(&rng) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 128);
+        nsegs = find_range_by_offset(&buffer, offset, offset + 300, segments, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+        total += nsegs ? segments[nsegs - 1].size : 0;
+    }
+    report("circular", "range1", iterations, now_ns() - start);
+    sink = total;
+
+    rng = 3;
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        offset = next_random(&rng) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 128);
+        nsegs = aesd_circular_buffer_find_range(&buffer, offset, offset + 300, segments, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+        total += nsegs ? segments[nsegs - 1].size : 0;
+    }
+    report("circular", "range", iterations, now_ns() - start);
+    if (total != sink)
+    {
+        fprintf(stderr, "aesd_circular_buffer_find_range differs from offset lookups\n");
+        return 1;
+    }
+
+    rng = 2;
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations; ii++)
+    {
+        found = entry_ring_find_offset(&ring, next_random(&rng) % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 128), &offset);
+        total += found ? offset : 0;
+    }
+    report("ring", "find", iterations, now_ns() - start);
+    sink = total;
+
+    /* iterations over the live entries, the raw FOREACH also visits empty slots */
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations / 10; ii++)
+    {
+        AESD_CIRCULAR_BUFFER_FOREACH_LIVE(found, &buffer, index, jj)
+            total += found->size;
+    }
+    report("circular", "foreach", iterations / 10, now_ns() - start);
+    sink = total;
+
+    total = 0;
+    start = now_ns();
+    for (ii = 0; ii < iterations / 10; ii++)
+    {
+        AESD_RING_FOREACH(found, &ring, entry_ring, jj)
+            total += found->size;
+    }
+    report("ring", "foreach", iterations / 10, now_ns() - start);
+    sink = total;
+
+    /* the ring holds the newest 16 sizes in order */
+    rng = 1;
+    for (ii = 0; ii < iterations - entry_ring_capacity(); ii++)
+        next_random(&rng);
+    AESD_RING_FOREACH(found, &ring, entry_ring, jj)
+    {
+        if (found->size != 1 + next_random(&rng) % 256)
+        {
+            fprintf(stderr, "ring entry %u does not hold the expected size\n", jj);
+            return 1;
+        }
+    }
+    if (entry_ring_count(&ring) != entry_ring_capacity())
+    {
+        fprintf(stderr, "ring holds %u entries\n", entry_ring_count(&ring));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+/**
+ * @file aesd_soa_bench.c
+ * @brief Compares the entry array layout of aesd_ring (buffptr and size interleaved) with the
+ * structure of arrays layout of AESD_RING_DECLARE_SOA at depths from 16 to 64k entries, on
+ * offset lookups and on summing the size of the history.
+ *
+ * Usage: aesd-soa-bench [-i iterations]
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-ring.h"
+
+AESD_RING_DECLARE(aos4, struct aesd_buffer_entry, 4)
+AESD_RING_DECLARE_FIND(aos4, struct aesd_buffer_entry, size)
+AESD_RING_DECLARE_SOA(soa4, 4)
+AESD_RING_DECLARE(aos8, struct aesd_buffer_entry, 8)
+AESD_RING_DECLARE_FIND(aos8, struct aesd_buffer_entry, size)
+AESD_RING_DECLARE_SOA(soa8, 8)
+AESD_RING_DECLARE(aos12, struct aesd_buffer_entry, 12)
+AESD_RING_DECLARE_FIND(aos12, struct aesd_buffer_entry, size)
+AESD_RING_DECLARE_SOA(soa12, 12)
+AESD_RING_DECLARE(aos16, struct aesd_buffer_entry, 16)
+AESD_RING_DECLARE_FIND(aos16, struct aesd_buffer_entry, size)
+AESD_RING_DECLARE_SOA(soa16, 16)
+
+/* sink for results so the compiler keeps the loops */
+static volatile size_t sink;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+
+static void report(uint32_t depth, const char *variant, const char *op, unsigned long ops, uint64_t elapsed_ns)
+{
+    printf("%6u %-10s %-8s %10lu ops %10.3f ms %10.2f ns/op\n", depth, variant, op, ops, elapsed_ns / 1e6,
+           (double)elapsed_ns / (ops ? ops : 1));
+}
+
+
+static void *alloc_ring(size_t size)
+{
+    void *ring = aligned_alloc(64, (size + 63) & ~(size_t)63);
+
+    if (!ring)
+    {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    return ring;
+}
+
+
+/**
+ * Fills an aesd_ring @param aos and its structure of arrays twin @param soa with the same
+ * entries, twice their capacity so both wrapped, then times @param lookups random offset
+ * lookups and size sums on each. Exits if the two layouts disagree.
+ * The linear scan over the sizes array is timed too, to separate the layout from the search.
+ */
+#define RUN_DEPTH(aos_name, soa_name, iterations)                                                   \
+do {                                                                                                \
+    struct aos_name *aos = alloc_ring(sizeof(*aos));                                                \
+    struct soa_name *soa = alloc_ring(sizeof(*soa));                                                \
+    uint32_t depth = aos_name##_capacity();                                                         \
+    unsigned long lookups = (iterations) / depth * 16;                                              \
+    struct aesd_buffer_entry entry = { "x", 0 };                                                    \
+    struct aesd_buffer_entry *found;                                                                \
+    uint64_t bytes, start;                                                                          \
+    size_t offset, total, expected;                                                                 \
+    uint32_t rng, jj;                                                                               \
+    unsigned long ii;                                                                               \
+                                                                                                    \
+    if (lookups < 100)                                                                              \
+        lookups = 100;                                                                              \
+    aos_name##_init(aos);                                                                           \
+    soa_name##_init(soa);                                                                           \
+    rng = 1;                                                                                        \
+    for (ii = 0; ii < 2 * depth; ii++)                                                              \
+    {                                                                                               \
+        entry.size = 1 + next_random(&rng) % 256;                                                   \
+        aos_name##_push(aos, &entry, NULL);                                                         \
+        soa_name##_push(soa, entry.buffptr, entry.size, NULL);                                      \
+    }                                                                                               \
+                                                                                                    \
+    /* the size of the history, as llseek and the entry ioctls need it */                           \
+    total = 0;                                                                                      \
+    start = now_ns();                                                                               \
+    for (ii = 0; ii < lookups; ii++)                                                                \
+        AESD_RING_FOREACH(found, aos, aos_name, jj)                                                 \
+            total += found->size;                                                                   \
+    report(depth, "aos", "sum", lookups, now_ns() - start);                                         \
+    expected = total;                                                                               \
+                                                                                                    \
+    /* the live sizes are at most two contiguous runs of the array, which vectorize */              \
+    total = 0;                                                                                      \
+    start = now_ns();                                                                               \
+    for (ii = 0; ii < lookups; ii++)                                                                \
+    {                                                                                               \
+        uint32_t first = soa_name##_slot(soa, 0);                                                   \
+        uint32_t count = soa_name##_count(soa);                                                     \
+        uint32_t run = (count < depth - first) ? count : depth - first;                             \
+        for (jj = 0; jj < run; jj++)                                                                \
+            total += soa->size[first + jj];                                                         \
+        for (jj = 0; jj < count - run; jj++)                                                        \
+            total += soa->size[jj];                                                                 \
+    }                                                                                               \
+    report(depth, "soa", "sum", lookups, now_ns() - start);                                         \
+    if (total != expected || soa_name##_bytes(soa) * lookups != expected)                           \
+    {                                                                                               \
+        fprintf(stderr, "depth %u: size sums differ\n", depth);                                     \
+        exit(1);                                                                                    \
+    }                                                                                               \
+                                                                                                    \
+    bytes = soa_name##_bytes(soa);                                                                  \
+    rng = 2;                                                                                        \
+    total = 0;                                                                                      \
+    start = now_ns();                                                                               \
+    for (ii = 0; ii < lookups; ii++)                                                                \
+    {                                                                                               \
+        found = aos_name##_find_offset(aos, next_random(&rng) % bytes, &offset);                    \
+        total += found ? found->size * 1024 + offset : 0;                                           \
+    }                                                                                               \
+    report(depth, "aos", "find", lookups, now_ns() - start);                                        \
+    expected = total;                                                                               \
+                                                                                                    \
+    rng = 2;                                                                                        \
+    total = 0;                                                                                      \
+    start = now_ns();                                                                               \
+    for (ii = 0; ii < lookups; ii++)                                                                \
+    {                                                                                               \
+        size_t char_offset = next_random(&rng) % bytes;                                             \
+        for (jj = 0; jj < soa_name##_count(soa); jj++)                                              \
+        {                                                                                           \
+            size_t size = soa->size[soa_name##_slot(soa, jj)];                                      \
+            if (char_offset < size)                                                                 \
+            {                                                                                       \
+                total += size * 1024 + char_offset;                                                 \
+                break;                                                                              \
+            }                                                                                       \
+            char_offset -= size;                                                                    \
+        }                                                                                           \
+    }                                                                                               \
+    report(depth, "soa scan", "find", lookups, now_ns() - start);                                   \
+    sink = total;                                                                                   \
+                                                                                                    \
+    rng = 2;                                                                                        \
+    total = 0;                                                                                      \
+    start = now_ns();                                                                               \
+    for (ii = 0; ii < lookups; ii++)                                                                \
+    {                                                                                               \
+        int32_t live = soa_name##_find_offset(soa, next_random(&rng) % bytes, &offset);             \
+        total += live >= 0 ? soa->size[soa_name##_slot(soa, live)] * 1024 + offset : 0;            \
+    }                                                                                               \
+    report(depth, "soa", "find", lookups, now_ns() - start);                                        \
+    if (total != expected || sink != expected)                                                      \
+    {                                                                                               \
+        fprintf(stderr, "depth %u: offset lookups differ\n", depth);                                \
+        exit(1);                                                                                    \
+    }                                                                                               \
+                                                                                                    \
+    free(aos);                                                                                      \
+    free(soa);                                                                                      \
+} while (0)
+
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if (opt != 'i')
+        {
+            fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+            return 1;
+        }
+        iterations = strtoul(optarg, NULL, 0);
+    }
+
+    /* the deeper the ring, the fewer lookups so every depth walks about as many entries */
+    RUN_DEPTH(aos4, soa4, iterations);
+    RUN_DEPTH(aos8, soa8, iterations);
+    RUN_DEPTH(aos12, soa12, iterations);
+    RUN_DEPTH(aos16, soa16, iterations);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# Measures aggregate write throughput of concurrent writers spread over 1, 2, 4 ... shards.
+# Load the module with enough minors first, e.g. ./aesdchar_load aesd_nr_devs=8
+device=/dev/aesdchar
+writers=${1:-$(nproc)}
+lines=${2:-20000}
+nr_devs=$(cat /sys/module/aesdchar/parameters/aesd_nr_devs 2>/dev/null || echo 1)
+data_file=$(mktemp)
+echo "Temp file created at ${data_file}"
+
+# fixed 64 byte lines, dd bs=64 issues one write() per line
+awk -v n=${lines} 'BEGIN { for (i = 0; i < n; i++) printf "%-63d\n", i }' > ${data_file}
+
+echo "${writers} writers, ${lines} lines each, ${nr_devs} devices available"
+shards=1
+while [ ${shards} -le ${nr_devs} ]; do
+    start_ns=$(date +%s%N)
+    writer=0
+    while [ ${writer} -lt ${writers} ]; do
+        dd if=${data_file} of=${device}$((writer % shards)) bs=64 > /dev/null 2>&1 &
+        writer=$((writer + 1))
+    done
+    wait
+    end_ns=$(date +%s%N)
+
+    elapsed_us=$(( (end_ns - start_ns) / 1000 ))
+    [ ${elapsed_us} -gt 0 ] || elapsed_us=1
+    echo "shards ${shards}: $((writers * lines * 1000 / elapsed_us)) klines/s, $((writers * lines * 64 / elapsed_us)) MB/s"
+    shards=$((shards * 2))
+done
+
+# remove the temp file
+rm ${data_file}
@@ -18,283 +18,421 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // For kmalloc()
+#include <linux/mm.h> // For kvmalloc() and vm_insert_page()
 #include <linux/uaccess.h> // For copy_from_user()
+#include <linux/string.h> // For memset()
+#include <linux/vmalloc.h> // For vmalloc_user()
+#include <linux/log2.h> // For roundup_pow_of_two()
+#include <linux/version.h>
+#include <linux/poll.h> // For poll_wait()
+#include <linux/uio.h> // For copy_to_iter()
+#include <linux/shrinker.h> // For the memory pressure shrinker
+#include <linux/device.h> // For the sysfs class
+#include <linux/debugfs.h> // For the stats counters
+#include <linux/sched/clock.h> // For local_clock()
 
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = 1; /* number of minors, /dev/aesdchar0 .. aesd_nr_devs-1 */
+unsigned long aesd_mmap_pages = 16; /* pages in the mmap history ring */
+unsigned long aesd_max_bytes = 4 << 20; /* default byte budget of each device */
+
+module_param(aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices, each with its own buffer and lock");
+module_param(aesd_mmap_pages, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_mmap_pages, "Size in pages of the history ring exposed by mmap, rounded up to a power of two");
+module_param(aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_bytes, "Initial byte budget of each device history, 0 to only limit the entry count");
 
 MODULE_AUTHOR("rohanventer2010"); 
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; /* allocated in aesd_init_module */
+static struct class *aesd_class; /* sysfs class of the devices */
+static struct dentry *aesd_debugfs_root; /* debugfs directory of the module */
+
+/* bytes of a write copied from user space at a time */
+#define AESD_WRITE_CHUNK (64 * 1024)
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
     PDEBUG("open");
 
 	struct aesd_dev *dev; /* device information */
+	struct aesd_file *file; /* per open file state */
 
 	dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = dev; /* for other methods */
+
+	file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+	file->dev = dev;
+	mutex_init(&file->write_lock);
+	filp->private_data = file; /* for other methods */
 
     return 0;
 }
 
 
+/**
+ * Hands the partial line in @param pending of a file being closed to the device, so the next
+ * writer continues it as a single writer writing through several opens would expect.
+ * Caller must hold dev->lock.
+ */
+static void aesd_carry_pending(struct aesd_dev *dev, struct aesd_pending *pending)
+{
+    if (!dev->carry.entry.size)
+    {
+        /* just move the buffer over */
+        aesd_pending_free(&dev->carry);
+        dev->carry = *pending;
+        memset(pending, 0, sizeof(*pending));
+    }
+    else if (aesd_pending_append(&dev->carry, pending->entry.buffptr, pending->entry.size))
+    {
+        printk(KERN_WARNING "aesdchar: dropped %zu byte partial line\n", pending->entry.size);
+    }
+}
+
+
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = (struct aesd_file*) filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
     PDEBUG("release");
+    if (file->pending.entry.size)
+    {
+        mutex_lock(&dev->lock);
+        aesd_carry_pending(dev, &file->pending);
+        mutex_unlock(&dev->lock);
+    }
+    aesd_pending_free(&file->pending);
+    mutex_destroy(&file->write_lock);
+    kfree(file);
     return 0;
 }
 
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * Takes dev->lock interruptibly. Only contended acquisitions are timed, so the uncontended
+ * path costs a trylock.
+ * @return 0 with the lock held, -ERESTARTSYS if interrupted while waiting
+ */
+static int aesd_lock(struct aesd_dev *dev)
 {
-    ssize_t retval = 0;
-
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
-    PDEBUG("filp->f_pos %lld", filp->f_pos);
+    u64 wait_start;
 
-    /* make sure arguments are valid 
-     * return EFAULT (Bad address)
-     */
-    if (!filp || !buf || !f_pos)
-        return -EFAULT;
-
-    struct aesd_dev *dev;
-    dev = (struct aesd_dev*) filp->private_data;        
+    if (mutex_trylock(&dev->lock))
+        return 0;
 
+    wait_start = local_clock();
     if(mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS; /* return ERESTARTSYS (Interrupted system call should be restarted) */
+    dev->stats.lock_contended++;
+    dev->stats.lock_wait_ns += local_clock() - wait_start;
+    return 0;
+}
 
-    struct aesd_buffer_entry *entry = NULL;
-    struct aesd_circular_buffer *buffer = &dev->buffer;
-    size_t offset = 0;
-    do {
-        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, *f_pos, &offset);
-        if (entry == NULL || retval >= count) 
-            break;
 
-        size_t bytes_to_copy = entry->size - offset;
-        if (bytes_to_copy + retval > count)
-            bytes_to_copy = count - retval;
+/**
+ * Takes dev->lock like aesd_lock() but can't be interrupted, for publishing a completed line
+ * which must not be lost to a signal.
+ */
+static void aesd_lock_publish(struct aesd_dev *dev)
+{
+    u64 wait_start;
 
-        size_t copied_bytes = copy_to_user(buf + retval, entry->buffptr + offset, bytes_to_copy);
-        if (copied_bytes != 0) 
-        {
-            mutex_unlock(&dev->lock);
-            return -EFAULT;
-        } else 
-        {
-            retval += bytes_to_copy;
-            *f_pos += bytes_to_copy;
-        }
-    } while (retval < count);
+    if (mutex_trylock(&dev->lock))
+        return;
 
-    mutex_unlock(&dev->lock);
-    return retval;
+    wait_start = local_clock();
+    mutex_lock(&dev->lock);
+    dev->stats.lock_contended++;
+    dev->stats.lock_wait_ns += local_clock() - wait_start;
 }
 
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * In tail mode, moves @param pos back by the bytes dropped from the start of the history since
+ * it was last rebased so it keeps pointing at the same data. Caller must hold dev->lock.
+ * @return the rebased position
+ */
+static loff_t aesd_tail_rebase(struct aesd_file *file, loff_t pos)
 {
-    ssize_t retval = count;
-    PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+    struct aesd_dev *dev = file->dev;
+    uint64_t dropped = dev->engine.evicted_bytes - file->evicted_bytes;
 
-    /* make sure arguments are valid 
-     * return EFAULT (Bad address)
-     * we ignore f_pos
-     */
-    if (!filp || !buf)
-        return -EFAULT;
+    if (!(file->flags & AESD_FLAG_TAIL))
+        return pos;
 
-    /* return 0 when attempting to write zero */
-    if (count == 0)
-        return 0;
+    file->evicted_bytes = dev->engine.evicted_bytes;
+    return (pos > dropped) ? pos - dropped : 0;
+}
 
-    struct aesd_dev *dev;
-    dev = (struct aesd_dev*) filp->private_data;        
 
-    if(mutex_lock_interruptible(&dev->lock))
+/* aesd_copy_fn for aesd_engine_read() */
+static size_t aesd_copy_to_iter(void *ctx, const char *src, size_t length)
+{
+    /* size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i);
+     * Returns the number of bytes copied, less than bytes on a fault or a full pipe */
+    return copy_to_iter(src, length, (struct iov_iter *)ctx);
+}
+
+
+/**
+ * Reads from the history at iocb->ki_pos into @param to, which may be a user buffer, an iovec
+ * array from readv or io_uring, or a pipe when the device is spliced from (sendfile).
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+
+    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+    PDEBUG("filp->f_pos %lld", filp->f_pos);
+
+    struct aesd_file *file = (struct aesd_file*) filp->private_data;
+    struct aesd_dev *dev = file->dev;
+
+    if(aesd_lock(dev))
         return -ERESTARTSYS; /* return ERESTARTSYS (Interrupted system call should be restarted) */
 
-    // first look at the buf from user
-    char *temp_buffer;
-    temp_buffer = kmalloc(count * sizeof(char), GFP_KERNEL);
-    if (!temp_buffer)
-    {
-        mutex_unlock(&dev->lock);
-        return -ENOMEM;
-    }   
+    *f_pos = aesd_tail_rebase(file, *f_pos);
 
-    /* unsigned long copy_from_user (void * to, const void __user * from, unsigned long n);
-     * Returns number of bytes that could not be copied. On success, this will be zero. 
-     * If some data could not be copied, this function will pad the copied data to the requested size using zero bytes. */
-    size_t copied_bytes = -1;
-    copied_bytes = copy_from_user((void *)temp_buffer,(const void *)buf, count);
-    if (copied_bytes != 0)
+    /* at the end of the history tail readers wait for the next complete line */
+    while ((file->flags & AESD_FLAG_TAIL) && count > 0 && *f_pos >= aesd_engine_size(&dev->engine))
     {
-        /* unable to copy from user space */
-        kfree(temp_buffer); /* cleaup */
+        uint64_t lines_committed = dev->engine.lines_committed;
+
         mutex_unlock(&dev->lock);
-        return -EFAULT;
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+
+        PDEBUG("tail read waiting at %lld", *f_pos);
+        if (wait_event_interruptible(dev->readq, READ_ONCE(dev->engine.lines_committed) != lines_committed))
+            return -ERESTARTSYS;
+
+        if(aesd_lock(dev))
+            return -ERESTARTSYS;
+        *f_pos = aesd_tail_rebase(file, *f_pos);
     }
-    
-    copied_bytes = count;
-    /* find last non-zero byte, this will be the true length */
-    size_t ii = 0;
-    for (ii = copied_bytes-1; ii >= 0; ii--)
+
+    loff_t start_pos = *f_pos;
+    retval = aesd_engine_read(&dev->engine, &file->cursor, f_pos, count, file->flags, aesd_copy_to_iter, to);
+    dev->stats.bytes_read += *f_pos - start_pos;
+
+    mutex_unlock(&dev->lock);
+    trace_aesd_read(MINOR(dev->cdev.dev), *f_pos, count, retval);
+    return retval;
+}
+
+
+/**
+ * Copies the line in @param entry, which was just added to the circular buffer, into the mmap
+ * history ring and moves the start offset in the header to the first byte still in the history.
+ * Caller must hold dev->lock.
+ */
+static void aesd_mmap_commit(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    size_t data_size = dev->mmap_pages * PAGE_SIZE;
+    size_t copied = 0;
+    uint64_t end;
+
+    /* odd seq tells readers an update is in progress */
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+
+    /* only the tail of a line larger than the ring fits */
+    end = header->end;
+    if (entry->size > data_size)
     {
-        if (temp_buffer[ii] != '\0')
-        {
-            copied_bytes = (ii + 1);
-            break;
-        }
+        copied = entry->size - data_size;
+        end += copied;
     }
-    
-    /* is the last char a new line */
-    bool last_line_complete = false;
-    if (temp_buffer[copied_bytes-1] == '\n')
-        last_line_complete = true;
-    
-    /* lets count the number of lines */
-    size_t line_count = 0;
-    for (ii = 0; ii < copied_bytes; ii++)
+    while (copied < entry->size)
     {
-        if (temp_buffer[ii] == '\n')
-            line_count++;
+        size_t ring_offset = end & (data_size - 1);
+        size_t chunk = min(entry->size - copied, data_size - ring_offset);
+
+        memcpy(dev->mmap_data + ring_offset, entry->buffptr + copied, chunk);
+        copied += chunk;
+        end += chunk;
     }
 
-    /* adjust the line count if the last line does not end with a newline */
-    if (!last_line_complete)
-        line_count++;
+    WRITE_ONCE(header->end, end);
+    WRITE_ONCE(header->start, end - min_t(uint64_t, aesd_engine_size(&dev->engine), data_size));
 
-    PDEBUG("Number of lines: %d", line_count);
-    PDEBUG("Last line complete: %s", last_line_complete ? "true" : "false");
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
 
-    /* extract each line from the temp_buffer and create a new entry */
-    const char *ptr = temp_buffer;
-    const char *start_ptr = ptr;
-    for (ii = 0; ii < line_count; ii++)
+
+/**
+ * Moves the start offset in the mmap header after entries were evicted without a commit.
+ * Caller must hold dev->lock.
+ */
+static void aesd_mmap_trim(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    size_t data_size = dev->mmap_pages * PAGE_SIZE;
+
+    WRITE_ONCE(header->seq, header->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(header->start, header->end - min_t(uint64_t, aesd_engine_size(&dev->engine), data_size));
+    smp_wmb();
+    WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+
+/**
+ * Publishes the completed line in @param pending to the history of @param dev and mirrors it
+ * into the mmap ring. Caller must hold dev->lock.
+ */
+static void aesd_publish_entry(struct aesd_dev *dev, struct aesd_pending *pending)
+{
+    aesd_mmap_commit(dev, aesd_engine_publish(&dev->engine, pending));
+}
+
+
+/**
+ * Appends the data in @param from, which may be a user buffer, an iovec array from writev or
+ * io_uring, or a pipe when spliced into the device, to the history. The position is ignored.
+ * The data is copied in chunks of AESD_WRITE_CHUNK bytes so large writes never need a
+ * contiguous buffer of their full size.
+ * Lines are assembled in the pending line of the open file without dev->lock, which is only
+ * taken to publish each completed line. Writers on different files therefore never interleave
+ * their partial lines and only contend for the short publish.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    size_t count = iov_iter_count(from);
+    ssize_t retval = count;
+    PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
+
+    /* return 0 when attempting to write zero */
+    if (count == 0)
+        return 0;
+
+    struct aesd_file *file = (struct aesd_file*) filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_pending *pending = &file->pending;
+
+    if(mutex_lock_interruptible(&file->write_lock))
+        return -ERESTARTSYS; /* return ERESTARTSYS (Interrupted system call should be restarted) */
+
+    /* a new line continues the partial line left by a closed file, if any. The unlocked check
+     * only avoids dev->lock when there is nothing to carry, another writer may have taken the
+     * carry meanwhile so it is checked again under the lock */
+    if (!pending->entry.size && READ_ONCE(dev->carry.entry.size))
     {
-        // get line start ptr and length
-        const char *start_ptr = ptr;
-        size_t line_length = 0; 
-        if (ii != (line_count-1)) /* last line? */
+        if(aesd_lock(dev))
         {
-            while (*ptr != '\n')
-            {
-                ptr++;
-                line_length++;
-            }
-            ptr++; /* skip the '\n' */
-            line_length++; /* we have to include the '\n' */
+            mutex_unlock(&file->write_lock);
+            return -ERESTARTSYS;
         }
-        else
+        if (dev->carry.entry.size)
         {
-            if (last_line_complete)
-            {
-                while (*ptr != '\n')
-                {
-                    ptr++;
-                    line_length++;
-                }
-                ptr++; /* skip the '\n' */ 
-                line_length++; /* we have to include the '\n' */                  
-            }
-            else
-                line_length = (&temp_buffer[copied_bytes-1] - start_ptr + 1); /* calculate line length */
+            aesd_pending_free(pending);
+            *pending = dev->carry;
+            memset(&dev->carry, 0, sizeof(dev->carry));
         }
+        mutex_unlock(&dev->lock);
+    }
+
+    char *chunk_buffer = kvmalloc(min_t(size_t, count, AESD_WRITE_CHUNK), GFP_KERNEL);
+    if (!chunk_buffer)
+    {
+        mutex_unlock(&file->write_lock);
+        return -ENOMEM;
+    }   
+
+    /* split the data into lines in a single pass, every '\n' found by memchr completes the
+     * pending entry which is published immediately, a trailing partial line stays pending */
+    size_t consumed = 0;
+    size_t published = 0;
+    int result = 0;
+    while (consumed < count && !result)
+    {
+        size_t chunk = min_t(size_t, count - consumed, AESD_WRITE_CHUNK);
 
-        PDEBUG("Line %d: line length: %d", ii, line_length);
+        /* size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i);
+         * Returns number of bytes copied, all of them on success */
+        size_t copied_bytes = copy_from_iter(chunk_buffer, chunk, from);
+        if (copied_bytes != chunk)
+            result = -EFAULT; /* unable to copy from user space, keep what was copied */
 
-        struct aesd_buffer_entry *entry = &dev->entry;
-        if(!entry->buffptr)
+        const char *ptr = chunk_buffer;
+        const char *end_ptr = chunk_buffer + copied_bytes;
+        while (ptr < end_ptr)
         {
-            /* this is a new entry */
-            entry->buffptr = kmalloc(line_length, GFP_KERNEL);
-            if (!entry->buffptr)
+            ssize_t line_length = aesd_pending_feed(pending, ptr, end_ptr - ptr);
+            if (line_length < 0)
             {
-                kfree(temp_buffer);
-                mutex_unlock(&dev->lock);
-                return -ENOMEM;
+                result = line_length;
+                break;
             }
 
-            memcpy((void *)entry->buffptr, (void *)start_ptr, line_length);
-            entry->size = line_length;
+            PDEBUG("line length: %zd, complete: %s", line_length, aesd_pending_complete(pending) ? "true" : "false");
 
-            /* add entry to circular buffer */
-            struct aesd_circular_buffer *buffer = &dev->buffer;
-            if (ii == (line_count-1)) /* last line? */
-            {
-                if (last_line_complete)
-                {
-                    struct aesd_buffer_entry *old_entry = aesd_circular_buffer_add_entry(buffer, entry);
-                    if (!old_entry)
-                        kfree(old_entry->buffptr);
-                    entry->buffptr = NULL;
-                    entry->size = 0;
-                }
-            }
-        }
-        else
-        {
-            /* complete a previous entry */
-            char *tmp = kmalloc(line_length + entry->size, GFP_KERNEL);
-            if (!tmp)
+            if (aesd_pending_complete(pending))
             {
-                kfree(temp_buffer);
+                aesd_pending_trim(pending);
+                /* the line is complete, it has to be published even if a signal is pending */
+                aesd_lock_publish(dev);
+                aesd_publish_entry(dev, pending);
                 mutex_unlock(&dev->lock);
-                return -ENOMEM;
+                published++;
             }
 
-            memcpy((void *)tmp, (void *)entry->buffptr, entry->size);
-            memcpy((void *)tmp + entry->size, (void *)start_ptr, line_length);
-
-            kfree(entry->buffptr); /* free the old entry buffer */
-            entry->buffptr = tmp;
-            entry->size += line_length;
-
-            /* add entry to circular buffer */
-            struct aesd_circular_buffer *buffer = &dev->buffer;
-            if (ii == (line_count-1)) /* last line? */
-            {
-                if (last_line_complete)
-                {
-                    struct aesd_buffer_entry *old_entry = aesd_circular_buffer_add_entry(buffer, entry);
-                    if (!old_entry)
-                        kfree(old_entry->buffptr);
-                    entry->buffptr = NULL;
-                    entry->size = 0;
-                }
-            }   
+            ptr += line_length;
         }
+        consumed += ptr - chunk_buffer;
     }
+    kvfree(chunk_buffer);
+
+    aesd_pending_end_write(pending); /* drops trailing '\0' bytes */
+    mutex_unlock(&file->write_lock);
+
+    /* report what was consumed so far, or the error if nothing was */
+    if (result)
+        retval = consumed ? consumed : result;
 
+    aesd_lock_publish(dev);
+    dev->stats.bytes_written += consumed;
+#ifdef AESD_DEBUG
+    /* dump the whole buffer, only compiled in with AESD_DEBUG */
     uint8_t index;
-    struct aesd_circular_buffer *buffer_ = &dev->buffer;
     struct aesd_buffer_entry *entry_;
     PDEBUG("======");
-    AESD_CIRCULAR_BUFFER_FOREACH(entry_, buffer_, index) 
+    AESD_CIRCULAR_BUFFER_FOREACH(entry_, &dev->engine.buffer, index) 
     {
-        char new_string[entry_->size+1];
-        memcpy(new_string, entry_->buffptr, entry_->size);
-        new_string[entry_->size] = '\0'; //properly null terminate
-        PDEBUG("%d : %s : %d", index, new_string, entry_->size);
+        PDEBUG("%d : %.*s : %zu", index, (int)entry_->size, entry_->buffptr ? entry_->buffptr : "", entry_->size);
     }
     PDEBUG("======");
-
-    kfree(temp_buffer);
+#endif
     mutex_unlock(&dev->lock);
+
+    /* readers are only woken when at least one line was completed */
+    if (published)
+        wake_up_interruptible(&dev->readq);
     return retval; /* return number of bytes written */
 }
 
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) 
 {
+    struct aesd_file *file;
     struct aesd_dev *dev;
 
     PDEBUG("whence: %d offset: %lld", whence, offset);
@@ -305,25 +443,21 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
     if (!filp)
         return -EFAULT;    
 
-    dev = (struct aesd_dev*)filp->private_data;
+    file = (struct aesd_file*)filp->private_data;
+    dev = file->dev;
 
     /* since we support wrapping around in reading from the FIFO we can define the maxsize as 
      * the maximum file size the FS supports
      * If we want to be more restrictive, set maxsize to the size of the FIFO (circular buffer) */
     loff_t maxsize = MAX_LFS_FILESIZE;
 
-    if(mutex_lock_interruptible(&dev->lock))
+    if(aesd_lock(dev))
         return -ERESTARTSYS; /* return ERESTARTSYS (Interrupted system call should be restarted) */
 
     /* get current size of the FIFO */
-    loff_t eof = 0;
-    uint8_t index;
-    struct aesd_circular_buffer *buffer_ = &dev->buffer;
-    struct aesd_buffer_entry *entry_;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry_, buffer_, index) 
-    {
-        eof += entry_->size;
-    }
+    loff_t eof = aesd_engine_size(&dev->engine);
+    /* the new position is relative to the current history */
+    file->evicted_bytes = dev->engine.evicted_bytes;
     /* only lock the relevant data */
     mutex_unlock(&dev->lock);
 
@@ -333,7 +467,9 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
         case SEEK_CUR: /* fall through */
         case SEEK_END:
             /* loff_t generic_file_llseek_size(struct file *file, loff_t offset, int whence, loff_t maxsize, loff_t eof) */
-            return generic_file_llseek_size(filp, offset, whence, maxsize, eof);
+            offset = generic_file_llseek_size(filp, offset, whence, maxsize, eof);
+            trace_aesd_seek(MINOR(dev->cdev.dev), whence, offset);
+            return offset;
         default:
             return -EINVAL;
             break;
@@ -341,8 +477,227 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 }
 
 
+/**
+ * Reports the file readable when there is history past its position, tail readers at the end
+ * of the history are woken by the next complete line. Writes never block.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = (struct aesd_file*)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    uint64_t dropped;
+    loff_t pos = READ_ONCE(filp->f_pos);
+
+    poll_wait(filp, &dev->readq, wait);
+
+    mutex_lock(&dev->lock);
+    /* same position as the next read would use, without rebasing the file */
+    if (file->flags & AESD_FLAG_TAIL)
+    {
+        dropped = dev->engine.evicted_bytes - file->evicted_bytes;
+        pos = (pos > dropped) ? pos - dropped : 0;
+    }
+    if (pos < aesd_engine_size(&dev->engine))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    mutex_unlock(&dev->lock);
+
+    return mask;
+}
+
+
+/**
+ * Maps the header page followed by the history ring read-only into user space. The mapping
+ * may cover the ring once or twice, in the latter case the ring pages are mapped back to back
+ * so a window that wraps around the end of the ring is still contiguous.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev;
+    unsigned long vma_pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+    unsigned long addr = vma->vm_start;
+    unsigned long ii;
+    int err;
+
+    dev = ((struct aesd_file*)filp->private_data)->dev;
+
+    PDEBUG("mmap %lu pages at offset %lu", vma_pages, vma->vm_pgoff);
+
+    if (vma->vm_pgoff != 0)
+        return -EINVAL;
+
+    if (vma_pages != 1 + dev->mmap_pages && vma_pages != 1 + 2 * dev->mmap_pages)
+        return -EINVAL;
+
+    /* the history can only be changed through write() */
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    err = vm_insert_page(vma, addr, vmalloc_to_page(dev->mmap_header));
+    for (ii = 0; !err && ii < vma_pages - 1; ii++)
+    {
+        addr += PAGE_SIZE;
+        err = vm_insert_page(vma, addr, vmalloc_to_page(dev->mmap_data + (ii % dev->mmap_pages) * PAGE_SIZE));
+    }
+
+    return err;
+}
+
+
+/**
+ * AESDCHAR_IOCGENTRIES, copies the count, sizes, offsets and oldest sequence number of the
+ * history of @param dev to @param utable in a single copy_to_user
+ */
+static long aesd_ioctl_get_entries(struct aesd_dev *dev, struct aesd_entry_table __user *utable)
+{
+    struct aesd_entry_table table;
+    struct aesd_buffer_entry *entry;
+    uint64_t offset = 0;
+    uint32_t ii;
+    uint8_t index;
+
+    BUILD_BUG_ON(AESD_ENTRY_TABLE_MAX < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    memset(&table, 0, sizeof(table));
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    table.count = aesd_engine_count(&dev->engine);
+    table.oldest_seq = dev->engine.lines_committed - table.count;
+    AESD_CIRCULAR_BUFFER_FOREACH_LIVE(entry, &dev->engine.buffer, index, ii)
+    {
+        table.size[ii] = entry->size;
+        table.offset[ii] = offset;
+        offset += entry->size;
+    }
+
+    mutex_unlock(&dev->lock);
+
+    if (copy_to_user(utable, &table, sizeof(table)))
+        return -EFAULT;
+    return 0;
+}
+
+
+/**
+ * AESDCHAR_IOCREADENTRIES, copies whole entries starting at sequence number first_seq into the
+ * user iovec array described by @param ureq, and reports back how much was copied
+ */
+static long aesd_ioctl_read_entries(struct aesd_dev *dev, struct aesd_read_entries __user *ureq)
+{
+    struct aesd_read_entries req;
+    struct iovec iovstack[UIO_FASTIOV];
+    struct iovec *iov = iovstack;
+    struct iov_iter iter;
+    uint64_t oldest_seq;
+    uint32_t count;
+    uint8_t index;
+    long retval = 0;
+
+    if (copy_from_user(&req, ureq, sizeof(req)))
+        return -EFAULT;
+
+    retval = import_iovec(READ, u64_to_user_ptr(req.iov), req.iovcnt, UIO_FASTIOV, &iov, &iter);
+    if (retval < 0)
+        return retval;
+    retval = 0;
+
+    req.entries_read = 0;
+    req.bytes_read = 0;
+
+    if(aesd_lock(dev))
+    {
+        kfree(iov);
+        return -ERESTARTSYS;
+    }
+
+    count = aesd_engine_count(&dev->engine);
+    oldest_seq = dev->engine.lines_committed - count;
+    if (req.first_seq < oldest_seq)
+    {
+        retval = -ERANGE; /* already evicted */
+    }
+    else if (req.first_seq < dev->engine.lines_committed)
+    {
+        uint32_t skip = (uint32_t)(req.first_seq - oldest_seq); /* less than count */
+
+        index = aesd_circular_buffer_advance(dev->engine.buffer.out_offs, skip);
+        count -= skip;
+        while (req.entries_read < min(count, req.count))
+        {
+            struct aesd_buffer_entry *entry = &dev->engine.buffer.entry[index];
+
+            if (entry->size > iov_iter_count(&iter))
+                break; /* never split an entry */
+            if (copy_to_iter(entry->buffptr, entry->size, &iter) != entry->size)
+            {
+                retval = -EFAULT;
+                break;
+            }
+            req.entries_read++;
+            req.bytes_read += entry->size;
+            index = aesd_circular_buffer_next(index);
+        }
+        dev->stats.bytes_read += req.bytes_read;
+    }
+
+    mutex_unlock(&dev->lock);
+    kfree(iov);
+
+    if (!retval && copy_to_user(ureq, &req, sizeof(req)))
+        retval = -EFAULT;
+    return retval;
+}
+
+
+/**
+ * AESDCHAR_IOCSEEKSEQ, moves the position of @param filp to the start of the entry with the
+ * requested sequence number or the first entry committed at or after the requested time.
+ * @return 0 on success, -ERANGE if the requested entry was already evicted,
+ *   -EINVAL if the sequence number was not committed yet
+ */
+static long aesd_ioctl_seek_seq(struct file *filp, struct aesd_seekseq __user *useek)
+{
+    struct aesd_file *file = (struct aesd_file*)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_seekseq seek;
+    uint64_t new_fpos = 0;
+    long retval = 0;
+
+    if (copy_from_user(&seek, useek, sizeof(seek)))
+        return -EFAULT;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    retval = aesd_engine_seek_seq(&dev->engine, &seek);
+    if (!retval)
+    {
+        new_fpos = seek.f_pos;
+        filp->f_pos = new_fpos;
+        /* the new position is relative to the current history */
+        file->evicted_bytes = dev->engine.evicted_bytes;
+    }
+
+    mutex_unlock(&dev->lock);
+
+    PDEBUG("ioctl seek seq %llu new_fpos %llu: %ld", seek.seq, new_fpos, retval);
+    if (!retval)
+        trace_aesd_seek(MINOR(dev->cdev.dev), AESDCHAR_IOCSEEKSEQ, new_fpos);
+    if (!retval && copy_to_user(useek, &seek, sizeof(seek)))
+        retval = -EFAULT;
+    return retval;
+}
+
+
 static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) 
 {
+    struct aesd_file *file;
     struct aesd_dev *dev;
 
     PDEBUG("ioctl cmd %u, arg: %lu", cmd, arg);
@@ -353,12 +708,40 @@ static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned lo
     if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
         return -ENOTTY;  /* Inappropriate ioctl for device */
 
-    
+    file = (struct aesd_file*)filp->private_data;
+    dev = file->dev;
+
+    if (cmd == AESDCHAR_IOCSETFLAGS)
+    {
+        uint32_t flags;
+        if (get_user(flags, (uint32_t __user *)arg))
+            return -EFAULT;
+        if (flags & ~(AESD_FLAG_TAIL | AESD_FLAG_RECORD | AESD_FLAG_RECORD_SIZES))
+            return -EINVAL;
+        if ((flags & AESD_FLAG_RECORD_SIZES) && !(flags & AESD_FLAG_RECORD))
+            return -EINVAL;
+
+        if(aesd_lock(dev))
+            return -ERESTARTSYS;
+        file->flags = flags;
+        file->evicted_bytes = dev->engine.evicted_bytes;
+        mutex_unlock(&dev->lock);
+        return 0;
+    }
+
+    if (cmd == AESDCHAR_IOCGENTRIES)
+        return aesd_ioctl_get_entries(dev, (struct aesd_entry_table __user *)arg);
+
+    if (cmd == AESDCHAR_IOCREADENTRIES)
+        return aesd_ioctl_read_entries(dev, (struct aesd_read_entries __user *)arg);
+
+    if (cmd == AESDCHAR_IOCSEEKSEQ)
+        return aesd_ioctl_seek_seq(filp, (struct aesd_seekseq __user *)arg);
+
     if (cmd != AESDCHAR_IOCSEEKTO)
         return -EINVAL;  /* Inappropriate ioctl for device */
 
     /* continue as cmd == AESDCHAR_IOCSEEKTO */
-    dev = (struct aesd_dev*)filp->private_data;
 
     struct aesd_seekto seekto;
     size_t copied_bytes = copy_from_user (&seekto, (struct aesd_seekto *)arg, sizeof(struct aesd_seekto));
@@ -366,38 +749,22 @@ static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned lo
     if (copied_bytes != 0)
         return -EINVAL;
 
-    if(mutex_lock_interruptible(&dev->lock))
+    if(aesd_lock(dev))
         return -ERESTARTSYS; /* return ERESTARTSYS (Interrupted system call should be restarted) */
 
-    /* get current size of the FIFO, and calculate new offset */
+    /* write_cmd counts from the oldest entry at out_offs */
     loff_t new_fpos = 0;
-    loff_t eof = 0;
-    uint8_t index;
-    struct aesd_circular_buffer *buffer_ = &dev->buffer;
-    struct aesd_buffer_entry *entry_;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry_, buffer_, index) 
-    {
-        eof += entry_->size;
-        if (index < seekto.write_cmd)
-            new_fpos += entry_->size;
-    }
-    
+    int result = aesd_engine_seekto(&dev->engine, seekto.write_cmd, seekto.write_cmd_offset, &new_fpos);
+    /* the new position is relative to the current history */
+    if (!result)
+        file->evicted_bytes = dev->engine.evicted_bytes;
     mutex_unlock(&dev->lock);
-    
-    // Calculate the new file position
-//    uint8_t ii = 0;
-//    for (ii = 0; i < seekto.write_cmd; ii++)
-//        new_fpos += buffer_.entry[ii % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size; // Should we wrap around?
-
-    //TODO: should we check if this offset is less than the size of the command?
-
-    /* Validate the new file position against total length */
-    if (new_fpos >= eof)
-        return -EINVAL;
+    if (result)
+        return result;
 
-    new_fpos += seekto.write_cmd_offset;
     filp->f_pos = new_fpos;
-    PDEBUG("ioctl new_fpos %lu", new_fpos);
+    PDEBUG("ioctl new_fpos %lld", new_fpos);
+    trace_aesd_seek(MINOR(dev->cdev.dev), AESDCHAR_IOCSEEKTO, new_fpos);
     /* unlock the mutex*/
     
     return 0;
@@ -406,76 +773,374 @@ static long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned lo
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+/**
+ * Shrinker count callback, reports every entry but the newest of each device as reclaimable
+ */
+static unsigned long aesd_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    int ii;
+
+    /* an estimate is fine here, the lock is not taken */
+    for (ii = 0; ii < aesd_nr_devs; ii++)
+    {
+        uint32_t entries = aesd_engine_count(&aesd_devices[ii].engine);
+        if (entries > 1)
+            count += entries - 1;
+    }
+    return count ? count : SHRINK_EMPTY;
+}
+
+
+/**
+ * Shrinker scan callback, evicts up to sc->nr_to_scan of the oldest entries. Writers stage their
+ * lines without dev->lock and only take it to publish, but readers copy to user pages that may
+ * fault and a closing file may grow the carried partial line while holding it, so reclaim can
+ * run under dev->lock and devices that are busy are skipped instead of waited for.
+ */
+static unsigned long aesd_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
 {
-    PDEBUG("aesd_setup_cdev");
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    unsigned long freed = 0;
+    bool contended = false;
+    int ii;
+
+    for (ii = 0; ii < aesd_nr_devs && freed < sc->nr_to_scan; ii++)
+    {
+        struct aesd_dev *dev = &aesd_devices[ii];
+        unsigned long dev_freed = 0;
+
+        if (!mutex_trylock(&dev->lock))
+        {
+            contended = true;
+            continue;
+        }
+        while (freed < sc->nr_to_scan && aesd_engine_count(&dev->engine) > 1)
+        {
+            aesd_engine_evict_oldest(&dev->engine);
+            dev_freed++;
+            freed++;
+        }
+        if (dev_freed)
+            aesd_mmap_trim(dev);
+        mutex_unlock(&dev->lock);
+    }
+
+    return (freed == 0 && contended) ? SHRINK_STOP : freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *aesd_shrinker;
+#else
+static struct shrinker aesd_shrinker_storage = {
+    .count_objects = aesd_shrink_count,
+    .scan_objects = aesd_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+static struct shrinker *aesd_shrinker = &aesd_shrinker_storage;
+#endif
+static bool aesd_shrinker_registered;
+
+
+/**
+ * Registers the shrinker that reclaims old history under memory pressure
+ */
+static int aesd_register_shrinker(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    aesd_shrinker = shrinker_alloc(0, "aesdchar");
+    if (!aesd_shrinker)
+        return -ENOMEM;
+    aesd_shrinker->count_objects = aesd_shrink_count;
+    aesd_shrinker->scan_objects = aesd_shrink_scan;
+    aesd_shrinker->seeks = DEFAULT_SEEKS;
+    shrinker_register(aesd_shrinker);
+    return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    return register_shrinker(aesd_shrinker, "aesdchar");
+#else
+    return register_shrinker(aesd_shrinker);
+#endif
+}
+
+
+static void aesd_unregister_shrinker(void)
+{
+    if (!aesd_shrinker_registered)
+        return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    shrinker_free(aesd_shrinker);
+#else
+    unregister_shrinker(aesd_shrinker);
+#endif
+}
+
+
+/* sysfs attributes of /sys/class/aesdchar/aesdcharN */
+static ssize_t bytes_used_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    size_t bytes_used;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+    bytes_used = dev->engine.bytes_used;
+    mutex_unlock(&dev->lock);
+    return sysfs_emit(buf, "%zu\n", bytes_used);
+}
+static DEVICE_ATTR_RO(bytes_used);
+
+
+static ssize_t entries_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    uint32_t entries;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+    entries = aesd_engine_count(&dev->engine);
+    mutex_unlock(&dev->lock);
+    return sysfs_emit(buf, "%u\n", entries);
+}
+static DEVICE_ATTR_RO(entries);
+
+
+static ssize_t max_bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(dev->engine.max_bytes));
+}
+
+
+/* a smaller budget takes effect immediately */
+static ssize_t max_bytes_store(struct device *device, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    unsigned long max_bytes;
+    int err;
+
+    err = kstrtoul(buf, 0, &max_bytes);
+    if (err)
+        return err;
+
+    if(aesd_lock(dev))
+        return -ERESTARTSYS;
+    dev->engine.max_bytes = max_bytes;
+    if (aesd_engine_enforce_budget(&dev->engine))
+        aesd_mmap_trim(dev);
+    mutex_unlock(&dev->lock);
+    return count;
+}
+static DEVICE_ATTR_RW(max_bytes);
+
+
+static struct attribute *aesd_attrs[] = {
+    &dev_attr_bytes_used.attr,
+    &dev_attr_entries.attr,
+    &dev_attr_max_bytes.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(aesd);
+
+
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
+{
+    PDEBUG("aesd_setup_cdev %d", index);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err)
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     return err;
 }
 
 
+/**
+ * Initializes the AESD specific portion of @param dev, every minor has its own
+ * buffer, lock and statistics.
+ * @return 0 on success, -ENOMEM if the mmap history ring could not be allocated
+ */
+static int aesd_init_device(struct aesd_dev *dev, int index)
+{
+    aesd_engine_init(&dev->engine, aesd_max_bytes, aesd_minor + index);
+    mutex_init(&dev->lock); 
+    init_waitqueue_head(&dev->readq);
+
+    /* header page followed by the history ring */
+    dev->mmap_pages = roundup_pow_of_two(max(aesd_mmap_pages, 1UL));
+    dev->mmap_area = vmalloc_user((1 + dev->mmap_pages) * PAGE_SIZE);
+    if (!dev->mmap_area)
+        return -ENOMEM;
+    dev->mmap_header = dev->mmap_area;
+    dev->mmap_data = (char *)dev->mmap_area + PAGE_SIZE;
+    dev->mmap_header->data_size = dev->mmap_pages * PAGE_SIZE;
+
+    return 0;
+}
+
+
+/**
+ * Creates /sys/kernel/debug/aesdchar/aesdcharN with the counters of @param dev. Debugfs is
+ * optional, failures are ignored.
+ */
+static void aesd_debugfs_init_device(struct aesd_dev *dev, int index)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "aesdchar%d", index);
+    dev->debugfs_dir = debugfs_create_dir(name, aesd_debugfs_root);
+    debugfs_create_u64("bytes_written", 0444, dev->debugfs_dir, &dev->stats.bytes_written);
+    debugfs_create_u64("bytes_read", 0444, dev->debugfs_dir, &dev->stats.bytes_read);
+    debugfs_create_u64("entries", 0444, dev->debugfs_dir, &dev->engine.lines_committed);
+    debugfs_create_u64("evictions", 0444, dev->debugfs_dir, &dev->engine.evictions);
+    debugfs_create_u64("evicted_bytes", 0444, dev->debugfs_dir, &dev->engine.evicted_bytes);
+    debugfs_create_u64("lock_contended", 0444, dev->debugfs_dir, &dev->stats.lock_contended);
+    debugfs_create_u64("lock_wait_ns", 0444, dev->debugfs_dir, &dev->stats.lock_wait_ns);
+}
+
+
+/**
+ * Frees everything owned by @param dev, the cdev must already be removed
+ */
+static void aesd_cleanup_device(struct aesd_dev *dev)
+{
+    if (!IS_ERR_OR_NULL(dev->device))
+        device_destroy(aesd_class, dev->cdev.dev);
+
+    aesd_engine_free(&dev->engine);
+    aesd_pending_free(&dev->carry); /* partial line that never got its '\n' */
+    vfree(dev->mmap_area);
+    mutex_destroy(&dev->lock);
+}
+
+
 int aesd_init_module(void)
 {
     PDEBUG("aesd_init_module");
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+    int ii;
+
+    if (aesd_nr_devs < 1)
+        return -EINVAL;
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs, "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) 
     {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices)
+    {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    aesd_class = class_create("aesdchar");
+#else
+    aesd_class = class_create(THIS_MODULE, "aesdchar");
+#endif
+    if (IS_ERR(aesd_class))
+    {
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return PTR_ERR(aesd_class);
+    }
+
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
 
     /**
-     * initialize the AESD specific portion of the device
+     * initialize the AESD specific portion of each device
      */
-    aesd_circular_buffer_init(&aesd_device.buffer);
-    mutex_init(&aesd_device.lock); 
-    result = aesd_setup_cdev(&aesd_device);
+    for (ii = 0; ii < aesd_nr_devs; ii++)
+    {
+        result = aesd_init_device(&aesd_devices[ii], ii);
+        if (!result)
+            result = aesd_setup_cdev(&aesd_devices[ii], ii);
+        if (!result)
+        {
+            /* usage is exposed in /sys/class/aesdchar/aesdcharN */
+            aesd_devices[ii].device = device_create_with_groups(aesd_class, NULL, aesd_devices[ii].cdev.dev,
+                &aesd_devices[ii], aesd_groups, "aesdchar%d", ii);
+            if (IS_ERR(aesd_devices[ii].device))
+            {
+                result = PTR_ERR(aesd_devices[ii].device);
+                cdev_del(&aesd_devices[ii].cdev);
+            }
+        }
+        if (!result)
+            aesd_debugfs_init_device(&aesd_devices[ii], ii);
+        if (result)
+        {
+            /* device ii is initialized at most, its cdev was not added */
+            aesd_cleanup_device(&aesd_devices[ii]);
+            while (--ii >= 0)
+            {
+                cdev_del(&aesd_devices[ii].cdev);
+                aesd_cleanup_device(&aesd_devices[ii]);
+            }
+            debugfs_remove_recursive(aesd_debugfs_root);
+            class_destroy(aesd_class);
+            kfree(aesd_devices);
+            unregister_chrdev_region(dev, aesd_nr_devs);
+            return result;
+        }
+    }
 
+    /* the shrinker walks aesd_devices, so it goes last */
+    result = aesd_register_shrinker();
+    aesd_shrinker_registered = (result == 0);
     if (result)
-        unregister_chrdev_region(dev, 1);
-    return result;
+        printk(KERN_WARNING "aesdchar: shrinker not registered, history is only bounded by aesd_max_bytes\n");
+
+    return 0;
 }
 
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    int ii;
 
-    cdev_del(&aesd_device.cdev);
+    aesd_unregister_shrinker();
+    debugfs_remove_recursive(aesd_debugfs_root);
 
     /**
      * cleanup AESD specific poritions here as necessary
      */
-    size_t index;
-    struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) 
+    for (ii = 0; ii < aesd_nr_devs; ii++)
     {
-        kfree(entry->buffptr);
+        cdev_del(&aesd_devices[ii].cdev);
+        aesd_cleanup_device(&aesd_devices[ii]);
     }
-    mutex_destroy(&aesd_device.lock);
-    unregister_chrdev_region(devno, 1);
+    class_destroy(aesd_class);
+    kfree(aesd_devices);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
 module_init(aesd_init_module);
-module_exit(aesd_cleanup_module);
\ No newline at end of file
+module_exit(aesd_cleanup_module);
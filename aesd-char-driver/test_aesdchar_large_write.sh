@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# Writes 64 MB lines to the aesdchar device while memory is fragmented, once in a single
+# write() and once spread over many writes, and checks that each reads back unchanged
+device=/dev/aesdchar
+line_mb=${1:-64}
+frag_dir=$(mktemp -d -p /dev/shm)
+line_file=$(mktemp)
+read_file=$(mktemp)
+echo "Temp files created at ${frag_dir} ${line_file} ${read_file}"
+
+# fragment memory: fill tmpfs with many one page files, then free every other one
+frag_files=${2:-20000}
+ii=0
+while [ ${ii} -lt ${frag_files} ]; do
+    head -c 4096 /dev/zero > ${frag_dir}/${ii}
+    ii=$((ii + 1))
+done
+ii=0
+while [ ${ii} -lt ${frag_files} ]; do
+    rm ${frag_dir}/${ii}
+    ii=$((ii + 2))
+done
+grep -E "Normal" /proc/buddyinfo
+
+# one line of ${line_mb} MB ending in a single '\n'
+head -c $((line_mb * 1024 * 1024 - 1)) /dev/zero | tr '\0' 'x' > ${line_file}
+echo >> ${line_file}
+
+rc=0
+check_line()
+{
+    local what=$1
+    # the newest entry is the last line of the history
+    tail -c $(wc -c < ${line_file}) ${device} > ${read_file}
+    if cmp -s ${line_file} ${read_file}; then
+        echo "${what}: ok"
+    else
+        echo "${what}: read back $(wc -c < ${read_file}) bytes, expected $(wc -c < ${line_file})"
+        rc=1
+    fi
+}
+
+# single write() of the whole line
+dd if=${line_file} of=${device} bs=$((line_mb * 1024 * 1024)) > /dev/null 2>&1
+check_line "single ${line_mb} MB write"
+
+# the same line assembled from 4 KB writes
+dd if=${line_file} of=${device} bs=4096 > /dev/null 2>&1
+check_line "${line_mb} MB line from 4 KB writes"
+
+# remove the temp files
+rm -rf ${frag_dir} ${line_file} ${read_file}
+exit ${rc}
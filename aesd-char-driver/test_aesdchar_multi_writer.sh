@@ -0,0 +1,74 @@
+#!/bin/sh
+
+# Runs several writers at once, each writing its own lines in small fragments so every line
+# takes several write() calls, while a reader keeps sampling the history.
+# Every line read back must be a whole line of a single writer, then the throughput is reported.
+device=/dev/aesdchar
+writers=${1:-8}
+lines=${2:-2000}
+work_dir=$(mktemp -d)
+echo "Temp files created at ${work_dir}"
+
+# writer i writes "w<i>-<n>-" followed by 32 copies of its own letter
+i=0
+while [ ${i} -lt ${writers} ]; do
+    awk -v w=${i} -v n=${lines} 'BEGIN {
+        c = sprintf("%c", 97 + w % 26)
+        s = ""
+        for (k = 0; k < 32; k++) s = s c
+        for (k = 0; k < n; k++) printf "w%d-%d-%s\n", w, k, s
+    }' > ${work_dir}/data${i}
+    i=$((i + 1))
+done
+
+# the reader samples until the writers are done, the history fits in a single read()
+( while [ ! -e ${work_dir}/done ]; do cat ${device}; done ) > ${work_dir}/seen &
+reader=$!
+
+start_ns=$(date +%s%N)
+writer_pids=""
+i=0
+while [ ${i} -lt ${writers} ]; do
+    # bs=7 splits every line over several write() calls
+    dd if=${work_dir}/data${i} of=${device} bs=7 > /dev/null 2>&1 &
+    writer_pids="${writer_pids} $!"
+    i=$((i + 1))
+done
+# wait for the writers only
+for pid in ${writer_pids}; do
+    wait ${pid}
+done
+end_ns=$(date +%s%N)
+touch ${work_dir}/done
+wait ${reader}
+cat ${device} >> ${work_dir}/seen
+
+elapsed_us=$(( (end_ns - start_ns) / 1000 ))
+[ ${elapsed_us} -gt 0 ] || elapsed_us=1
+total_lines=$((writers * lines))
+echo "${writers} writers wrote ${total_lines} lines in ${elapsed_us} us, $((total_lines * 1000 / elapsed_us)) klines/s"
+
+# a line is whole when its letters all belong to the writer named at its start
+bad=$(awk '{
+    if (!match($0, /^w[0-9]+-[0-9]+-[a-z]+$/)) { print; next }
+    split($0, f, "-")
+    w = substr(f[1], 2) + 0
+    c = sprintf("%c", 97 + w % 26)
+    s = ""
+    for (k = 0; k < 32; k++) s = s c
+    if (f[3] != s) print
+}' ${work_dir}/seen | wc -l)
+seen=$(wc -l < ${work_dir}/seen)
+
+if [ ${bad} -eq 0 ] && [ ${seen} -gt 0 ]; then
+    echo "All ${seen} lines read back were whole"
+    rc=0
+else
+    echo "${bad} of ${seen} lines read back were interleaved:"
+    head -n 20 ${work_dir}/seen
+    rc=1
+fi
+
+# remove the temp files
+rm -r ${work_dir}
+exit ${rc}
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+# Writes large multi-line buffers to the aesdchar device in single write() calls
+# and reports the throughput, then checks that the last lines were split correctly
+device=/dev/aesdchar
+lines=${1:-100000}
+passes=${2:-10}
+data_file=$(mktemp)
+expected_file=$(mktemp)
+read_file=$(mktemp)
+echo "Temp files created at ${data_file} ${expected_file} ${read_file}"
+
+# one buffer of ${lines} lines with varying lengths
+awk -v n=${lines} 'BEGIN { for (i = 0; i < n; i++) printf "line%d %.*s\n", i, i % 64, "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijkl" }' > ${data_file}
+data_size=$(wc -c < ${data_file})
+tail -n 10 ${data_file} > ${expected_file}
+
+start_ns=$(date +%s%N)
+pass=0
+while [ ${pass} -lt ${passes} ]; do
+    # bs larger than the file makes dd issue a single write() per pass
+    dd if=${data_file} of=${device} bs=$((data_size + 1)) > /dev/null 2>&1
+    pass=$((pass + 1))
+done
+end_ns=$(date +%s%N)
+
+elapsed_us=$(( (end_ns - start_ns) / 1000 ))
+[ ${elapsed_us} -gt 0 ] || elapsed_us=1
+total_bytes=$((data_size * passes))
+echo "Wrote ${total_bytes} bytes in $((lines * passes)) lines, ${passes} writes, ${elapsed_us} us"
+echo "Throughput: $((total_bytes / elapsed_us)) MB/s, $((lines * passes * 1000 / elapsed_us)) klines/s"
+
+cat ${device} > ${read_file}
+if cmp -s ${expected_file} ${read_file}; then
+    echo "Last lines match"
+    rc=0
+else
+    echo "Last lines do not match, expected:"
+    cat ${expected_file}
+    echo "got:"
+    cat ${read_file}
+    rc=1
+fi
+
+# remove the temp files
+rm ${data_file} ${expected_file} ${read_file}
+exit ${rc}
@@ -0,0 +1,411 @@
+/**
+ * @file aesd_bench.c
+ * @brief Microbenchmark suite of the aesd code that builds in user space: the circular buffer,
+ * newline scanning and line assembly of the aesdchar engine, and the systemcalls and threading
+ * helpers of the examples. Results are printed as a table and optionally written as JSON, which
+ * a later run compares against to flag regressions.
+ *
+ * Usage: aesd-bench [-m min ms] [-r runs] [-f filter] [-o results.json] [-b baseline.json]
+ *                   [-T threshold %] [-l]
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "aesd_bench_harness.h"
+#include "aesd-circular-buffer.h"
+#include "aesd-engine.h"
+#include "systemcalls.h"
+#include "threading.h"
+
+#define CHUNK_SIZE 4096 /* one write or read, a page */
+#define BATCH_SIZE 8
+
+/* sink for results so the compiler keeps the loops */
+static volatile size_t sink;
+
+static struct aesd_circular_buffer buffer;
+static struct aesd_buffer_entry entries[BATCH_SIZE];
+static char chunk[CHUNK_SIZE];
+static struct aesd_engine engine;
+static struct aesd_pending pending;
+static struct aesd_read_cursor cursor;
+static char *read_buffer;
+
+
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+
+/**
+ * Fills chunk with log-like lines of 16 to 128 bytes, the last one cut short by the end of
+ * the chunk like a write that ends in the middle of a line
+ */
+static void fill_chunk(void)
+{
+    uint32_t rng = 1;
+    size_t used = 0;
+
+    while (used < CHUNK_SIZE)
+    {
+        size_t length = 16 + next_random(&rng) % 113;
+
+        if (length > CHUNK_SIZE - used)
+            length = CHUNK_SIZE - used;
+        memset(chunk + used, 'a' + used % 26, length - 1);
+        chunk[used + length - 1] = '\n';
+        used += length;
+    }
+}
+
+
+static void circbuf_setup(void)
+{
+    uint32_t rng = 1;
+    uint32_t ii;
+
+    aesd_circular_buffer_init(&buffer);
+    for (ii = 0; ii < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; ii++)
+    {
+        struct aesd_buffer_entry entry = { chunk, 1 + next_random(&rng) % 128 };
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    for (ii = 0; ii < BATCH_SIZE; ii++)
+    {
+        entries[ii].buffptr = chunk;
+        entries[ii].size = 1 + next_random(&rng) % 128;
+    }
+}
+
+
+static void circbuf_add(unsigned long iterations)
+{
+    struct aesd_buffer_entry entry = { chunk, 0 };
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        entry.size = 1 + (ii & 127);
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+}
+
+
+/* one operation is one entry, added BATCH_SIZE at a time */
+static void circbuf_add_entries(unsigned long iterations)
+{
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii += BATCH_SIZE)
+    {
+        size_t count = (iterations - ii < BATCH_SIZE) ? iterations - ii : BATCH_SIZE;
+        aesd_circular_buffer_add_entries(&buffer, entries, count, NULL, NULL);
+    }
+}
+
+
+static void circbuf_find(unsigned long iterations)
+{
+    uint32_t rng = 2;
+    size_t total = 0;
+    size_t offset;
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        if (aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, next_random(&rng) % 640, &offset))
+            total += offset;
+    }
+    sink = total;
+}
+
+
+static void circbuf_find_range(unsigned long iterations)
+{
+    struct aesd_buffer_entry segments[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t rng = 2;
+    size_t total = 0;
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        size_t start = next_random(&rng) % 640;
+        total += aesd_circular_buffer_find_range(&buffer, start, start + 200, segments,
+                                                 AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    }
+    sink = total;
+}
+
+
+static void circbuf_foreach(unsigned long iterations)
+{
+    struct aesd_buffer_entry *entry;
+    size_t total = 0;
+    unsigned long ii;
+    uint32_t jj;
+    uint8_t index;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        AESD_CIRCULAR_BUFFER_FOREACH_LIVE(entry, &buffer, index, jj)
+            total += entry->size;
+    }
+    sink = total;
+}
+
+
+/* one operation splits a page of written data into lines, as the driver's write path does */
+static void scan_newline(unsigned long iterations)
+{
+    size_t lines = 0;
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        const char *data = chunk;
+        size_t left = CHUNK_SIZE;
+        const char *newline;
+
+        while (left && (newline = memchr(data, '\n', left)) != NULL)
+        {
+            left -= newline + 1 - data;
+            data = newline + 1;
+            lines++;
+        }
+    }
+    sink = lines;
+}
+
+
+static void engine_setup(void)
+{
+    aesd_engine_init(&engine, 0, 0);
+    memset(&pending, 0, sizeof(pending));
+    memset(&cursor, 0, sizeof(cursor));
+}
+
+
+static void engine_teardown(void)
+{
+    aesd_pending_free(&pending);
+    aesd_engine_free(&engine);
+}
+
+
+/**
+ * Writes @param length bytes of @param data the way aesdchar_write_iter does: every complete
+ * line is published, a partial line stays pending for the next write.
+ */
+static void engine_write(const char *data, size_t length)
+{
+    while (length)
+    {
+        ssize_t consumed = aesd_pending_feed(&pending, data, length);
+
+        if (consumed < 0)
+        {
+            fprintf(stderr, "aesd_pending_feed failed\n");
+            exit(1);
+        }
+        if (aesd_pending_complete(&pending))
+        {
+            aesd_pending_trim(&pending);
+            aesd_engine_publish(&engine, &pending);
+        }
+        data += consumed;
+        length -= consumed;
+    }
+    aesd_pending_end_write(&pending);
+}
+
+
+/* one operation is a page written to the engine */
+static void engine_assemble(unsigned long iterations)
+{
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+        engine_write(chunk, CHUNK_SIZE);
+}
+
+
+static size_t copy_out(void *ctx, const char *src, size_t length)
+{
+    (void)ctx;
+    memcpy(read_buffer, src, length);
+    return length;
+}
+
+
+static void engine_read_setup(void)
+{
+    engine_setup();
+    read_buffer = malloc(CHUNK_SIZE);
+    if (!read_buffer)
+        exit(1);
+    /* a full history of lines */
+    engine_write(chunk, CHUNK_SIZE);
+    engine_write("\n", 1);
+}
+
+
+static void engine_read_teardown(void)
+{
+    free(read_buffer);
+    engine_teardown();
+}
+
+
+/* one operation is a read(2) of up to a page, rewinding at the end of the history */
+static void engine_read(unsigned long iterations)
+{
+    int64_t pos = 0;
+    size_t total = 0;
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        ssize_t result = aesd_engine_read(&engine, &cursor, &pos, 256, 0, copy_out, NULL);
+
+        if (result <= 0)
+            pos = 0;
+        else
+            total += result;
+    }
+    sink = total;
+}
+
+
+static void systemcalls_do_system(unsigned long iterations)
+{
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+        sink = do_system("true");
+}
+
+
+static void systemcalls_do_exec(unsigned long iterations)
+{
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+        sink = do_exec(1, "/bin/true");
+}
+
+
+static void systemcalls_do_exec_redirect(unsigned long iterations)
+{
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+        sink = do_exec_redirect("/dev/null", 2, "/bin/echo", "aesd");
+}
+
+
+/* one operation starts a thread that takes and releases a mutex right away, then joins it */
+static void threading_start_join(unsigned long iterations)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    unsigned long ii;
+
+    for (ii = 0; ii < iterations; ii++)
+    {
+        pthread_t thread;
+        void *result;
+
+        if (!start_thread_obtaining_mutex(&thread, &mutex, 0, 0))
+        {
+            fprintf(stderr, "start_thread_obtaining_mutex failed\n");
+            exit(1);
+        }
+        pthread_join(thread, &result);
+        free(result);
+    }
+}
+
+
+static const struct aesd_bench_case cases[] = {
+    { "circbuf/add", circbuf_setup, circbuf_add, NULL },
+    { "circbuf/add_entries", circbuf_setup, circbuf_add_entries, NULL },
+    { "circbuf/find", circbuf_setup, circbuf_find, NULL },
+    { "circbuf/find_range", circbuf_setup, circbuf_find_range, NULL },
+    { "circbuf/foreach", circbuf_setup, circbuf_foreach, NULL },
+    { "scan/newline", NULL, scan_newline, NULL },
+    { "engine/assemble", engine_setup, engine_assemble, engine_teardown },
+    { "engine/read", engine_read_setup, engine_read, engine_read_teardown },
+    { "systemcalls/do_system", NULL, systemcalls_do_system, NULL },
+    { "systemcalls/do_exec", NULL, systemcalls_do_exec, NULL },
+    { "systemcalls/do_exec_redirect", NULL, systemcalls_do_exec_redirect, NULL },
+    { "threading/start_join", NULL, threading_start_join, NULL },
+};
+
+
+int main(int argc, char *argv[])
+{
+    struct aesd_bench_options opts = {
+        .min_ms = 100,
+        .runs = 5,
+        .threshold_pct = 10.0,
+    };
+    size_t ii;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:r:f:o:b:T:l")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                opts.min_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                opts.runs = strtoul(optarg, NULL, 0);
+                if (opts.runs == 0)
+                    opts.runs = 1;
+                break;
+            case 'f':
+                opts.filter = optarg;
+                break;
+            case 'o':
+                opts.json_path = optarg;
+                break;
+            case 'b':
+                opts.baseline_path = optarg;
+                break;
+            case 'T':
+                opts.threshold_pct = strtod(optarg, NULL);
+                break;
+            case 'l':
+                for (ii = 0; ii < sizeof(cases) / sizeof(cases[0]); ii++)
+                    printf("%s\n", cases[ii].name);
+                return 0;
+            default:
+                fprintf(stderr, "Usage: %s [-m min ms] [-r runs] [-f filter] [-o results.json] [-b baseline.json] "
+                        "[-T threshold %%] [-l]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    fill_chunk();
+    switch (aesd_bench_run_all(cases, sizeof(cases) / sizeof(cases[0]), &opts))
+    {
+        case 0:
+            return 0;
+        case 1:
+            return 1; /* regressions */
+        default:
+            return 2;
+    }
+}
@@ -0,0 +1,250 @@
+/**
+ * @file aesd_bench_harness.c
+ * @brief Calibration, timing, JSON output and baseline comparison for aesd-bench
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd_bench_harness.h"
+
+/* iterations are never scaled by more than this factor at once, the first runs are noisy */
+#define CALIBRATE_MAX_GROWTH 100
+
+struct aesd_bench_result
+{
+    const char *name;
+    unsigned long iterations;
+    double ns_per_op; /* median of the runs */
+    double min_ns_per_op;
+    double baseline_ns_per_op; /* 0 if the case is not in the baseline */
+};
+
+
+uint64_t aesd_bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t time_run(const struct aesd_bench_case *bench_case, unsigned long iterations)
+{
+    uint64_t start = aesd_bench_now_ns();
+
+    bench_case->run(iterations);
+    return aesd_bench_now_ns() - start;
+}
+
+
+/**
+ * @return the number of iterations for which one run of @param bench_case takes at least
+ * @param min_ns
+ */
+static unsigned long calibrate(const struct aesd_bench_case *bench_case, uint64_t min_ns)
+{
+    unsigned long iterations = 1;
+
+    for (;;)
+    {
+        uint64_t elapsed = time_run(bench_case, iterations);
+        double growth;
+
+        if (elapsed >= min_ns)
+            return iterations;
+        /* aim 20% past the target so the next attempt usually is the last */
+        growth = elapsed ? 1.2 * min_ns / elapsed : CALIBRATE_MAX_GROWTH;
+        if (growth > CALIBRATE_MAX_GROWTH)
+            growth = CALIBRATE_MAX_GROWTH;
+        if (growth < 2)
+            growth = 2;
+        iterations = (unsigned long)(iterations * growth);
+    }
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Looks up the ns_per_op of @param name in @param json, the text of a file written by
+ * write_json().
+ * @return the baseline value, or 0 if the case is not in the baseline
+ */
+static double baseline_lookup(const char *json, const char *name)
+{
+    char key[256];
+    const char *found;
+    double value;
+
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    found = strstr(json, key);
+    if (!found)
+        return 0;
+    found = strstr(found, "\"ns_per_op\":");
+    if (!found || sscanf(found, "\"ns_per_op\": %lf", &value) != 1)
+        return 0;
+    return value;
+}
+
+
+/**
+ * @return the contents of @param path as a string to be freed by the caller, or NULL
+ */
+static char *read_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char *data = NULL;
+    long size;
+
+    if (!file)
+        return NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0)
+    {
+        data = malloc(size + 1);
+        if (data && fread(data, 1, size, file) == (size_t)size)
+            data[size] = '\0';
+        else
+        {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+
+static int write_json(const char *path, const struct aesd_bench_result *results, size_t nresults,
+                      const struct aesd_bench_options *opts)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    size_t ii;
+
+    if (!file)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(file, "{\n  \"min_ms\": %u,\n  \"runs\": %u,\n  \"benchmarks\": [\n", opts->min_ms, opts->runs);
+    for (ii = 0; ii < nresults; ii++)
+    {
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f}%s\n",
+                results[ii].name, results[ii].iterations, results[ii].ns_per_op, results[ii].min_ns_per_op,
+                ii + 1 < nresults ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    if (file != stdout)
+        fclose(file);
+    return 0;
+}
+
+
+/**
+ * Times every case of @param cases matching the filter in @param opts, prints a table of the
+ * results and writes and compares them as requested in @param opts.
+ * @return 0 on success, 1 if a case regressed against the baseline, -1 on errors
+ */
+int aesd_bench_run_all(const struct aesd_bench_case *cases, size_t ncases, const struct aesd_bench_options *opts)
+{
+    struct aesd_bench_result *results = calloc(ncases, sizeof(*results));
+    double *samples = calloc(opts->runs, sizeof(*samples));
+    char *baseline = NULL;
+    size_t nresults = 0;
+    size_t regressions = 0;
+    size_t ii;
+    unsigned int run;
+    int retval = 0;
+    /* the table goes to stderr when the JSON goes to stdout */
+    FILE *out = (opts->json_path && strcmp(opts->json_path, "-") == 0) ? stderr : stdout;
+
+    if (!results || !samples)
+    {
+        free(results);
+        free(samples);
+        return -1;
+    }
+
+    if (opts->baseline_path)
+    {
+        baseline = read_file(opts->baseline_path);
+        if (!baseline)
+        {
+            perror(opts->baseline_path);
+            free(results);
+            free(samples);
+            return -1;
+        }
+    }
+
+    fprintf(out, "%-32s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "baseline", "change");
+    for (ii = 0; ii < ncases; ii++)
+    {
+        const struct aesd_bench_case *bench_case = &cases[ii];
+        struct aesd_bench_result *result = &results[nresults];
+        unsigned long iterations;
+
+        if (opts->filter && !strstr(bench_case->name, opts->filter))
+            continue;
+
+        if (bench_case->setup)
+            bench_case->setup();
+        iterations = calibrate(bench_case, (uint64_t)opts->min_ms * 1000000);
+        for (run = 0; run < opts->runs; run++)
+            samples[run] = (double)time_run(bench_case, iterations) / iterations;
+        if (bench_case->teardown)
+            bench_case->teardown();
+
+        qsort(samples, opts->runs, sizeof(*samples), compare_double);
+        result->name = bench_case->name;
+        result->iterations = iterations;
+        result->ns_per_op = samples[opts->runs / 2];
+        result->min_ns_per_op = samples[0];
+        result->baseline_ns_per_op = baseline ? baseline_lookup(baseline, bench_case->name) : 0;
+        nresults++;
+
+        fprintf(out, "%-32s %12lu %12.2f", result->name, result->iterations, result->ns_per_op);
+        if (result->baseline_ns_per_op > 0)
+        {
+            double change = 100.0 * (result->ns_per_op - result->baseline_ns_per_op) / result->baseline_ns_per_op;
+            bool regressed = change > opts->threshold_pct;
+
+            fprintf(out, " %12.2f %+11.1f%%%s", result->baseline_ns_per_op, change, regressed ? "  REGRESSION" : "");
+            if (regressed)
+                regressions++;
+        }
+        else if (baseline)
+            fprintf(out, " %12s", "new");
+        fprintf(out, "\n");
+        fflush(out);
+    }
+
+    if (opts->json_path && write_json(opts->json_path, results, nresults, opts) != 0)
+        retval = -1;
+    if (baseline)
+    {
+        fprintf(out, "%zu of %zu benchmarks regressed by more than %.1f%%\n", regressions, nresults, opts->threshold_pct);
+        if (regressions && retval == 0)
+            retval = 1;
+    }
+
+    free(baseline);
+    free(results);
+    free(samples);
+    return retval;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file aesd_bench_harness.h
+ * @brief Minimal timing harness for aesd-bench: calibrates the iterations of each case to a
+ * minimum run time, takes the median of several runs, writes the results as JSON and compares
+ * them with a baseline written by an earlier run.
+ *
+ * @author rohanventer2010
+ *
+ */
+
+#ifndef AESD_BENCH_HARNESS_H
+#define AESD_BENCH_HARNESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct aesd_bench_case
+{
+    /**
+     * Unique name, "area/operation", used to match results against the baseline
+     */
+    const char *name;
+    /**
+     * Optional, called once before the case is timed
+     */
+    void (*setup)(void);
+    /**
+     * Performs @param iterations operations, only this call is timed
+     */
+    void (*run)(unsigned long iterations);
+    /**
+     * Optional, called once after the case was timed
+     */
+    void (*teardown)(void);
+};
+
+struct aesd_bench_options
+{
+    /**
+     * Minimum duration of one timed run in ms, the iterations are scaled up until it is reached
+     */
+    unsigned int min_ms;
+    /**
+     * Number of timed runs per case, the median is reported
+     */
+    unsigned int runs;
+    /**
+     * Only cases whose name contains this string are run, all if NULL
+     */
+    const char *filter;
+    /**
+     * Path the JSON results are written to, "-" for stdout, none if NULL
+     */
+    const char *json_path;
+    /**
+     * Path of the JSON results of an earlier run to compare with, none if NULL
+     */
+    const char *baseline_path;
+    /**
+     * A case is a regression when its median is more than this many percent above the baseline
+     */
+    double threshold_pct;
+};
+
+extern uint64_t aesd_bench_now_ns(void);
+
+extern int aesd_bench_run_all(const struct aesd_bench_case *cases, size_t ncases, const struct aesd_bench_options *opts);
+
+#endif /* AESD_BENCH_HARNESS_H */
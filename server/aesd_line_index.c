@@ -0,0 +1,174 @@
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd_line_index.h"
+
+/* offsets allocated up front, doubled whenever the index is full */
+#define LINE_INDEX_INITIAL_CAPACITY 1024
+
+/* bytes of history read at a time when a mapped index scans the lines already written */
+#define LINE_INDEX_SCAN_SIZE (64 * 1024)
+
+
+int aesd_line_index_init(struct aesd_line_index *index)
+{
+  index->starts = malloc(LINE_INDEX_INITIAL_CAPACITY * sizeof(*index->starts));
+  if (!index->starts)
+    return -ENOMEM;
+  index->starts[0] = 0;
+  index->count = 0;
+  index->capacity = LINE_INDEX_INITIAL_CAPACITY;
+  index->scanned = 0;
+  index->mapped = false;
+  return 0;
+}
+
+
+/**
+ * Sets up an index in an anonymous mapping for the history in data_fd and scans the lines it
+ * already holds.
+ * Returns 0, or a negative errno
+ */
+int aesd_line_index_map(struct aesd_line_index *index, int data_fd)
+{
+  char *buffer;
+  ssize_t bytes_read;
+  int ret;
+
+  index->starts = mmap(NULL, LINE_INDEX_INITIAL_CAPACITY * sizeof(*index->starts), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (index->starts == MAP_FAILED)
+  {
+    index->starts = NULL;
+    return -errno;
+  }
+  index->starts[0] = 0;
+  index->count = 0;
+  index->capacity = LINE_INDEX_INITIAL_CAPACITY;
+  index->scanned = 0;
+  index->mapped = true;
+
+  buffer = malloc(LINE_INDEX_SCAN_SIZE);
+  if (!buffer)
+  {
+    aesd_line_index_free(index);
+    return -ENOMEM;
+  }
+  while ((bytes_read = pread(data_fd, buffer, LINE_INDEX_SCAN_SIZE, index->scanned)) != 0)
+  {
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    ret = (bytes_read < 0) ? -errno : aesd_line_index_scan(index, buffer, bytes_read);
+    if (ret != 0)
+    {
+      free(buffer);
+      aesd_line_index_free(index);
+      return ret;
+    }
+  }
+  free(buffer);
+  return 0;
+}
+
+
+void aesd_line_index_free(struct aesd_line_index *index)
+{
+  if (index->mapped)
+    munmap(index->starts, index->capacity * sizeof(*index->starts));
+  else
+    free(index->starts);
+  index->starts = NULL;
+  index->mapped = false;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+
+/* doubles the room for offsets, a mapped index moves its pages instead of copying them */
+static int grow(struct aesd_line_index *index)
+{
+  size_t capacity = 2 * index->capacity;
+  uint64_t *bigger;
+
+  if (index->mapped)
+  {
+    bigger = mremap(index->starts, index->capacity * sizeof(*index->starts), capacity * sizeof(*index->starts),
+                    MREMAP_MAYMOVE);
+    if (bigger == MAP_FAILED)
+      return -errno;
+  }
+  else
+  {
+    bigger = realloc(index->starts, capacity * sizeof(*index->starts));
+    if (!bigger)
+      return -ENOMEM;
+  }
+  index->starts = bigger;
+  index->capacity = capacity;
+  return 0;
+}
+
+
+/**
+ * Adds the lines completed by the length bytes of data, which are the bytes of the history
+ * right after the bytes scanned before.
+ * Returns 0, or a negative errno with the index left at the last line it could record, which
+ * the history has then moved past
+ */
+int aesd_line_index_scan(struct aesd_line_index *index, const char *data, size_t length)
+{
+  const char *end = data + length;
+  const char *newline;
+  uint64_t offset = index->scanned;
+  int ret = 0;
+
+  while ((newline = memchr(data, '\n', end - data)) != NULL)
+  {
+    if (index->count + 1 == index->capacity && (ret = grow(index)) != 0)
+      break;
+    offset += newline + 1 - data;
+    data = newline + 1;
+    index->starts[++index->count] = offset;
+  }
+  index->scanned = (ret == 0) ? offset + (end - data) : offset;
+  return ret;
+}
+
+
+/**
+ * Looks up the bytes [start, end) of count lines from line first, fewer when the history ends
+ * sooner. An empty range is returned when first is past the last line
+ */
+void aesd_line_index_range(const struct aesd_line_index *index, uint64_t first, uint64_t count,
+                           uint64_t *start, uint64_t *end)
+{
+  uint64_t last;
+
+  if (first > index->count)
+    first = index->count;
+  last = (count > index->count - first) ? index->count : first + count;
+  *start = index->starts[first];
+  *end = index->starts[last];
+}
+
+
+/**
+ * Finds the offset of byte write_cmd_offset of line write_cmd, as AESDCHAR_IOCSEEKTO does for
+ * the write commands of aesdchar, in O(1).
+ * Returns 0, or -EINVAL if the history has no such line or byte
+ */
+int aesd_line_index_seekto(const struct aesd_line_index *index, uint32_t write_cmd, uint32_t write_cmd_offset,
+                           uint64_t *offset)
+{
+  if (write_cmd >= index->count ||
+      write_cmd_offset >= index->starts[write_cmd + 1] - index->starts[write_cmd])
+    return -EINVAL;
+
+  *offset = index->starts[write_cmd] + write_cmd_offset;
+  return 0;
+}
@@ -0,0 +1,38 @@
+
+#ifndef _AESD_LINE_INDEX_H_
+#define _AESD_LINE_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Byte offsets of the lines of a history, so a range of lines maps to a range of bytes without
+ * scanning for '\n'. starts[i] is the offset of line i and starts[count] the offset past the
+ * last complete line, where the next line starts. The index only grows, by scanning the bytes
+ * appended to the history.
+ *
+ * The index lives on the heap (aesd_line_index_init) or, for a history that keeps growing, in an
+ * anonymous mapping (aesd_line_index_map) that mremap grows without copying the offsets. It
+ * lasts as long as the process, like the history file aesdsocket removes when it exits.
+ * Any necessary locking must be performed by the caller.
+ */
+struct aesd_line_index
+{
+  uint64_t *starts;   /* count + 1 offsets */
+  size_t count;       /* complete lines, ending in '\n' */
+  size_t capacity;    /* offsets starts has room for */
+  uint64_t scanned;   /* bytes of the history scanned so far */
+  bool mapped;        /* starts is an anonymous mapping, not on the heap */
+};
+
+int aesd_line_index_init(struct aesd_line_index *index);
+int aesd_line_index_map(struct aesd_line_index *index, int data_fd);
+void aesd_line_index_free(struct aesd_line_index *index);
+int aesd_line_index_scan(struct aesd_line_index *index, const char *data, size_t length);
+void aesd_line_index_range(const struct aesd_line_index *index, uint64_t first, uint64_t count,
+                           uint64_t *start, uint64_t *end);
+int aesd_line_index_seekto(const struct aesd_line_index *index, uint32_t write_cmd, uint32_t write_cmd_offset,
+                           uint64_t *offset);
+
+#endif /* _AESD_LINE_INDEX_H_ */
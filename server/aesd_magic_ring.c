@@ -0,0 +1,157 @@
+
+#define _GNU_SOURCE /* memfd_create */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd_magic_ring.h"
+
+/**
+ * Sets up an empty ring of at least capacity bytes, rounded up to whole pages, holding at most
+ * 1 << AESD_MAGIC_RING_ENTRIES_ORDER entries.
+ * Returns 0 on success, -errno if the memfd or one of its mappings could not be set up
+ */
+int aesd_magic_ring_init(struct aesd_magic_ring *ring, size_t capacity)
+{
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  char *base;
+  int err;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  ring->capacity = (capacity + page_size - 1) / page_size * page_size;
+  if (ring->capacity == 0)
+    ring->capacity = page_size;
+
+  ring->entries = malloc(sizeof(*ring->entries));
+  if (!ring->entries)
+    return -ENOMEM;
+  aesd_magic_ring_entries_init(ring->entries);
+
+  ring->fd = memfd_create("aesdsocket-history", MFD_CLOEXEC);
+  if (ring->fd < 0 || ftruncate(ring->fd, ring->capacity) != 0)
+    goto fail;
+
+  /* reserve both halves first so nothing else can be mapped in between */
+  base = mmap(NULL, 2 * ring->capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    goto fail;
+  ring->base = base;
+  if (mmap(base, ring->capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ring->fd, 0) == MAP_FAILED ||
+      mmap(base + ring->capacity, ring->capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ring->fd, 0) == MAP_FAILED)
+    goto fail;
+  return 0;
+
+fail:
+  err = errno;
+  aesd_magic_ring_free(ring);
+  return -err;
+}
+
+
+void aesd_magic_ring_free(struct aesd_magic_ring *ring)
+{
+  if (ring->base)
+    munmap(ring->base, 2 * ring->capacity);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring->entries);
+  ring->base = NULL;
+  ring->fd = -1;
+  ring->entries = NULL;
+}
+
+
+/* drops the oldest entry, the history then starts at the next one */
+static void drop_oldest(struct aesd_magic_ring *ring)
+{
+  uint64_t next = (aesd_magic_ring_count(ring) > 1) ?
+    *aesd_magic_ring_entries_at(ring->entries, 1) : ring->committed;
+
+  ring->dropped_bytes += next - ring->tail;
+  ring->tail = next;
+  aesd_magic_ring_entries_pop(ring->entries, NULL);
+}
+
+
+/**
+ * Appends length bytes of data, every '\n' completes an entry. The oldest entries are dropped
+ * when the bytes or the entries don't fit otherwise.
+ * Returns 0 on success, -EMSGSIZE if the partial line with data would not fit in the whole ring,
+ * the partial line is then discarded
+ */
+int aesd_magic_ring_append(struct aesd_magic_ring *ring, const char *data, size_t length)
+{
+  uint64_t end;
+  const char *newline;
+  const char *scan;
+
+  if (ring->head - ring->committed + length > ring->capacity)
+  {
+    ring->head = ring->committed;
+    return -EMSGSIZE;
+  }
+
+  while (ring->head + length - ring->tail > ring->capacity)
+    drop_oldest(ring);
+
+  /* the second mapping takes whatever runs past the end of the first one */
+  memcpy(ring->base + ring->head % ring->capacity, data, length);
+  end = ring->head + length;
+
+  scan = data;
+  while ((newline = memchr(scan, '\n', data + length - scan)) != NULL)
+  {
+    if (aesd_magic_ring_entries_full(ring->entries))
+      drop_oldest(ring);
+    aesd_magic_ring_entries_push(ring->entries, &ring->committed, NULL);
+    ring->committed = ring->head + (newline - data) + 1;
+    scan = newline + 1;
+  }
+
+  ring->head = end;
+  return 0;
+}
+
+
+/**
+ * Returns the contiguous span of the history from offset, counted from the oldest entry, to the
+ * end of the newest complete line with its length in length, or NULL if offset is at or past
+ * the end. The span is valid until the next append.
+ */
+const char *aesd_magic_ring_window(const struct aesd_magic_ring *ring, uint64_t offset, size_t *length)
+{
+  if (offset >= aesd_magic_ring_size(ring))
+    return NULL;
+
+  *length = aesd_magic_ring_size(ring) - offset;
+  return ring->base + (ring->tail + offset) % ring->capacity;
+}
+
+
+/**
+ * Same semantics as AESDCHAR_IOCSEEKTO: stores in offset the position of byte write_cmd_offset
+ * of entry write_cmd, both counted from 0 and from the oldest entry, without walking the entries.
+ * Returns 0 on success, -EINVAL if there is no such entry or byte
+ */
+int aesd_magic_ring_seekto(const struct aesd_magic_ring *ring, uint32_t write_cmd, uint32_t write_cmd_offset,
+                           uint64_t *offset)
+{
+  uint64_t start;
+  uint64_t end;
+
+  if (write_cmd >= aesd_magic_ring_count(ring))
+    return -EINVAL;
+
+  start = *aesd_magic_ring_entries_at(ring->entries, write_cmd);
+  end = (write_cmd + 1 < aesd_magic_ring_count(ring)) ?
+    *aesd_magic_ring_entries_at(ring->entries, write_cmd + 1) : ring->committed;
+  if (write_cmd_offset >= end - start)
+    return -EINVAL;
+
+  *offset = start - ring->tail + write_cmd_offset;
+  return 0;
+}
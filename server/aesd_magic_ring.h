@@ -0,0 +1,63 @@
+
+#ifndef _AESD_MAGIC_RING_H_
+#define _AESD_MAGIC_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-ring.h"
+
+/**
+ * In-memory history of aesdsocket: a byte ring backed by a memfd that is mapped twice back to
+ * back, so the bytes at base[capacity .. 2 * capacity) are the bytes at base[0 .. capacity)
+ * again. Any window of the history, even one crossing the end of the ring, is then a single
+ * contiguous span that goes out with one send() instead of being split at the wrap point.
+ *
+ * Lines ending in '\n' are the entries of the history, like the write commands of aesdchar:
+ * a partial line is kept but not visible until its '\n' arrives, and when the ring is full the
+ * oldest entries are dropped whole. Offsets are counted from the first byte of the oldest
+ * entry, as the file position of aesdchar is, so AESDCHAR_IOCSEEKTO:X,Y resolves the same way.
+ * Any necessary locking must be performed by the caller.
+ */
+/* lines kept at most, besides the byte size */
+#define AESD_MAGIC_RING_ENTRIES_ORDER 16
+
+/* stream offsets of the entries, oldest first */
+AESD_RING_DECLARE(aesd_magic_ring_entries, uint64_t, AESD_MAGIC_RING_ENTRIES_ORDER)
+
+struct aesd_magic_ring
+{
+  char *base;            /* capacity bytes mapped twice back to back */
+  size_t capacity;       /* a multiple of the page size */
+  int fd;                /* memfd backing both mappings */
+  uint64_t tail;         /* stream offset of the oldest entry */
+  uint64_t committed;    /* stream offset past the newest complete line */
+  uint64_t head;         /* stream offset past the last byte appended */
+  struct aesd_magic_ring_entries *entries; /* where each entry starts */
+  uint64_t dropped_bytes; /* bytes of the entries dropped to make room */
+};
+
+int aesd_magic_ring_init(struct aesd_magic_ring *ring, size_t capacity);
+void aesd_magic_ring_free(struct aesd_magic_ring *ring);
+int aesd_magic_ring_append(struct aesd_magic_ring *ring, const char *data, size_t length);
+const char *aesd_magic_ring_window(const struct aesd_magic_ring *ring, uint64_t offset, size_t *length);
+int aesd_magic_ring_seekto(const struct aesd_magic_ring *ring, uint32_t write_cmd, uint32_t write_cmd_offset,
+                           uint64_t *offset);
+
+/**
+ * Returns the number of bytes visible in the history, the complete lines
+ */
+static inline uint64_t aesd_magic_ring_size(const struct aesd_magic_ring *ring)
+{
+  return ring->committed - ring->tail;
+}
+
+/**
+ * Returns the number of entries in the history
+ */
+static inline uint64_t aesd_magic_ring_count(const struct aesd_magic_ring *ring)
+{
+  return aesd_magic_ring_entries_count(ring->entries);
+}
+
+#endif /* _AESD_MAGIC_RING_H_ */
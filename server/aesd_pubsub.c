@@ -0,0 +1,185 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "aesd_pubsub.h"
+
+
+int aesd_pubsub_init(struct aesd_pubsub *pubsub, unsigned int order, enum aesd_pubsub_policy policy)
+{
+  memset(pubsub, 0, sizeof(*pubsub));
+  pubsub->batches = calloc((size_t)1 << order, sizeof(*pubsub->batches));
+  if (!pubsub->batches)
+    return -ENOMEM;
+  pubsub->mask = ((uint64_t)1 << order) - 1;
+  pubsub->policy = policy;
+  atomic_init(&pubsub->subscribers, 0);
+  pthread_mutex_init(&pubsub->lock, NULL);
+  pthread_cond_init(&pubsub->published, NULL);
+  return 0;
+}
+
+
+/**
+ * Frees the feed, once every subscriber is gone
+ */
+void aesd_pubsub_free(struct aesd_pubsub *pubsub)
+{
+  uint64_t slot;
+
+  for (slot = 0; slot <= pubsub->mask; slot++)
+    if (pubsub->batches[slot])
+      aesd_batch_put(pubsub->batches[slot]);
+  free(pubsub->batches);
+  pubsub->batches = NULL;
+  pthread_cond_destroy(&pubsub->published);
+  pthread_mutex_destroy(&pubsub->lock);
+}
+
+
+/**
+ * Publishes the bytes of iov as one batch, copied once for every subscriber.
+ * Returns 0, or -ENOMEM
+ */
+int aesd_pubsub_publish(struct aesd_pubsub *pubsub, const struct iovec *iov, int iovcnt)
+{
+  struct aesd_batch *batch;
+  struct aesd_batch *old;
+  size_t size = 0;
+  int ii;
+
+  for (ii = 0; ii < iovcnt; ii++)
+    size += iov[ii].iov_len;
+
+  /* serialized outside the lock */
+  batch = malloc(sizeof(*batch) + size);
+  if (!batch)
+    return -ENOMEM;
+  batch->size = 0;
+  for (ii = 0; ii < iovcnt; ii++)
+  {
+    memcpy(batch->data + batch->size, iov[ii].iov_base, iov[ii].iov_len);
+    batch->size += iov[ii].iov_len;
+  }
+  atomic_init(&batch->refs, 1);
+
+  pthread_mutex_lock(&pubsub->lock);
+  batch->seq = pubsub->head;
+  old = pubsub->batches[pubsub->head & pubsub->mask];
+  pubsub->batches[pubsub->head & pubsub->mask] = batch;
+  pubsub->head++;
+  if (pubsub->waiting > 0)
+    pthread_cond_broadcast(&pubsub->published);
+  pthread_mutex_unlock(&pubsub->lock);
+
+  /* a subscriber still sending the old batch keeps it alive */
+  if (old)
+    aesd_batch_put(old);
+  return 0;
+}
+
+
+/**
+ * Subscribes to the batches published from now on
+ */
+void aesd_pubsub_subscribe(struct aesd_pubsub *pubsub, struct aesd_subscription *subscription)
+{
+  pthread_mutex_lock(&pubsub->lock);
+  subscription->next = pubsub->head;
+  subscription->dropped = 0;
+  subscription->disconnected = false;
+  atomic_fetch_add_explicit(&pubsub->subscribers, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&pubsub->lock);
+}
+
+
+void aesd_pubsub_unsubscribe(struct aesd_pubsub *pubsub, struct aesd_subscription *subscription)
+{
+  (void)subscription;
+  atomic_fetch_sub_explicit(&pubsub->subscribers, 1, memory_order_relaxed);
+}
+
+
+static void unlock_cleanup(void *lock)
+{
+  pthread_mutex_unlock(lock);
+}
+
+
+/**
+ * Waits for the next batches of subscription and stores up to max of them in batches, each with
+ * a reference for the caller to drop with aesd_batch_put once sent. A subscriber lapped by the
+ * feed skips to the oldest batch kept, or gets none under AESD_PUBSUB_DISCONNECT.
+ * Returns the number of batches stored, 0 once the feed is closed or the subscriber is
+ * disconnected. May be cancelled while waiting
+ */
+size_t aesd_pubsub_next(struct aesd_pubsub *pubsub, struct aesd_subscription *subscription,
+                        struct aesd_batch **batches, size_t max)
+{
+  size_t count = 0;
+  uint64_t behind;
+
+  pthread_mutex_lock(&pubsub->lock);
+  pthread_cleanup_push(unlock_cleanup, &pubsub->lock);
+
+  while (!pubsub->closed && subscription->next == pubsub->head)
+  {
+    pubsub->waiting++;
+    pthread_cond_wait(&pubsub->published, &pubsub->lock);
+    pubsub->waiting--;
+  }
+
+  behind = pubsub->head - subscription->next;
+  if (!pubsub->closed && behind > pubsub->mask + 1)
+  {
+    if (pubsub->policy == AESD_PUBSUB_DISCONNECT)
+    {
+      pubsub->disconnected++;
+      subscription->disconnected = true;
+      behind = 0;
+    }
+    else
+    {
+      subscription->dropped += behind - (pubsub->mask + 1);
+      pubsub->dropped += behind - (pubsub->mask + 1);
+      subscription->next = pubsub->head - (pubsub->mask + 1);
+      behind = pubsub->mask + 1;
+    }
+  }
+
+  /* everything already published goes in one go, one lock round trip for many batches */
+  while (!pubsub->closed && count < behind && count < max)
+  {
+    struct aesd_batch *batch = pubsub->batches[subscription->next & pubsub->mask];
+
+    atomic_fetch_add_explicit(&batch->refs, 1, memory_order_relaxed);
+    batches[count++] = batch;
+    subscription->next++;
+  }
+
+  pthread_cleanup_pop(1);
+  return count;
+}
+
+
+/**
+ * Wakes every subscriber up for good, aesd_pubsub_next returns 0 from now on
+ */
+void aesd_pubsub_close(struct aesd_pubsub *pubsub)
+{
+  pthread_mutex_lock(&pubsub->lock);
+  pubsub->closed = true;
+  pthread_cond_broadcast(&pubsub->published);
+  pthread_mutex_unlock(&pubsub->lock);
+}
+
+
+/**
+ * Drops a reference to batch, freeing it with the last one. Needs no lock
+ */
+void aesd_batch_put(struct aesd_batch *batch)
+{
+  if (atomic_fetch_sub_explicit(&batch->refs, 1, memory_order_acq_rel) == 1)
+    free(batch);
+}
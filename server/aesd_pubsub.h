@@ -0,0 +1,76 @@
+
+#ifndef _AESD_PUBSUB_H_
+#define _AESD_PUBSUB_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Live feed of the lines committed to aesdsocket's history, for SUBSCRIBE clients.
+ *
+ * Each committed batch is copied once into an immutable, reference counted aesd_batch and put
+ * in a ring of the last mask + 1 batches shared by every subscriber. Publishing costs the same
+ * for one subscriber or a thousand: subscribers follow the ring at their own pace, each taking
+ * a reference on the batch it sends, and the ring drops its own reference when the slot is
+ * reused. A subscriber that falls more than a ring behind either skips the batches it missed
+ * or is disconnected, and both are counted.
+ */
+struct aesd_batch
+{
+  uint64_t seq;              /* position in the feed */
+  _Atomic unsigned int refs;
+  size_t size;               /* bytes in data */
+  char data[];
+};
+
+enum aesd_pubsub_policy
+{
+  AESD_PUBSUB_DROP,          /* a lapped subscriber skips to the oldest batch kept */
+  AESD_PUBSUB_DISCONNECT,    /* a lapped subscriber is dropped */
+};
+
+struct aesd_pubsub
+{
+  pthread_mutex_t lock;
+  pthread_cond_t published;      /* broadcast for a batch when somebody waits, and on close */
+  unsigned int waiting;          /* subscribers waiting on published */
+  struct aesd_batch **batches;   /* ring of the last mask + 1 batches */
+  uint64_t mask;
+  uint64_t head;                 /* batches published so far */
+  enum aesd_pubsub_policy policy;
+  bool closed;
+  _Atomic unsigned int subscribers;
+  uint64_t dropped;              /* batches skipped by lapped subscribers */
+  uint64_t disconnected;         /* subscribers dropped for being lapped */
+};
+
+struct aesd_subscription
+{
+  uint64_t next;                 /* seq of the next batch to send */
+  uint64_t dropped;              /* batches this subscriber skipped */
+  bool disconnected;             /* lapped under AESD_PUBSUB_DISCONNECT */
+};
+
+int aesd_pubsub_init(struct aesd_pubsub *pubsub, unsigned int order, enum aesd_pubsub_policy policy);
+void aesd_pubsub_free(struct aesd_pubsub *pubsub);
+int aesd_pubsub_publish(struct aesd_pubsub *pubsub, const struct iovec *iov, int iovcnt);
+void aesd_pubsub_subscribe(struct aesd_pubsub *pubsub, struct aesd_subscription *subscription);
+void aesd_pubsub_unsubscribe(struct aesd_pubsub *pubsub, struct aesd_subscription *subscription);
+size_t aesd_pubsub_next(struct aesd_pubsub *pubsub, struct aesd_subscription *subscription,
+                        struct aesd_batch **batches, size_t max);
+void aesd_pubsub_close(struct aesd_pubsub *pubsub);
+void aesd_batch_put(struct aesd_batch *batch);
+
+/**
+ * Returns whether anybody is subscribed, without taking the lock
+ */
+static inline bool aesd_pubsub_has_subscribers(struct aesd_pubsub *pubsub)
+{
+  return atomic_load_explicit(&pubsub->subscribers, memory_order_relaxed) > 0;
+}
+
+#endif /* _AESD_PUBSUB_H_ */
@@ -0,0 +1,235 @@
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aesd_query.h"
+
+/* spans of matching lines gathered before they go out with one sendmsg() */
+#define GREP_SPANS 64
+
+
+/* parses the decimal number at *text, moving *text past it, returns -EINVAL without digits */
+static int parse_number(const char **text, const char *end, uint64_t *number)
+{
+  const char *digit = *text;
+
+  *number = 0;
+  while (digit < end && *digit >= '0' && *digit <= '9')
+  {
+    if (*number > (UINT64_MAX - 9) / 10)
+      return -EINVAL;
+    *number = *number * 10 + (*digit++ - '0');
+  }
+  if (digit == *text)
+    return -EINVAL;
+  *text = digit;
+  return 0;
+}
+
+
+/**
+ * Parses the first line of the length bytes at command as a query.
+ * Returns 0 with query filled in, or -EINVAL when the line is not a complete, well formed
+ * query and should be written to the history as any other line
+ */
+int aesd_query_parse(const char *command, size_t length, struct aesd_query *query)
+{
+  const char *newline = memchr(command, '\n', length);
+  const char *text;
+
+  if (!newline)
+    return -EINVAL;
+
+  if (newline - command > 4 && memcmp(command, "GET ", 4) == 0)
+  {
+    text = command + 4;
+    query->type = AESD_QUERY_GET;
+    if (parse_number(&text, newline, &query->first) != 0 || text == newline || *text++ != ' ' ||
+        parse_number(&text, newline, &query->count) != 0)
+      return -EINVAL;
+    return (text == newline) ? 0 : -EINVAL;
+  }
+
+  if (newline - command > 5 && memcmp(command, "TAIL ", 5) == 0)
+  {
+    text = command + 5;
+    query->type = AESD_QUERY_TAIL;
+    query->first = 0;
+    if (parse_number(&text, newline, &query->count) != 0)
+      return -EINVAL;
+    return (text == newline) ? 0 : -EINVAL;
+  }
+
+  if (newline - command > 5 && memcmp(command, "GREP ", 5) == 0)
+  {
+    query->type = AESD_QUERY_GREP;
+    query->literal = command + 5;
+    query->literal_length = newline - query->literal;
+    return 0;
+  }
+
+  return -EINVAL;
+}
+
+
+/**
+ * Resolves a GET or TAIL query against a history of lines lines into the lines [first,
+ * first + count) to send, clamped to the history
+ */
+void aesd_query_lines(const struct aesd_query *query, uint64_t lines, uint64_t *first, uint64_t *count)
+{
+  if (query->type == AESD_QUERY_TAIL)
+  {
+    *first = (query->count < lines) ? lines - query->count : 0;
+    *count = lines - *first;
+    return;
+  }
+
+  *first = (query->first < lines) ? query->first : lines;
+  *count = (query->count < lines - *first) ? query->count : lines - *first;
+}
+
+
+/**
+ * Returns the first occurrence of literal in the length bytes at data, or NULL.
+ * With SSE2 16 positions are tested at once against the first and the last byte of literal and
+ * only the positions matching both are compared in full, which skips most of a history that
+ * does not contain the literal at memory speed
+ */
+const char *aesd_find_literal(const char *data, size_t length, const char *literal, size_t literal_length)
+{
+  if (literal_length == 0)
+    return data;
+  if (literal_length > length)
+    return NULL;
+  if (literal_length == 1)
+    return memchr(data, literal[0], length);
+
+#ifdef __SSE2__
+  const __m128i first = _mm_set1_epi8(literal[0]);
+  const __m128i last = _mm_set1_epi8(literal[literal_length - 1]);
+  size_t positions = length - literal_length + 1;
+  size_t pos = 0;
+
+  for (; pos + 16 <= positions; pos += 16)
+  {
+    __m128i block_first = _mm_loadu_si128((const __m128i *)(data + pos));
+    __m128i block_last = _mm_loadu_si128((const __m128i *)(data + pos + literal_length - 1));
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+
+    while (mask)
+    {
+      unsigned int bit = __builtin_ctz(mask);
+
+      if (memcmp(data + pos + bit + 1, literal + 1, literal_length - 2) == 0)
+        return data + pos + bit;
+      mask &= mask - 1;
+    }
+  }
+
+  /* the last positions, fewer than a block */
+  if (pos < positions)
+    return memmem(data + pos, length - pos, literal, literal_length);
+  return NULL;
+#else
+  return memmem(data, length, literal, literal_length);
+#endif
+}
+
+
+/* sends the spans of iov, returns the number of bytes sent or -1 */
+static ssize_t send_spans(int sock_fd, struct iovec *iov, int spans)
+{
+  struct msghdr msg;
+  ssize_t total = 0;
+  ssize_t bytes_sent;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = spans;
+  while (msg.msg_iovlen > 0)
+  {
+    bytes_sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+    if (bytes_sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return total ? total : -1;
+    }
+    total += bytes_sent;
+
+    /* skip what went out, a partial span is resumed */
+    while (msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len)
+    {
+      bytes_sent -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0)
+    {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + bytes_sent;
+      msg.msg_iov->iov_len -= bytes_sent;
+    }
+  }
+  return total;
+}
+
+
+/**
+ * Sends to sock_fd every line of the length bytes at data that contains literal. Neighbouring
+ * matching lines are sent as one span, straight from data.
+ * Returns the number of bytes sent, or -1 if nothing could be sent
+ */
+ssize_t aesd_query_grep(int sock_fd, const char *data, size_t length, const char *literal, size_t literal_length)
+{
+  struct iovec iov[GREP_SPANS];
+  int spans = 0;
+  ssize_t total = 0;
+  ssize_t bytes_sent;
+  const char *end = data + length;
+  const char *line = data; /* always the start of a line */
+  const char *match;
+
+  while (line < end && (match = aesd_find_literal(line, end - line, literal, literal_length)) != NULL)
+  {
+    const char *line_start = memrchr(line, '\n', match - line);
+    const char *line_end = memchr(match + literal_length, '\n', end - match - literal_length);
+
+    line_start = line_start ? line_start + 1 : line;
+    line_end = line_end ? line_end + 1 : end;
+
+    if (spans > 0 && (char *)iov[spans - 1].iov_base + iov[spans - 1].iov_len == line_start)
+      iov[spans - 1].iov_len += line_end - line_start;
+    else
+    {
+      if (spans == GREP_SPANS)
+      {
+        bytes_sent = send_spans(sock_fd, iov, spans);
+        if (bytes_sent < 0)
+          return total ? total : -1;
+        total += bytes_sent;
+        spans = 0;
+      }
+      iov[spans].iov_base = (void *)line_start;
+      iov[spans].iov_len = line_end - line_start;
+      spans++;
+    }
+    line = line_end;
+  }
+
+  if (spans > 0)
+  {
+    bytes_sent = send_spans(sock_fd, iov, spans);
+    if (bytes_sent < 0)
+      return total ? total : -1;
+    total += bytes_sent;
+  }
+  return total;
+}
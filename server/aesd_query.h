@@ -0,0 +1,37 @@
+
+#ifndef _AESD_QUERY_H_
+#define _AESD_QUERY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Queries a client sends instead of a line, answered from the history without writing to it:
+ *
+ * - GET <from_line> <count>  count lines from line from_line, counted from 0 as for SEEKTO
+ * - TAIL <n>                 the last n lines
+ * - GREP <literal>           every line containing literal
+ */
+enum aesd_query_type
+{
+  AESD_QUERY_GET,
+  AESD_QUERY_TAIL,
+  AESD_QUERY_GREP,
+};
+
+struct aesd_query
+{
+  enum aesd_query_type type;
+  uint64_t first;          /* GET: first line */
+  uint64_t count;          /* GET, TAIL: number of lines */
+  const char *literal;     /* GREP: the text searched for, inside the command */
+  size_t literal_length;
+};
+
+int aesd_query_parse(const char *command, size_t length, struct aesd_query *query);
+void aesd_query_lines(const struct aesd_query *query, uint64_t lines, uint64_t *first, uint64_t *count);
+const char *aesd_find_literal(const char *data, size_t length, const char *literal, size_t literal_length);
+ssize_t aesd_query_grep(int sock_fd, const char *data, size_t length, const char *literal, size_t literal_length);
+
+#endif /* _AESD_QUERY_H_ */
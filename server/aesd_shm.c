@@ -0,0 +1,382 @@
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "aesd_shm.h"
+
+/* where the parts of a channel live in its memfd: magic and ring size, the two ring headers,
+ * then the request bytes and the reply bytes from the first page on */
+#define SHM_REQUESTS_HEADER 128
+#define SHM_REPLIES_HEADER 256
+#define SHM_DATA_OFFSET 4096
+
+struct shm_header
+{
+  uint64_t magic;
+  uint64_t ring_size;
+};
+
+
+/* whether a ring with these counters holds no more than it can, any copy they bound then stays
+ * inside its data */
+static inline bool ring_valid(const struct aesd_shm_ring *ring, uint64_t head, uint64_t tail)
+{
+  return head - tail <= ring->mask + 1;
+}
+
+
+/* points the rings of channel into its mapping */
+static void channel_layout(struct aesd_shm_channel *channel, size_t ring_size)
+{
+  char *base = channel->base;
+
+  channel->requests.header = (struct aesd_shm_ring_header *)(base + SHM_REQUESTS_HEADER);
+  channel->requests.data = base + SHM_DATA_OFFSET;
+  channel->requests.mask = ring_size - 1;
+  channel->replies.header = (struct aesd_shm_ring_header *)(base + SHM_REPLIES_HEADER);
+  channel->replies.data = base + SHM_DATA_OFFSET + ring_size;
+  channel->replies.mask = ring_size - 1;
+}
+
+
+/**
+ * Sets up the server side of a channel with rings of ring_size bytes, a power of two of at
+ * least a page, for the client on the unix socket sock_fd.
+ * Returns 0, or a negative errno
+ */
+int aesd_shm_channel_create(struct aesd_shm_channel *channel, size_t ring_size, int sock_fd)
+{
+  struct shm_header *header;
+  int ret;
+
+  memset(channel, 0, sizeof(*channel));
+  channel->memfd = channel->server_doorbell = channel->client_doorbell = -1;
+  if (ring_size < SHM_DATA_OFFSET || (ring_size & (ring_size - 1)) != 0)
+    return -EINVAL;
+
+  channel->length = SHM_DATA_OFFSET + 2 * ring_size;
+  channel->memfd = memfd_create("aesd-shm", MFD_CLOEXEC);
+  if (channel->memfd < 0 || ftruncate(channel->memfd, channel->length) != 0)
+    goto fail_errno;
+  channel->base = mmap(NULL, channel->length, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memfd, 0);
+  if (channel->base == MAP_FAILED)
+  {
+    channel->base = NULL;
+    goto fail_errno;
+  }
+  channel->server_doorbell = eventfd(0, EFD_CLOEXEC);
+  channel->client_doorbell = eventfd(0, EFD_CLOEXEC);
+  if (channel->server_doorbell < 0 || channel->client_doorbell < 0)
+    goto fail_errno;
+
+  /* a fresh memfd reads as zeros, the rings start out empty */
+  header = channel->base;
+  header->magic = AESD_SHM_MAGIC;
+  header->ring_size = ring_size;
+  channel_layout(channel, ring_size);
+  channel->hangup_fd = sock_fd;
+  channel->server = true;
+  return 0;
+
+fail_errno:
+  ret = -errno;
+  aesd_shm_channel_free(channel);
+  return ret;
+}
+
+
+/**
+ * Answers the client's AESD_SHM_OFFER with the ring size, the memfd and the two doorbells.
+ * Returns 0, or a negative errno
+ */
+int aesd_shm_channel_offer(const struct aesd_shm_channel *channel)
+{
+  char reply[64];
+  int fds[3] = { channel->memfd, channel->server_doorbell, channel->client_doorbell };
+  union
+  {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  iov.iov_base = reply;
+  iov.iov_len = snprintf(reply, sizeof(reply), "SHM %llu\n", (unsigned long long)(channel->replies.mask + 1));
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  while (sendmsg(channel->hangup_fd, &msg, MSG_NOSIGNAL) < 0)
+    if (errno != EINTR)
+      return -errno;
+  return 0;
+}
+
+
+/**
+ * Sets up the client side of a channel from the server's answer to AESD_SHM_OFFER on the unix
+ * socket sock_fd.
+ * Returns 0, or a negative errno
+ */
+int aesd_shm_channel_accept(struct aesd_shm_channel *channel, int sock_fd)
+{
+  char reply[64];
+  int fds[3];
+  union
+  {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) - 1 };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  unsigned long long ring_size;
+  struct stat memfd_stat;
+  const struct shm_header *header;
+  ssize_t received;
+  int ret;
+
+  memset(channel, 0, sizeof(*channel));
+  channel->memfd = channel->server_doorbell = channel->client_doorbell = -1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  while ((received = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+    if (errno != EINTR)
+      return -errno;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    return -EPROTO;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  channel->memfd = fds[0];
+  channel->server_doorbell = fds[1];
+  channel->client_doorbell = fds[2];
+
+  reply[received] = '\0';
+  if (sscanf(reply, "SHM %llu\n", &ring_size) != 1 || fstat(channel->memfd, &memfd_stat) != 0 ||
+      (unsigned long long)memfd_stat.st_size != SHM_DATA_OFFSET + 2 * ring_size)
+  {
+    ret = -EPROTO;
+    goto fail;
+  }
+
+  channel->length = memfd_stat.st_size;
+  channel->base = mmap(NULL, channel->length, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memfd, 0);
+  if (channel->base == MAP_FAILED)
+  {
+    channel->base = NULL;
+    ret = -errno;
+    goto fail;
+  }
+  header = channel->base;
+  if (header->magic != AESD_SHM_MAGIC || header->ring_size != ring_size)
+  {
+    ret = -EPROTO;
+    goto fail;
+  }
+
+  channel_layout(channel, ring_size);
+  channel->hangup_fd = sock_fd;
+  channel->server = false;
+  return 0;
+
+fail:
+  aesd_shm_channel_free(channel);
+  return ret;
+}
+
+
+/**
+ * Unmaps the channel and closes its memfd and doorbells, the unix socket is left to the caller
+ */
+void aesd_shm_channel_free(struct aesd_shm_channel *channel)
+{
+  if (channel->base)
+    munmap(channel->base, channel->length);
+  if (channel->memfd >= 0)
+    close(channel->memfd);
+  if (channel->server_doorbell >= 0)
+    close(channel->server_doorbell);
+  if (channel->client_doorbell >= 0)
+    close(channel->client_doorbell);
+  channel->base = NULL;
+  channel->memfd = channel->server_doorbell = channel->client_doorbell = -1;
+}
+
+
+static void ring_doorbell(int doorbell)
+{
+  uint64_t one = 1;
+
+  while (write(doorbell, &one, sizeof(one)) < 0 && errno == EINTR)
+    ;
+}
+
+
+/* sleeps until the peer rings this side's doorbell, returns -1 once the peer is gone */
+static int sleep_on_doorbell(struct aesd_shm_channel *channel)
+{
+  struct pollfd fds[2];
+  uint64_t rings;
+
+  fds[0].fd = channel->server ? channel->server_doorbell : channel->client_doorbell;
+  fds[0].events = POLLIN;
+  fds[1].fd = channel->hangup_fd;
+  fds[1].events = POLLIN;
+  while (poll(fds, 2, -1) < 0)
+    if (errno != EINTR)
+      return -1;
+
+  if (fds[0].revents & POLLIN)
+  {
+    if (read(fds[0].fd, &rings, sizeof(rings)) < 0 && errno != EAGAIN && errno != EINTR)
+      return -1;
+    return 0;
+  }
+  if (fds[1].revents & (POLLHUP | POLLERR))
+    return -1;
+  if (fds[1].revents & POLLIN)
+  {
+    /* only end of file means the peer left, bytes it sent over the socket are dropped since the
+     * channel carries the data, and the caller looks at the ring again */
+    char stray[64];
+    ssize_t received = recv(fds[1].fd, stray, sizeof(stray), MSG_DONTWAIT);
+    if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * Writes the length bytes of data to the peer, waiting for room in the ring when it is full.
+ * Returns length, or what could be written before the peer went away or corrupted the ring
+ * (-1 for nothing, errno is EPROTO for a corrupt ring)
+ */
+ssize_t aesd_shm_write(struct aesd_shm_channel *channel, const void *data, size_t length)
+{
+  struct aesd_shm_ring *ring = channel->server ? &channel->replies : &channel->requests;
+  int peer_doorbell = channel->server ? channel->client_doorbell : channel->server_doorbell;
+  const char *bytes = data;
+  size_t done = 0;
+
+  while (done < length)
+  {
+    uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->header->tail, memory_order_acquire);
+    size_t room;
+    size_t count;
+    size_t pos;
+    size_t first;
+
+    if (!ring_valid(ring, head, tail))
+    {
+      errno = EPROTO;
+      return done ? (ssize_t)done : -1;
+    }
+    room = ring->mask + 1 - (head - tail);
+    if (room == 0)
+    {
+      /* say we sleep before looking again, so the reader either sees it or made room already */
+      atomic_store_explicit(&ring->header->writer_waiting, 1, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load_explicit(&ring->header->tail, memory_order_relaxed) == tail &&
+          sleep_on_doorbell(channel) != 0)
+      {
+        atomic_store_explicit(&ring->header->writer_waiting, 0, memory_order_relaxed);
+        return done ? (ssize_t)done : -1;
+      }
+      atomic_store_explicit(&ring->header->writer_waiting, 0, memory_order_relaxed);
+      continue;
+    }
+
+    count = (room < length - done) ? room : length - done;
+    pos = head & ring->mask;
+    first = (count < ring->mask + 1 - pos) ? count : ring->mask + 1 - pos;
+    memcpy(ring->data + pos, bytes + done, first);
+    memcpy(ring->data, bytes + done + first, count - first);
+    atomic_store_explicit(&ring->header->head, head + count, memory_order_release);
+    done += count;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->header->reader_waiting, memory_order_relaxed))
+      ring_doorbell(peer_doorbell);
+  }
+  return done;
+}
+
+
+/**
+ * Reads up to length bytes from the peer into buffer, waiting for at least one.
+ * Returns the number of bytes read, 0 once the peer went away and nothing is left, -1 with
+ * errno EPROTO if the peer corrupted the ring
+ */
+ssize_t aesd_shm_read(struct aesd_shm_channel *channel, void *buffer, size_t length)
+{
+  struct aesd_shm_ring *ring = channel->server ? &channel->requests : &channel->replies;
+  int peer_doorbell = channel->server ? channel->client_doorbell : channel->server_doorbell;
+
+  for (;;)
+  {
+    uint64_t head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->header->tail, memory_order_relaxed);
+
+    if (!ring_valid(ring, head, tail))
+    {
+      errno = EPROTO;
+      return -1;
+    }
+    if (head != tail)
+    {
+      /* no more than the ring holds, whatever length the caller has room for */
+      size_t count = (head - tail < length) ? head - tail : length;
+      size_t pos = tail & ring->mask;
+      size_t first = (count < ring->mask + 1 - pos) ? count : ring->mask + 1 - pos;
+
+      memcpy(buffer, ring->data + pos, first);
+      memcpy((char *)buffer + first, ring->data, count - first);
+      atomic_store_explicit(&ring->header->tail, tail + count, memory_order_release);
+
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load_explicit(&ring->header->writer_waiting, memory_order_relaxed))
+        ring_doorbell(peer_doorbell);
+      return count;
+    }
+
+    atomic_store_explicit(&ring->header->reader_waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->header->head, memory_order_acquire) == tail &&
+        sleep_on_doorbell(channel) != 0)
+    {
+      atomic_store_explicit(&ring->header->reader_waiting, 0, memory_order_relaxed);
+      /* bytes written right before the peer left are still delivered */
+      if (atomic_load_explicit(&ring->header->head, memory_order_acquire) != tail)
+        continue;
+      return 0;
+    }
+    atomic_store_explicit(&ring->header->reader_waiting, 0, memory_order_relaxed);
+  }
+}
@@ -0,0 +1,63 @@
+
+#ifndef _AESD_SHM_H_
+#define _AESD_SHM_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Shared-memory transport of aesdsocket for clients on the same host. A client connected to the
+ * unix socket sends "SHM\n"; the server answers "SHM <ring size>\n" and passes, with
+ * SCM_RIGHTS, a memfd holding two byte rings and two eventfd doorbells. From then on lines go
+ * through the requests ring and replays come back through the replies ring, without a send()
+ * or recv() on the data path. The unix socket stays open only to tell either side the other
+ * one went away.
+ *
+ * Each ring has a single producer and a single consumer. A side only rings the doorbell of the
+ * other when the other said it is about to sleep, so a busy session costs no system calls.
+ * The counters of both rings are in memory the client can write: a side reads each of them once
+ * per copy and gives up on a ring that claims to hold more than its size, so a client can only
+ * corrupt its own stream, never make the server copy outside the rings.
+ */
+#define AESD_SHM_OFFER "SHM\n"
+#define AESD_SHM_MAGIC 0x314d485344534541ULL /* "AESDSHM1" */
+
+struct aesd_shm_ring_header
+{
+  _Alignas(64) _Atomic uint64_t head;   /* bytes produced so far */
+  _Atomic uint32_t writer_waiting;      /* the producer sleeps until room is made */
+  _Alignas(64) _Atomic uint64_t tail;   /* bytes consumed so far */
+  _Atomic uint32_t reader_waiting;      /* the consumer sleeps until bytes arrive */
+};
+
+struct aesd_shm_ring
+{
+  struct aesd_shm_ring_header *header;
+  char *data;
+  uint64_t mask;                        /* ring size - 1 */
+};
+
+struct aesd_shm_channel
+{
+  void *base;                 /* the whole memfd mapping */
+  size_t length;
+  int memfd;
+  int server_doorbell;        /* eventfd the server sleeps on */
+  int client_doorbell;        /* eventfd the client sleeps on */
+  int hangup_fd;              /* the unix socket, readable once the peer is gone */
+  bool server;                /* this side serves the requests */
+  struct aesd_shm_ring requests;  /* client to server */
+  struct aesd_shm_ring replies;   /* server to client */
+};
+
+int aesd_shm_channel_create(struct aesd_shm_channel *channel, size_t ring_size, int sock_fd);
+int aesd_shm_channel_offer(const struct aesd_shm_channel *channel);
+int aesd_shm_channel_accept(struct aesd_shm_channel *channel, int sock_fd);
+void aesd_shm_channel_free(struct aesd_shm_channel *channel);
+ssize_t aesd_shm_write(struct aesd_shm_channel *channel, const void *data, size_t length);
+ssize_t aesd_shm_read(struct aesd_shm_channel *channel, void *buffer, size_t length);
+
+#endif /* _AESD_SHM_H_ */
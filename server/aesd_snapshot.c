@@ -0,0 +1,159 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "aesd_snapshot.h"
+
+/* first guess of the history size, doubled until the whole history fits */
+#define SNAPSHOT_INITIAL_SIZE (64 * 1024)
+
+
+void aesd_snapshot_cache_init(struct aesd_snapshot_cache *cache)
+{
+  memset(cache, 0, sizeof(*cache));
+}
+
+
+void aesd_snapshot_cache_free(struct aesd_snapshot_cache *cache)
+{
+  if (cache->current)
+    aesd_snapshot_put(cache->current);
+  cache->current = NULL;
+}
+
+
+/**
+ * Reads the whole history in data_fd from its start, without moving the file position.
+ * Returns the new snapshot with one reference, or NULL with errno set
+ */
+static struct aesd_snapshot *snapshot_read(int data_fd, uint64_t generation)
+{
+  size_t capacity = SNAPSHOT_INITIAL_SIZE;
+  struct aesd_snapshot *snapshot = malloc(sizeof(*snapshot) + capacity);
+  ssize_t bytes_read;
+
+  if (!snapshot)
+    return NULL;
+  snapshot->size = 0;
+
+  for (;;)
+  {
+    if (snapshot->size == capacity)
+    {
+      struct aesd_snapshot *bigger = realloc(snapshot, sizeof(*snapshot) + 2 * capacity);
+      if (!bigger)
+      {
+        free(snapshot);
+        return NULL;
+      }
+      snapshot = bigger;
+      capacity *= 2;
+    }
+
+    bytes_read = pread(data_fd, snapshot->data + snapshot->size, capacity - snapshot->size, snapshot->size);
+    if (bytes_read < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      free(snapshot);
+      return NULL;
+    }
+    if (bytes_read == 0)
+      break;
+    snapshot->size += bytes_read;
+  }
+
+  snapshot->generation = generation;
+  snapshot->lines.starts = NULL;
+  atomic_init(&snapshot->refs, 1);
+  return snapshot;
+}
+
+
+/**
+ * Returns a snapshot of the history in data_fd at the current generation of cache, shared with
+ * every other replay of that generation, with a reference for the caller to drop with
+ * aesd_snapshot_put once sent. The history is only read when it changed since the last call.
+ * Returns NULL with errno set if the history could not be read
+ */
+struct aesd_snapshot *aesd_snapshot_get(struct aesd_snapshot_cache *cache, int data_fd)
+{
+  struct aesd_snapshot *snapshot = cache->current;
+
+  cache->replays++;
+  if (snapshot && snapshot->generation == cache->generation)
+  {
+    cache->hits++;
+    atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+    return snapshot;
+  }
+
+  cache->misses++;
+  snapshot = snapshot_read(data_fd, cache->generation);
+  if (!snapshot)
+    return NULL;
+
+  /* the previous snapshot lives on until its last sender is done */
+  if (cache->current)
+    aesd_snapshot_put(cache->current);
+  cache->current = snapshot;
+  atomic_fetch_add_explicit(&snapshot->refs, 1, memory_order_relaxed);
+  return snapshot;
+}
+
+
+/**
+ * Same as aesd_snapshot_get for a replay that can also send the history itself: the first
+ * replay of a generation gets NULL with errno 0 and sends it from data_fd, without a copy, under
+ * the lock. Later replays of the same generation share one snapshot sent without the lock.
+ * Returns NULL with errno set if the history could not be read
+ */
+struct aesd_snapshot *aesd_snapshot_share(struct aesd_snapshot_cache *cache, int data_fd)
+{
+  struct aesd_snapshot *snapshot = cache->current;
+
+  if ((snapshot == NULL || snapshot->generation != cache->generation) && cache->replays == 0)
+  {
+    cache->replays++;
+    cache->direct++;
+    errno = 0;
+    return NULL;
+  }
+  return aesd_snapshot_get(cache, data_fd);
+}
+
+
+/**
+ * Drops a reference to snapshot, freeing it with the last one. Needs no lock
+ */
+void aesd_snapshot_put(struct aesd_snapshot *snapshot)
+{
+  if (atomic_fetch_sub_explicit(&snapshot->refs, 1, memory_order_acq_rel) == 1)
+  {
+    aesd_line_index_free(&snapshot->lines);
+    free(snapshot);
+  }
+}
+
+
+/**
+ * Returns the line index of snapshot, scanning it on the first call. Must be called with the
+ * lock of the cache held, the index may then be read without it like the rest of the snapshot.
+ * Returns NULL if the index could not be allocated
+ */
+const struct aesd_line_index *aesd_snapshot_lines(struct aesd_snapshot *snapshot)
+{
+  if (snapshot->lines.starts)
+    return &snapshot->lines;
+
+  if (aesd_line_index_init(&snapshot->lines) != 0)
+    return NULL;
+  if (aesd_line_index_scan(&snapshot->lines, snapshot->data, snapshot->size) != 0)
+  {
+    aesd_line_index_free(&snapshot->lines);
+    return NULL;
+  }
+  return &snapshot->lines;
+}
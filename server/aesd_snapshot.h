@@ -0,0 +1,69 @@
+
+#ifndef _AESD_SNAPSHOT_H_
+#define _AESD_SNAPSHOT_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd_line_index.h"
+
+/**
+ * Immutable copy of a history as it was at one generation, shared by every replay of that
+ * generation and freed when the last one is done with it.
+ */
+struct aesd_snapshot
+{
+  uint64_t generation;    /* generation of the history copied */
+  _Atomic unsigned int refs;
+  size_t size;            /* bytes in data */
+  struct aesd_line_index lines; /* built by the first range query, under the cache lock */
+  char data[];
+};
+
+/**
+ * Snapshot cache of one history (a file, an aesdchar shard). Every write to the history bumps
+ * the generation; replays of an unchanged history then share the cached snapshot instead of
+ * reading the history again.
+ * A snapshot copies the whole history, so plain replays only take one once a second replay of
+ * the same generation shows it will be shared (aesd_snapshot_share), the first one sends the
+ * history straight from the file.
+ * The cache is guarded by the lock of its history, only aesd_snapshot_put may be called
+ * without it.
+ */
+struct aesd_snapshot_cache
+{
+  struct aesd_snapshot *current; /* the newest snapshot, the cache holds a reference */
+  uint64_t generation;           /* bumped by every write to the history */
+  uint64_t replays;              /* replays of the current generation so far */
+  uint64_t hits;                 /* replays served from current */
+  uint64_t misses;               /* replays that read the history into a snapshot */
+  uint64_t direct;               /* replays left to send the history themselves */
+};
+
+void aesd_snapshot_cache_init(struct aesd_snapshot_cache *cache);
+void aesd_snapshot_cache_free(struct aesd_snapshot_cache *cache);
+struct aesd_snapshot *aesd_snapshot_get(struct aesd_snapshot_cache *cache, int data_fd);
+struct aesd_snapshot *aesd_snapshot_share(struct aesd_snapshot_cache *cache, int data_fd);
+void aesd_snapshot_put(struct aesd_snapshot *snapshot);
+const struct aesd_line_index *aesd_snapshot_lines(struct aesd_snapshot *snapshot);
+
+/**
+ * Marks the history as changed, the next replay reads it again
+ */
+static inline void aesd_snapshot_cache_invalidate(struct aesd_snapshot_cache *cache)
+{
+  cache->generation++;
+  cache->replays = 0;
+}
+
+/**
+ * Returns the percentage of replays served from the cache
+ */
+static inline double aesd_snapshot_cache_hit_rate(const struct aesd_snapshot_cache *cache)
+{
+  uint64_t total = cache->hits + cache->misses + cache->direct;
+  return total ? 100.0 * cache->hits / total : 0;
+}
+
+#endif /* _AESD_SNAPSHOT_H_ */
@@ -8,22 +8,49 @@
 #include <syslog.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <libgen.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/sendfile.h>
 
 #include "threading.h"
 #include "queue.h"
 #include "aesd_ioctl.h"
+#include "aesd_magic_ring.h"
+#include "aesd_snapshot.h"
+#include "aesd_query.h"
+#include "aesd_line_index.h"
+#include "aesd_pubsub.h"
+#include "aesd_shm.h"
 
 /* function prototypes */
 void signal_handler(int);
 void uint32_to_ip(uint32_t, char *);
 void safe_shutdown(void);
 int find_chr_in_str(const char*, int, char);
+uint32_t client_hash(const struct sockaddr_in*);
+int accept_client(struct sockaddr_in*, socklen_t*, bool*);
+ssize_t send_history(int, int, off_t);
+ssize_t send_buffer(int, const char*, size_t);
+const char *copy_history_window(struct socket_thread_data*, const char*, size_t);
+ssize_t write_history(int, struct aesd_snapshot_cache*, const char*, size_t);
+bool history_can_seek(void);
+int seek_history(int, uint32_t, uint32_t, uint64_t*);
+void answer_query(struct socket_thread_data*, int, const struct aesd_query*);
+void publish_history(const char*, size_t, const char*, size_t);
+void follow_history(struct socket_thread_data*, int);
+void keep_pending(struct socket_thread_data*, const char*, size_t);
+void commit_pending(struct socket_thread_data*, const char*, size_t);
+int shm_write_history(struct socket_thread_data*, struct aesd_shm_channel*, const char*, size_t, bool);
+void serve_shm(struct socket_thread_data*, int);
 void* socket_thread_func(void*);
 void* timer_thread_func(void*);
 
@@ -40,6 +67,21 @@ const uint16_t DEFAULT_PORT = 9000;
 #define TEMP_FILE "/var/tmp/aesdsocketdata"
 #endif
 
+/* upper limit for -s, clients are hashed over /dev/aesdchar0 .. shards-1 */
+#define MAX_SHARDS 64
+
+/* batches kept for SUBSCRIBE clients, one that falls further behind is lapped */
+#define HISTORY_FEED_ORDER 10
+
+/* batches a subscriber takes from the feed at a time */
+#define FEED_BATCHES_PER_WAKEUP 16
+
+/* a subscriber whose client takes longer than this to accept a batch is disconnected */
+#define FEED_SEND_TIMEOUT_SEC 5
+
+/* bytes in each ring of the channel of a SHM client, a replay larger than that is streamed */
+#define SHM_RING_SIZE (1 << 20)
+
 /* structs */
 struct thread_entry
 {
@@ -50,9 +92,18 @@ struct thread_entry
 
 /* globals */
 int server_fd = -1;
+int local_fd = -1; /* -u, unix socket for clients on the same host */
+const char *local_path = NULL;
 struct thread_entry *thread_list_entry = NULL;
 struct slisthead head;
 pthread_t timer_thread_id = -1;
+unsigned int shard_count = 1;
+pthread_mutex_t shard_mutex[MAX_SHARDS]; /* one lock per shard, only [0] without -s */
+bool memory_history = false; /* -m, keep the history in history_ring instead of TEMP_FILE */
+struct aesd_magic_ring history_ring; /* guarded by shard_mutex[0] */
+struct aesd_snapshot_cache shard_snapshots[MAX_SHARDS]; /* replay snapshots, guarded by shard_mutex */
+struct aesd_line_index history_lines; /* line offsets of the file backend, guarded by shard_mutex[0] */
+struct aesd_pubsub history_feed; /* committed batches pushed to SUBSCRIBE clients */
 
 SLIST_HEAD(slisthead, thread_entry);
 
@@ -62,9 +113,11 @@ int main(int argc, char *argv[])
   int ret = -1; /* generic return result */
   bool daemon_flag = false;
   uint16_t socket_port = DEFAULT_PORT;  
+  size_t history_bytes = 0;
+  enum aesd_pubsub_policy feed_policy = AESD_PUBSUB_DROP;
 
   int opt = -1;
-  while ((opt = getopt(argc, argv, "p:d")) != -1) {
+  while ((opt = getopt(argc, argv, "p:ds:m:ku:")) != -1) {
     switch (opt) {
       case 'p':
         socket_port = (uint16_t)strtol(optarg, NULL, 10);
@@ -72,6 +125,39 @@ int main(int argc, char *argv[])
       case 'd':
         daemon_flag = true;
         break;              
+      case 's':
+        shard_count = (unsigned int)strtoul(optarg, NULL, 10);
+        if (shard_count < 1 || shard_count > MAX_SHARDS)
+        {
+          printf("Shard count must be between 1 and %d\n", MAX_SHARDS);
+          exit(EXIT_FAILURE);
+        }
+#ifndef USE_AESD_CHAR_DEVICE
+        printf("Shards need the aesdchar device, using a single file\n");
+        shard_count = 1;
+#endif
+        break;
+      case 'm':
+        history_bytes = (size_t)strtoull(optarg, NULL, 10);
+        if (history_bytes == 0)
+        {
+          printf("History size must be a number of bytes\n");
+          exit(EXIT_FAILURE);
+        }
+        memory_history = true;
+        break;
+      case 'k':
+        /* SUBSCRIBE clients that fall behind are disconnected instead of skipping batches */
+        feed_policy = AESD_PUBSUB_DISCONNECT;
+        break;
+      case 'u':
+        if (strlen(optarg) >= sizeof(((struct sockaddr_un *)NULL)->sun_path))
+        {
+          printf("Unix socket path is too long\n");
+          exit(EXIT_FAILURE);
+        }
+        local_path = optarg;
+        break;
       case '?':
         printf("Unknown option or missing argument\n");
         exit(EXIT_FAILURE);
@@ -94,16 +180,58 @@ int main(int argc, char *argv[])
 #endif
 
 
-  /* inititialize mutex */
-  pthread_mutex_t mutex;
-  ret = pthread_mutex_init(&mutex, NULL);
-  if (ret != 0) 
+  /* inititialize mutexes, one per shard */
+  unsigned int shard;
+  for (shard = 0; shard < shard_count; shard++)
   {
-    syslog(LOG_ERR, "Mutex cannot be initialized");
-    exit(EXIT_FAILURE);
+    ret = pthread_mutex_init(&shard_mutex[shard], NULL);
+    if (ret != 0) 
+    {
+      syslog(LOG_ERR, "Mutex cannot be initialized");
+      exit(EXIT_FAILURE);
+    }
+    aesd_snapshot_cache_init(&shard_snapshots[shard]);
   }
   //TODO: mutex_destroy
 
+  /* the in-memory history is a single ring, clients are not sharded */
+  if (memory_history)
+  {
+    if (shard_count > 1)
+    {
+      printf("Shards need the aesdchar device, using a single in-memory history\n");
+      shard_count = 1;
+    }
+    ret = aesd_magic_ring_init(&history_ring, history_bytes);
+    if (ret != 0)
+    {
+      syslog(LOG_ERR, "In-memory history of %zu bytes cannot be set up: %s", history_bytes, strerror(-ret));
+      exit(EXIT_FAILURE);
+    }
+    syslog(LOG_INFO, "Keeping the history in memory, %zu bytes", history_ring.capacity);
+  }
+
+  ret = aesd_pubsub_init(&history_feed, HISTORY_FEED_ORDER, feed_policy);
+  if (ret != 0)
+  {
+    syslog(LOG_ERR, "Feed for SUBSCRIBE clients cannot be set up: %s", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+
+#ifndef USE_AESD_CHAR_DEVICE
+  /* the file backend indexes its lines for AESDCHAR_IOCSEEKTO, GET and TAIL
+   * without the index a seek command is stored as an ordinary line */
+  if (!memory_history)
+  {
+    int data_fd = open(TEMP_FILE, O_CREAT | O_APPEND | O_RDWR, 0666);
+    ret = (data_fd < 0) ? -errno : aesd_line_index_map(&history_lines, data_fd);
+    if (ret != 0)
+      syslog(LOG_ERR, "Line index of %s cannot be set up: %s", TEMP_FILE, strerror(-ret));
+    if (data_fd >= 0)
+      close(data_fd);
+  }
+#endif
+
   /* Opens a stream socket bound to port 9000, failing and returning -1 if any of the socket connection steps fail.
   *
   * int socket(int domain, int type, int protocol);
@@ -158,6 +286,32 @@ int main(int argc, char *argv[])
     safe_shutdown();
     exit(EXIT_FAILURE);
   }
+
+  /* clients on the same host may connect to the unix socket of -u instead, and move their
+  * appends and replays to a shared-memory channel from there
+  */
+  if (local_path != NULL)
+  {
+    struct sockaddr_un local_address;
+    memset(&local_address, 0, sizeof(local_address));
+    local_address.sun_family = AF_UNIX;
+    strcpy(local_address.sun_path, local_path);
+    unlink(local_path);
+
+    /* only the user of the server may connect, a client gets to write into the server's memory
+     * the mode is set through the umask so the socket never exists with a wider one */
+    mode_t old_mask = umask(0177);
+    local_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (local_fd >= 0)
+      ret = bind(local_fd, (struct sockaddr*)&local_address, sizeof(local_address));
+    umask(old_mask);
+    if (local_fd < 0 || ret < 0 || listen(local_fd, 10) < 0)
+    {
+      syslog(LOG_ERR, "Unix socket %s could not listen", local_path);
+      safe_shutdown();
+      exit(EXIT_FAILURE);
+    }
+  }
   /* catch signal SIGINT and SIGTERM 
   * setting up the signal handlers should happen afeter daemonizing
   */
@@ -211,7 +365,7 @@ int main(int argc, char *argv[])
 #ifndef USE_AESD_CHAR_DEVICE
   /* setup timer thread */ 
   struct timer_thread_data timer_thread_func_args;
-  timer_thread_func_args.mutex = &mutex;
+  timer_thread_func_args.mutex = &shard_mutex[0];
 
   ret = pthread_create(&timer_thread_id, NULL, timer_thread_func, &timer_thread_func_args);
   if(ret != 0)
@@ -231,7 +385,8 @@ int main(int argc, char *argv[])
     */
     
     socklen_t addrlen = sizeof(socket_address);
-    int accepted_fd = accept(server_fd, (struct sockaddr*)&socket_address, &addrlen);
+    bool local = false;
+    int accepted_fd = accept_client(&socket_address, &addrlen, &local);
     if (accepted_fd < 0)
     {
       syslog(LOG_ERR, "Socket could not accept");
@@ -241,7 +396,10 @@ int main(int argc, char *argv[])
 
     char ip_str[16];
     struct in_addr sin_addr = socket_address.sin_addr;
-    uint32_to_ip(sin_addr.s_addr, ip_str);
+    if (local)
+      strcpy(ip_str, "local");
+    else
+      uint32_to_ip(sin_addr.s_addr, ip_str);
     syslog(LOG_DEBUG, "Accepted connection from %s", ip_str); 
     printf("Accepted connection from %s\n", ip_str); 
     
@@ -261,8 +419,26 @@ int main(int argc, char *argv[])
       // error out because malloc failed
       //TODO: safe shutdown
     }
-    thread_func_args->mutex = &mutex;
+    /* with shards every client sticks to the device its address hashes to, local ones to the first */
+    shard = 0;
+    if (shard_count > 1)
+    {
+      if (!local)
+        shard = client_hash(&socket_address) % shard_count;
+      snprintf(thread_func_args->data_path, sizeof(thread_func_args->data_path), "%s%u", TEMP_FILE, shard);
+    }
+    else
+      snprintf(thread_func_args->data_path, sizeof(thread_func_args->data_path), "%s", TEMP_FILE);
+    thread_func_args->mutex = &shard_mutex[shard];
+    thread_func_args->snapshots = &shard_snapshots[shard];
     thread_func_args->accepted_fd = accepted_fd;
+    thread_func_args->local = local;
+    thread_func_args->pending = NULL;
+    thread_func_args->pending_length = 0;
+    thread_func_args->pending_capacity = 0;
+    thread_func_args->pending_skipped = false;
+    thread_func_args->replay = NULL;
+    thread_func_args->replay_capacity = 0;
     thread_func_args->thread_completed = false;
     thread_func_args->thread_generated_error = false;
     strncpy(thread_func_args->ip_str, ip_str, 16);
@@ -289,6 +465,8 @@ int main(int argc, char *argv[])
       {
         pthread_join(thread_list_entry->thread_id, NULL);
         SLIST_REMOVE(&head, thread_list_entry, thread_entry, threads);
+        free(thread_list_entry->thread_data->pending);
+        free(thread_list_entry->thread_data->replay);
         free(thread_list_entry->thread_data);
         free(thread_list_entry); 
       }
@@ -330,19 +508,38 @@ void safe_shutdown(void)
 
   if (server_fd >= 0)
     close(server_fd);
+  if (local_fd >= 0)
+  {
+    close(local_fd);
+    unlink(local_path);
+  }
 
   pthread_cancel(timer_thread_id);
   pthread_join(timer_thread_id, NULL);
 
+  /* subscribers leave on their own */
+  if (history_feed.batches)
+    aesd_pubsub_close(&history_feed);
+
   while (!SLIST_EMPTY(&head)) {           /* List Deletion. */
     n1 = SLIST_FIRST(&head);
     pthread_cancel(n1->thread_id);
     pthread_join(n1->thread_id, NULL);
     SLIST_REMOVE_HEAD(&head, threads);
+    free(n1->thread_data->pending);
+    free(n1->thread_data->replay);
     free(n1->thread_data);
     free(n1);
   }
 
+  if (history_feed.batches)
+  {
+    syslog(LOG_INFO, "Feed: %llu batches published, %llu skipped by slow subscribers, %llu subscribers disconnected",
+           (unsigned long long)history_feed.head, (unsigned long long)history_feed.dropped,
+           (unsigned long long)history_feed.disconnected);
+    aesd_pubsub_free(&history_feed);
+  }
+
 
   //if (tempfile_fd >= 0)
   //  close(tempfile_fd);    
@@ -354,8 +551,65 @@ void safe_shutdown(void)
   */
 #ifndef USE_AESD_CHAR_DEVICE
   remove(TEMP_FILE);
+  if (history_lines.starts)
+    aesd_line_index_free(&history_lines);
 #endif
-  
+
+  if (memory_history)
+    aesd_magic_ring_free(&history_ring);
+
+  unsigned int shard;
+  for (shard = 0; shard < shard_count; shard++)
+  {
+    struct aesd_snapshot_cache *snapshots = &shard_snapshots[shard];
+    if (snapshots->hits + snapshots->misses + snapshots->direct > 0)
+      syslog(LOG_INFO, "Shard %u replay snapshots: %llu hits, %llu misses, %llu sent from the file, %.1f%% hit rate",
+             shard, (unsigned long long)snapshots->hits, (unsigned long long)snapshots->misses,
+             (unsigned long long)snapshots->direct, aesd_snapshot_cache_hit_rate(snapshots));
+    aesd_snapshot_cache_free(snapshots);
+  }
+}
+
+/* FNV-1a over the client address and port, used to pick a shard */
+uint32_t client_hash(const struct sockaddr_in *address)
+{
+  uint32_t hash = 2166136261u;
+  unsigned char key[6];
+  size_t ii;
+
+  memcpy(key, &address->sin_addr.s_addr, 4);
+  memcpy(key + 4, &address->sin_port, 2);
+  for (ii = 0; ii < sizeof(key); ii++)
+  {
+    hash ^= key[ii];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* wait for the next client on the TCP socket or, with -u, on the unix socket
+* local tells which one it came from, address is only filled in for TCP clients
+*/
+int accept_client(struct sockaddr_in *address, socklen_t *addrlen, bool *local)
+{
+  struct pollfd fds[2] = {
+    { .fd = server_fd, .events = POLLIN },
+    { .fd = local_fd, .events = POLLIN }
+  };
+
+  *local = false;
+  if (local_fd < 0)
+    return accept(server_fd, (struct sockaddr*)address, addrlen);
+
+  while (poll(fds, 2, -1) < 0)
+    if (errno != EINTR)
+      return -1;
+  if (fds[1].revents & POLLIN)
+  {
+    *local = true;
+    return accept(local_fd, NULL, NULL);
+  }
+  return accept(server_fd, (struct sockaddr*)address, addrlen);
 }
 
 int find_chr_in_str(const char *str, int str_len, char c)
@@ -371,41 +625,456 @@ int find_chr_in_str(const char *str, int str_len, char c)
   return -1;
 }
 
+/* send everything from offset in data_fd to sock_fd
+* sendfile() lets the kernel splice the data straight into the socket, the read/send
+* loop is only used when data_fd does not support splicing
+*/
+ssize_t send_history(int sock_fd, int data_fd, off_t offset)
+{
+  ssize_t total = 0;
+  ssize_t bytes_sent;
+
+  while ((bytes_sent = sendfile(sock_fd, data_fd, &offset, 1 << 20)) > 0)
+    total += bytes_sent;
+
+  if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS) && total == 0)
+  {
+    char file_buffer[1024];
+    ssize_t bytes_read = 0;
+    while ((bytes_read = pread(data_fd, file_buffer, sizeof(file_buffer), offset)) > 0)
+    {
+      send(sock_fd, file_buffer, bytes_read, 0);
+      offset += bytes_read;
+      total += bytes_read;
+    }
+  }
+
+  return total;
+}
+
+/* send length bytes of data to sock_fd, a single send() unless the socket takes less */
+ssize_t send_buffer(int sock_fd, const char *data, size_t length)
+{
+  ssize_t total = 0;
+  ssize_t bytes_sent;
+
+  while ((size_t)total < length)
+  {
+    bytes_sent = send(sock_fd, data + total, length - total, MSG_NOSIGNAL);
+    if (bytes_sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return total ? total : -1;
+    }
+    total += bytes_sent;
+  }
+
+  return total;
+}
+
+/* copy a window of the in-memory history into the replay buffer of the thread, with the lock
+* held, so it is sent after unlocking while writers overwrite the ring. The double mapping of
+* history_ring makes any window one contiguous span, copied at once even when it wraps around
+* the end of the ring. Returns the copy, or NULL if the buffer cannot grow
+*/
+const char *copy_history_window(struct socket_thread_data *thread_func_args, const char *window, size_t length)
+{
+  if (length > thread_func_args->replay_capacity)
+  {
+    size_t capacity = thread_func_args->replay_capacity ? thread_func_args->replay_capacity : 4096;
+    char *replay;
+
+    while (capacity < length)
+      capacity *= 2;
+    replay = realloc(thread_func_args->replay, capacity);
+    if (replay == NULL)
+      return NULL;
+    thread_func_args->replay = replay;
+    thread_func_args->replay_capacity = capacity;
+  }
+  memcpy(thread_func_args->replay, window, length);
+  return thread_func_args->replay;
+}
+
+/* append data to the history, the in-memory one or data_fd whose replay snapshots it makes stale */
+ssize_t write_history(int data_fd, struct aesd_snapshot_cache *snapshots, const char *data, size_t length)
+{
+  int ret;
+
+  if (!memory_history)
+  {
+    ssize_t bytes_written = write(data_fd, data, length);
+    if (bytes_written > 0 && snapshots != NULL)
+      aesd_snapshot_cache_invalidate(snapshots);
+    if (bytes_written > 0 && history_lines.starts != NULL)
+    {
+      ret = aesd_line_index_scan(&history_lines, data, bytes_written);
+      if (ret != 0)
+      {
+        syslog(LOG_ERR, "Line index cannot grow, seeks are disabled: %s", strerror(-ret));
+        aesd_line_index_free(&history_lines);
+      }
+    }
+    return bytes_written;
+  }
+
+  ret = aesd_magic_ring_append(&history_ring, data, length);
+  if (ret != 0)
+  {
+    errno = -ret;
+    return -1;
+  }
+  return length;
+}
+
+/* AESDCHAR_IOCSEEKTO:X,Y is understood by the aesdchar device, the in-memory history and the
+* file backend while it has its line index
+*/
+bool history_can_seek(void)
+{
+#ifdef USE_AESD_CHAR_DEVICE
+  return true;
+#else
+  return memory_history || history_lines.starts != NULL;
+#endif
+}
+
+/* seek to byte write_cmd_offset of write command write_cmd, in the in-memory history that is
+* the offset stored in replay_offset, on the aesdchar device and in the file the file position
+* of data_fd, which the line index of the file finds in O(1)
+*/
+int seek_history(int data_fd, uint32_t write_cmd, uint32_t write_cmd_offset, uint64_t *replay_offset)
+{
+  if (memory_history)
+    return aesd_magic_ring_seekto(&history_ring, write_cmd, write_cmd_offset, replay_offset);
+
+#ifdef USE_AESD_CHAR_DEVICE
+  struct aesd_seekto seekto = {
+    .write_cmd = write_cmd,
+    .write_cmd_offset = write_cmd_offset
+  };
+  return ioctl(data_fd, AESDCHAR_IOCSEEKTO, &seekto);
+#else
+  uint64_t offset;
+  int ret = aesd_line_index_seekto(&history_lines, write_cmd, write_cmd_offset, &offset);
+  if (ret != 0)
+    return ret;
+  return (lseek(data_fd, offset, SEEK_SET) < 0) ? -errno : 0;
+#endif
+}
+
+/* answer a GET, TAIL or GREP query from the history, which is not written to
+* the lines of the in-memory history are copied with the lock held and sent without it
+* the file and aesdchar histories are answered from the shared snapshot, after closing data_fd
+* and releasing the lock as a replay does
+*/
+void answer_query(struct socket_thread_data *thread_func_args, int data_fd, const struct aesd_query *query)
+{
+  const struct aesd_line_index *lines = NULL;
+  struct aesd_snapshot *snapshot = NULL;
+  const char *data;
+  size_t length;
+  uint64_t first;
+  uint64_t count;
+  uint64_t start = 0;
+  uint64_t end = 0;
+
+  if (memory_history)
+  {
+    /* the bytes to answer from are copied with the lock held and sent without it */
+    data = aesd_magic_ring_window(&history_ring, 0, &length);
+    if (data != NULL && query->type != AESD_QUERY_GREP)
+    {
+      /* the entries of the ring are its lines, each found in O(1) */
+      aesd_query_lines(query, aesd_magic_ring_count(&history_ring), &first, &count);
+      if (count == 0 ||
+          aesd_magic_ring_seekto(&history_ring, first, 0, &start) != 0)
+        end = start;
+      else if (first + count == aesd_magic_ring_count(&history_ring))
+        end = length;
+      else if (aesd_magic_ring_seekto(&history_ring, first + count, 0, &end) != 0)
+        end = start;
+      data += start;
+      length = end - start;
+    }
+    if (data != NULL)
+      data = copy_history_window(thread_func_args, data, length);
+    pthread_mutex_unlock(thread_func_args->mutex);
+    if (data == NULL)
+      return;
+    if (query->type == AESD_QUERY_GREP)
+      aesd_query_grep(thread_func_args->accepted_fd, data, length, query->literal, query->literal_length);
+    else
+      send_buffer(thread_func_args->accepted_fd, data, length);
+    return;
+  }
+
+  snapshot = aesd_snapshot_get(thread_func_args->snapshots, data_fd);
+  if (snapshot != NULL && query->type != AESD_QUERY_GREP)
+  {
+    /* the file keeps its index up to date with every write, aesdchar's is built per snapshot */
+    lines = history_lines.starts ? &history_lines : aesd_snapshot_lines(snapshot);
+    if (lines != NULL)
+    {
+      aesd_query_lines(query, lines->count, &first, &count);
+      aesd_line_index_range(lines, first, count, &start, &end);
+    }
+  }
+  close(data_fd);
+  pthread_mutex_unlock(thread_func_args->mutex);
+  if (snapshot == NULL || (query->type != AESD_QUERY_GREP && lines == NULL))
+  {
+    syslog(LOG_ERR, "Could not read %s to answer a query", thread_func_args->data_path);
+    if (snapshot != NULL)
+      aesd_snapshot_put(snapshot);
+    return;
+  }
+
+  if (query->type == AESD_QUERY_GREP)
+    aesd_query_grep(thread_func_args->accepted_fd, snapshot->data, snapshot->size,
+                    query->literal, query->literal_length);
+  else if (start < end && end <= snapshot->size)
+    send_buffer(thread_func_args->accepted_fd, snapshot->data + start, end - start);
+  aesd_snapshot_put(snapshot);
+}
+
+/* push a committed batch to SUBSCRIBE clients, the partial line written before it first */
+void publish_history(const char *pending, size_t pending_length, const char *data, size_t length)
+{
+  struct iovec iov[2] = {
+    { .iov_base = (void *)pending, .iov_len = pending_length },
+    { .iov_base = (void *)data, .iov_len = length }
+  };
+
+  if (!aesd_pubsub_has_subscribers(&history_feed))
+    return;
+  if (aesd_pubsub_publish(&history_feed, iov, 2) != 0)
+    syslog(LOG_ERR, "Could not publish %zu bytes to subscribers", pending_length + length);
+}
+
+/* SUBSCRIBE: keep the connection and push every batch committed from now on, until the client
+* goes away or the server shuts down. The client takes no lock, a slow one is lapped by the feed
+* and one that stops reading is disconnected after FEED_SEND_TIMEOUT_SEC, releasing its batches
+*/
+void follow_history(struct socket_thread_data *thread_func_args, int data_fd)
+{
+  struct aesd_subscription subscription;
+  struct aesd_batch *batches[FEED_BATCHES_PER_WAKEUP];
+  struct timeval timeout = { .tv_sec = FEED_SEND_TIMEOUT_SEC };
+  size_t count;
+  size_t ii;
+  bool sending = true;
+  bool stalled = false;
+
+  aesd_pubsub_subscribe(&history_feed, &subscription);
+  if (data_fd >= 0)
+    close(data_fd);
+  pthread_mutex_unlock(thread_func_args->mutex);
+  if (setsockopt(thread_func_args->accepted_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0)
+    syslog(LOG_ERR, "Could not set a send timeout for %s: %s", thread_func_args->ip_str, strerror(errno));
+  syslog(LOG_INFO, "Subscribed %s", thread_func_args->ip_str);
+
+  while (sending && (count = aesd_pubsub_next(&history_feed, &subscription, batches, FEED_BATCHES_PER_WAKEUP)) > 0)
+  {
+    for (ii = 0; ii < count; ii++)
+    {
+      /* a batch sent in part would tear the stream, the subscriber is done with it */
+      if (sending && send_buffer(thread_func_args->accepted_fd, batches[ii]->data, batches[ii]->size) !=
+                     (ssize_t)batches[ii]->size)
+      {
+        sending = false;
+        stalled = (errno == EAGAIN || errno == EWOULDBLOCK);
+      }
+      aesd_batch_put(batches[ii]);
+    }
+  }
+
+  aesd_pubsub_unsubscribe(&history_feed, &subscription);
+  syslog(LOG_INFO, "Unsubscribed %s%s, %llu batches skipped", thread_func_args->ip_str,
+         subscription.disconnected ? " for falling behind" : stalled ? " for not reading" : "",
+         (unsigned long long)subscription.dropped);
+  close(thread_func_args->accepted_fd);
+  thread_func_args->thread_completed = true;
+  thread_func_args->thread_generated_error = false;
+}
+
+/* keep a partial line written by a client until its '\n' commits it for subscribers
+* with nobody subscribed nothing is kept, and the line is then not published at all rather than
+* from its middle to a client that subscribes before the '\n'
+*/
+void keep_pending(struct socket_thread_data *thread_func_args, const char *data, size_t length)
+{
+  size_t needed = thread_func_args->pending_length + length;
+
+  if (thread_func_args->pending_skipped || !aesd_pubsub_has_subscribers(&history_feed))
+  {
+    thread_func_args->pending_skipped = true;
+    return;
+  }
+
+  if (needed > thread_func_args->pending_capacity)
+  {
+    size_t capacity = thread_func_args->pending_capacity ? thread_func_args->pending_capacity : 1024;
+    char *pending;
+
+    while (capacity < needed)
+      capacity *= 2;
+    pending = realloc(thread_func_args->pending, capacity);
+    if (pending == NULL)
+    {
+      syslog(LOG_ERR, "Could not keep a partial line of %zu bytes for subscribers", needed);
+      thread_func_args->pending_skipped = true;
+      return;
+    }
+    thread_func_args->pending = pending;
+    thread_func_args->pending_capacity = capacity;
+  }
+  memcpy(thread_func_args->pending + thread_func_args->pending_length, data, length);
+  thread_func_args->pending_length = needed;
+}
+
+/* publish a line committed by its '\n' after the partial pieces kept for it */
+void commit_pending(struct socket_thread_data *thread_func_args, const char *data, size_t length)
+{
+  if (!thread_func_args->pending_skipped)
+    publish_history(thread_func_args->pending, thread_func_args->pending_length, data, length);
+  thread_func_args->pending_length = 0;
+  thread_func_args->pending_skipped = false;
+}
+
+/* write a piece of a line from a SHM client to the history, and once its '\n' commits the line
+* replay the history into channel as a socket client gets it, without the lock: the in-memory
+* history from a copy taken with it held, the file and aesdchar histories from their shared snapshot.
+* Returns 0, or -1 when the history cannot be written or the client is gone
+*/
+int shm_write_history(struct socket_thread_data *thread_func_args, struct aesd_shm_channel *channel,
+                      const char *data, size_t length, bool committed)
+{
+  int data_fd = -1;
+  struct aesd_snapshot *snapshot;
+  ssize_t bytes_written = 0;
+
+  pthread_mutex_lock(thread_func_args->mutex);
+  if (!memory_history)
+    data_fd = open(thread_func_args->data_path, O_CREAT | O_APPEND | O_RDWR, 0666);
+  if ((!memory_history && data_fd < 0) ||
+      write_history(data_fd, thread_func_args->snapshots, data, length) < 0)
+  {
+    syslog(LOG_ERR, "Could not write to %s for a shared-memory client", thread_func_args->data_path);
+    if (data_fd >= 0)
+      close(data_fd);
+    pthread_mutex_unlock(thread_func_args->mutex);
+    return -1;
+  }
+
+  if (!committed)
+  {
+    keep_pending(thread_func_args, data, length);
+    if (data_fd >= 0)
+      close(data_fd);
+    pthread_mutex_unlock(thread_func_args->mutex);
+    return 0;
+  }
+  commit_pending(thread_func_args, data, length);
+
+  if (memory_history)
+  {
+    /* a client that stops draining its ring only stalls this thread, not the lock */
+    size_t window_length = 0;
+    const char *window = aesd_magic_ring_window(&history_ring, 0, &window_length);
+    if (window != NULL)
+      window = copy_history_window(thread_func_args, window, window_length);
+    pthread_mutex_unlock(thread_func_args->mutex);
+    if (window != NULL)
+      bytes_written = aesd_shm_write(channel, window, window_length);
+    return (bytes_written < 0) ? -1 : 0;
+  }
+
+  snapshot = aesd_snapshot_get(thread_func_args->snapshots, data_fd);
+  close(data_fd);
+  pthread_mutex_unlock(thread_func_args->mutex);
+  if (snapshot == NULL)
+  {
+    syslog(LOG_ERR, "Could not read %s for a shared-memory client", thread_func_args->data_path);
+    return -1;
+  }
+  bytes_written = aesd_shm_write(channel, snapshot->data, snapshot->size);
+  aesd_snapshot_put(snapshot);
+  return (bytes_written < 0) ? -1 : 0;
+}
+
+/* SHM: hand a client of the unix socket a shared-memory channel and serve it from there until
+* it goes away. Its lines arrive through the requests ring, each committed one is answered with
+* a replay through the replies ring, and neither costs a system call while both sides are busy
+*/
+void serve_shm(struct socket_thread_data *thread_func_args, int data_fd)
+{
+  struct aesd_shm_channel channel;
+  char line_buffer[1024];
+  ssize_t bytes_read;
+  int ret;
+
+  if (data_fd >= 0)
+    close(data_fd);
+  pthread_mutex_unlock(thread_func_args->mutex);
+
+  ret = aesd_shm_channel_create(&channel, SHM_RING_SIZE, thread_func_args->accepted_fd);
+  if (ret == 0)
+    ret = aesd_shm_channel_offer(&channel);
+  if (ret != 0)
+  {
+    syslog(LOG_ERR, "Could not set up shared memory for %s: %s", thread_func_args->ip_str, strerror(-ret));
+    aesd_shm_channel_free(&channel);
+    close(thread_func_args->accepted_fd);
+    thread_func_args->thread_completed = true;
+    thread_func_args->thread_generated_error = true;
+    return;
+  }
+  syslog(LOG_INFO, "Serving %s over shared memory", thread_func_args->ip_str);
+
+  /* unlike a socket packet, everything after the first '\n' of a read is kept */
+  while ((bytes_read = aesd_shm_read(&channel, line_buffer, sizeof(line_buffer))) > 0)
+  {
+    ssize_t done = 0;
+    while (done < bytes_read)
+    {
+      const char *newline = memchr(line_buffer + done, '\n', bytes_read - done);
+      size_t length = newline ? (size_t)(newline - line_buffer - done + 1) : (size_t)(bytes_read - done);
+
+      if (shm_write_history(thread_func_args, &channel, line_buffer + done, length, newline != NULL) != 0)
+        break;
+      done += length;
+    }
+    if (done < bytes_read)
+      break;
+  }
+
+  syslog(LOG_INFO, "Closed shared memory of %s", thread_func_args->ip_str);
+  aesd_shm_channel_free(&channel);
+  close(thread_func_args->accepted_fd);
+  thread_func_args->thread_completed = true;
+  thread_func_args->thread_generated_error = false;
+}
+
 void* socket_thread_func(void* thread_param)
 {
   char recv_buffer[1024];
   //memset(buffer, 0, sizeof(buffer));
   ssize_t bytes_received = -1;
   int tempfile_fd = -1;
+  uint64_t replay_offset = 0; /* where the in-memory history is replayed from */
+  bool seeked = false; /* replay from the file position set by AESDCHAR_IOCSEEKTO */
+  struct aesd_query query;
+  bool queried = false; /* answer query instead of replaying the history */
+  bool subscribed = false; /* follow the history instead of replaying it */
+  bool shm = false; /* move to a shared-memory channel */
 
   struct socket_thread_data* thread_func_args = (struct socket_thread_data *) thread_param;
 
   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-    int ret;
-    ret = pthread_mutex_lock(thread_func_args->mutex);
-    if (ret != 0)
-    {
-      syslog(LOG_ERR, "Error acquiring mutex");
-      if (thread_func_args->accepted_fd >= 0)
-        close(thread_func_args->accepted_fd);      
-      thread_func_args->thread_completed = true;
-      thread_func_args->thread_generated_error = true;    
-      return thread_param;
-    }
-
-    /* open the file */
-    tempfile_fd = open(TEMP_FILE, O_CREAT | O_APPEND | O_RDWR, 0666);
-    if (tempfile_fd < 0)
-    {
-      syslog(LOG_ERR, "Could not open temp file %s", TEMP_FILE);
-      if (thread_func_args->accepted_fd >= 0)
-        close(thread_func_args->accepted_fd);      
-      thread_func_args->thread_completed = true;
-      thread_func_args->thread_generated_error = true;
-      pthread_mutex_unlock(thread_func_args->mutex);
-      return thread_param;
-    }
+  int ret;
 
   while(1)
   {
@@ -419,12 +1088,42 @@ void* socket_thread_func(void* thread_param)
           close(thread_func_args->accepted_fd);      
         thread_func_args->thread_completed = true;
         thread_func_args->thread_generated_error = true;
+        if (tempfile_fd >= 0)
+          close(tempfile_fd);
         return thread_param;
       }
 
       if (bytes_received == 0)
         break; /* connection closed by peer */
 
+      /* the lock is held for each packet, from its write until its replay is sent */
+      ret = pthread_mutex_lock(thread_func_args->mutex);
+      if (ret != 0)
+      {
+        syslog(LOG_ERR, "Error acquiring mutex");
+        if (thread_func_args->accepted_fd >= 0)
+          close(thread_func_args->accepted_fd);      
+        thread_func_args->thread_completed = true;
+        thread_func_args->thread_generated_error = true;    
+        if (tempfile_fd >= 0)
+          close(tempfile_fd);
+        return thread_param;
+      }
+
+      /* open the file, the in-memory history needs none, a replay closes it again */
+      if (!memory_history && tempfile_fd < 0)
+        tempfile_fd = open(thread_func_args->data_path, O_CREAT | O_APPEND | O_RDWR, 0666);
+      if (!memory_history && tempfile_fd < 0)
+      {
+        syslog(LOG_ERR, "Could not open temp file %s", thread_func_args->data_path);
+        if (thread_func_args->accepted_fd >= 0)
+          close(thread_func_args->accepted_fd);      
+        thread_func_args->thread_completed = true;
+        thread_func_args->thread_generated_error = true;
+        pthread_mutex_unlock(thread_func_args->mutex);
+        return thread_param;
+      }
+
       // int ret;
       // ret = pthread_mutex_lock(thread_func_args->mutex);
       // if (ret != 0)
@@ -454,19 +1153,30 @@ void* socket_thread_func(void* thread_param)
        * where X and Y are unsigned decimal integer values, 
        * the X should be considered the write command to seek into and 
        * the Y should be considered the offset within the write command */
-#ifdef USE_AESD_CHAR_DEVICE      
       uint32_t write_cmd;
       uint32_t write_cmd_offset;
-      struct aesd_seekto seekto = {
-        .write_cmd = 0,
-        .write_cmd_offset = 0
-      };
-      ret = sscanf(recv_buffer, "AESDCHAR_IOCSEEKTO:%u,%u\n", &write_cmd, &write_cmd_offset);
-      if (ret == 2) /* we need to get 2 parameters */
+      if (bytes_received >= 10 && memcmp(recv_buffer, "SUBSCRIBE\n", 10) == 0)
+      {
+        subscribed = true;
+        break;
+      }
+      else if (thread_func_args->local && bytes_received == strlen(AESD_SHM_OFFER) &&
+               memcmp(recv_buffer, AESD_SHM_OFFER, bytes_received) == 0)
+      {
+        shm = true;
+        break;
+      }
+      else if (aesd_query_parse(recv_buffer, bytes_received, &query) == 0)
+      {
+        /* GET, TAIL and GREP are answered from the history instead of being written to it */
+        queried = true;
+        break;
+      }
+      else if (history_can_seek() &&
+          sscanf(recv_buffer, "AESDCHAR_IOCSEEKTO:%u,%u\n", &write_cmd, &write_cmd_offset) == 2) /* we need to get 2 parameters */
       {
-        seekto.write_cmd = write_cmd;
-        seekto.write_cmd_offset = write_cmd_offset;
-        ret = ioctl(tempfile_fd, AESDCHAR_IOCSEEKTO, &seekto);
+        ret = seek_history(tempfile_fd, write_cmd, write_cmd_offset, &replay_offset);
+        seeked = true;
         if (ret != 0)
         {
           syslog(LOG_ERR, "Could not ioctl, write_cmd: %u, write_cmd_offset: %u", write_cmd, write_cmd_offset);
@@ -474,6 +1184,8 @@ void* socket_thread_func(void* thread_param)
             close(thread_func_args->accepted_fd);      
           thread_func_args->thread_completed = true;
           thread_func_args->thread_generated_error = true;
+          if (tempfile_fd >= 0)
+            close(tempfile_fd);
           pthread_mutex_unlock(thread_func_args->mutex);
           return thread_param;
         }
@@ -481,7 +1193,6 @@ void* socket_thread_func(void* thread_param)
         break;
       }
       else
-#endif      
       {
         // ret = pthread_mutex_lock(thread_func_args->mutex);
         // if (ret != 0)
@@ -512,34 +1223,42 @@ void* socket_thread_func(void* thread_param)
         if (pos < 0)
         {
           /* '\n' was not found, write entire buffer */
-          ret = write(tempfile_fd, recv_buffer, bytes_received);
+          ret = write_history(tempfile_fd, thread_func_args->snapshots, recv_buffer, bytes_received);
           if (ret < 0)
           {
-            syslog(LOG_ERR, "Could not write to temp file %s, '\\n' was not found", TEMP_FILE);
+            syslog(LOG_ERR, "Could not write to temp file %s, '\\n' was not found", thread_func_args->data_path);
             if (thread_func_args->accepted_fd >= 0)
               close(thread_func_args->accepted_fd);        
             thread_func_args->thread_completed = true;
             thread_func_args->thread_generated_error = true;
-            pthread_mutex_unlock(thread_func_args->mutex);      
+            if (tempfile_fd >= 0)
+              close(tempfile_fd);
+            pthread_mutex_unlock(thread_func_args->mutex);
             return thread_param;
           }
           //close(tempfile_fd);        
+
+          keep_pending(thread_func_args, recv_buffer, bytes_received);
+          pthread_mutex_unlock(thread_func_args->mutex);
         }
         else
         {
           /* '\n' was found, write only upto returned position */
-          ret = write(tempfile_fd, recv_buffer, pos+1);
+          ret = write_history(tempfile_fd, thread_func_args->snapshots, recv_buffer, pos+1);
           if (ret < 0)
           {
-            syslog(LOG_ERR, "Could not write to temp file %s, '\\n' was found", TEMP_FILE);
+            syslog(LOG_ERR, "Could not write to temp file %s, '\\n' was found", thread_func_args->data_path);
             if (thread_func_args->accepted_fd >= 0)
               close(thread_func_args->accepted_fd);        
             thread_func_args->thread_completed = true;
             thread_func_args->thread_generated_error = true;
+            if (tempfile_fd >= 0)
+              close(tempfile_fd);
             pthread_mutex_unlock(thread_func_args->mutex);
             return thread_param;
           }
           //close(tempfile_fd);
+          commit_pending(thread_func_args, recv_buffer, pos+1);
           break; 
         }
       }
@@ -553,13 +1272,24 @@ void* socket_thread_func(void* thread_param)
         close(thread_func_args->accepted_fd);
       thread_func_args->thread_completed = true;
       thread_func_args->thread_generated_error = false;
-      pthread_mutex_unlock(thread_func_args->mutex);
-      close(tempfile_fd);
+      if (tempfile_fd >= 0)
+        close(tempfile_fd);
       return thread_param;
     }
     else
     {
       /* open the temp file again and read all data and send back to remote peer */
+      if (subscribed)
+      {
+        follow_history(thread_func_args, tempfile_fd);
+        return thread_param;
+      }
+      if (shm)
+      {
+        serve_shm(thread_func_args, tempfile_fd);
+        return thread_param;
+      }
+
       printf("Read from circular buffer\n");
       // tempfile_fd = open(TEMP_FILE, O_RDONLY);
       // if (tempfile_fd < 0)
@@ -573,14 +1303,55 @@ void* socket_thread_func(void* thread_param)
       //   return thread_param;
       // }   
 
-      char file_buffer[1024];
-      ssize_t bytes_read = 0;
-      while ((bytes_read = read(tempfile_fd, file_buffer, sizeof(file_buffer))) > 0)
+      if (queried)
       {
-        send(thread_func_args->accepted_fd, file_buffer, bytes_read, 0);
+        answer_query(thread_func_args, tempfile_fd, &query);
+        queried = false;
       }
-      close(tempfile_fd);
-      pthread_mutex_unlock(thread_func_args->mutex);
+      else if (memory_history)
+      {
+        /* every packet replays the whole history unless a seek picked the start, copied with
+         * the lock held so a slow client only holds up itself */
+        size_t length = 0;
+        const char *window = aesd_magic_ring_window(&history_ring, replay_offset, &length);
+        if (window != NULL)
+          window = copy_history_window(thread_func_args, window, length);
+        pthread_mutex_unlock(thread_func_args->mutex);
+        if (window != NULL)
+          send_buffer(thread_func_args->accepted_fd, window, length);
+        replay_offset = 0;
+      }
+      else
+      {
+        /* the first replay of a generation is sent from the file with the lock held, further
+         * replays of an unchanged history share one snapshot, which is sent without the lock
+         * this assumes aesdsocket is the only writer of the history */
+        off_t offset = seeked ? lseek(tempfile_fd, 0, SEEK_CUR) : 0;
+        struct aesd_snapshot *snapshot = NULL;
+        if (offset < 0)
+          offset = 0;
+        else
+          snapshot = aesd_snapshot_share(thread_func_args->snapshots, tempfile_fd);
+        if (snapshot == NULL)
+        {
+          send_history(thread_func_args->accepted_fd, tempfile_fd, offset);
+          close(tempfile_fd);
+          pthread_mutex_unlock(thread_func_args->mutex);
+        }
+        else
+        {
+          syslog(LOG_DEBUG, "Replaying generation %llu, snapshot hit rate %.1f%%",
+                 (unsigned long long)snapshot->generation, aesd_snapshot_cache_hit_rate(thread_func_args->snapshots));
+          close(tempfile_fd);
+          pthread_mutex_unlock(thread_func_args->mutex);
+          if ((size_t)offset < snapshot->size)
+            send_buffer(thread_func_args->accepted_fd, snapshot->data + offset, snapshot->size - offset);
+          aesd_snapshot_put(snapshot);
+        }
+        seeked = false;
+      }
+      /* the replay closed the file and released the lock, the next packet takes both again */
+      tempfile_fd = -1;
     } /* if bytes_received == 0*/
   }
 
@@ -589,7 +1360,6 @@ void* socket_thread_func(void* thread_param)
 
   thread_func_args->thread_completed = true;
   thread_func_args->thread_generated_error = false;
-  pthread_mutex_unlock(thread_func_args->mutex);
   return thread_param;
 }
 
@@ -619,6 +1389,21 @@ void* timer_thread_func(void* thread_param)
         return thread_param;
       }
 
+      time_t t = time(NULL);
+      char time_str[50];
+      // year, month, day, hour (in 24 hour format) minute and second
+      strftime(time_str, 100, "timestamp:%Y, %m, %d, %H, %M, %S\n", localtime(&t));
+
+      if (memory_history)
+      {
+        if (write_history(-1, NULL, time_str, strlen(time_str)) < 0)
+          syslog(LOG_ERR, "Could not add the timestamp to the in-memory history");
+        else
+          publish_history(NULL, 0, time_str, strlen(time_str));
+        pthread_mutex_unlock(thread_func_args->mutex);
+        continue;
+      }
+
       tempfile_fd = open(TEMP_FILE, O_CREAT | O_APPEND | O_WRONLY, 0666);
       if (tempfile_fd < 0)
       {
@@ -627,11 +1412,7 @@ void* timer_thread_func(void* thread_param)
         return thread_param;
       }
 
-      time_t t = time(NULL);
-      char time_str[50];
-      // year, month, day, hour (in 24 hour format) minute and second
-      strftime(time_str, 100, "timestamp:%Y, %m, %d, %H, %M, %S\n", localtime(&t));
-      ret = write(tempfile_fd, time_str, strlen(time_str));
+      ret = write_history(tempfile_fd, &shard_snapshots[0], time_str, strlen(time_str));
       if (ret < 0)
       {
         syslog(LOG_ERR, "Could not write to temp file %s.", TEMP_FILE);
@@ -641,6 +1422,7 @@ void* timer_thread_func(void* thread_param)
         return thread_param;
       }
       close(tempfile_fd);
+      publish_history(NULL, 0, time_str, strlen(time_str));
       pthread_mutex_unlock(thread_func_args->mutex);
     }
   }
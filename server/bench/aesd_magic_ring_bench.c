@@ -0,0 +1,266 @@
+
+/*
+ * Replay benchmark of the in-memory history of aesdsocket: windows of a wrapped aesd_magic_ring
+ * are sent to a socket drained by another thread, the way a client's history is replayed.
+ *
+ * - magic:  the whole window with one send(), thanks to the double mapping
+ * - split:  the same window split at the end of the ring, two sends when it wraps
+ * - bounce: copied through a 1 KiB buffer and sent per chunk, like the read/send fallback
+ *           of send_history()
+ *
+ * Windows start at a random entry found with aesd_magic_ring_seekto and run to the end of the
+ * history. Every window is checked against the split copy, and the bytes received are counted.
+ *
+ * Usage: aesd-magic-ring-bench [-c capacity bytes] [-n replays]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "aesd_magic_ring.h"
+
+#define BOUNCE_SIZE 1024
+
+enum replay_mode
+{
+  REPLAY_MAGIC,
+  REPLAY_SPLIT,
+  REPLAY_BOUNCE,
+};
+
+struct drain
+{
+  int fd;
+  uint64_t bytes;
+};
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint32_t next_random(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+static void *drain_func(void *arg)
+{
+  struct drain *drain = arg;
+  static char buffer[1 << 20];
+  ssize_t received;
+
+  while ((received = recv(drain->fd, buffer, sizeof(buffer), 0)) > 0)
+    drain->bytes += received;
+  return NULL;
+}
+
+
+/* sends length bytes of data, returns the number of send calls */
+static unsigned long send_all(int fd, const char *data, size_t length)
+{
+  unsigned long calls = 0;
+
+  while (length)
+  {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+
+    calls++;
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("send");
+      exit(EXIT_FAILURE);
+    }
+    data += sent;
+    length -= sent;
+  }
+  return calls;
+}
+
+
+/* sends the window at offset of ring, returns the number of send calls */
+static unsigned long replay(struct aesd_magic_ring *ring, int fd, uint64_t offset, enum replay_mode mode)
+{
+  size_t length;
+  const char *window = aesd_magic_ring_window(ring, offset, &length);
+  size_t first;
+  unsigned long calls = 0;
+  char bounce[BOUNCE_SIZE];
+  size_t done;
+
+  if (!window)
+    return 0;
+
+  switch (mode)
+  {
+    case REPLAY_MAGIC:
+      return send_all(fd, window, length);
+    case REPLAY_SPLIT:
+      /* only the first mapping, as an ordinary ring */
+      first = ring->capacity - (window - ring->base);
+      if (first >= length)
+        return send_all(fd, window, length);
+      calls = send_all(fd, window, first);
+      return calls + send_all(fd, ring->base, length - first);
+    case REPLAY_BOUNCE:
+      for (done = 0; done < length; done += BOUNCE_SIZE)
+      {
+        size_t chunk = (length - done < BOUNCE_SIZE) ? length - done : BOUNCE_SIZE;
+        size_t pos = (window - ring->base + done) % ring->capacity;
+        size_t part = (ring->capacity - pos < chunk) ? ring->capacity - pos : chunk;
+
+        memcpy(bounce, ring->base + pos, part);
+        memcpy(bounce + part, ring->base, chunk - part);
+        calls += send_all(fd, bounce, chunk);
+      }
+      return calls;
+  }
+  return 0;
+}
+
+
+/* the window seen through the double mapping matches the ring read with a modulo */
+static bool window_ok(struct aesd_magic_ring *ring, uint64_t offset)
+{
+  size_t length;
+  const char *window = aesd_magic_ring_window(ring, offset, &length);
+  size_t start = window - ring->base;
+  size_t ii;
+
+  for (ii = 0; ii < length; ii++)
+    if (window[ii] != ring->base[(start + ii) % ring->capacity])
+      return false;
+  return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+  static const char *mode_names[] = { "magic", "split", "bounce" };
+  size_t capacity = 1 << 20;
+  unsigned long replays = 2000;
+  struct aesd_magic_ring ring;
+  char line[256];
+  uint32_t rng = 1;
+  uint64_t line_no = 0;
+  int mode;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c':
+        capacity = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        replays = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        printf("Usage: %s [-c capacity bytes] [-n replays]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (aesd_magic_ring_init(&ring, capacity) != 0)
+  {
+    perror("aesd_magic_ring_init");
+    exit(EXIT_FAILURE);
+  }
+
+  /* log lines until the ring wrapped a few times */
+  while (ring.dropped_bytes < 3 * ring.capacity)
+  {
+    int length = snprintf(line, sizeof(line), "%08llu ", (unsigned long long)line_no++);
+    size_t fill = 8 + next_random(&rng) % 180;
+
+    memset(line + length, 'a' + line_no % 26, fill);
+    line[length + fill] = '\n';
+    if (aesd_magic_ring_append(&ring, line, length + fill + 1) != 0)
+    {
+      printf("Append failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printf("%zu bytes, %llu entries in the history\n", (size_t)aesd_magic_ring_size(&ring),
+         (unsigned long long)aesd_magic_ring_count(&ring));
+  printf("%-7s %10s %12s %10s %12s\n", "mode", "replays", "sends", "us/replay", "MB/s");
+
+  for (mode = REPLAY_MAGIC; mode <= REPLAY_BOUNCE; mode++)
+  {
+    struct drain drain = { 0, 0 };
+    pthread_t thread;
+    int fds[2];
+    uint64_t expected = 0;
+    unsigned long calls = 0;
+    unsigned long ii;
+    uint64_t start;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      perror("socketpair");
+      exit(EXIT_FAILURE);
+    }
+    drain.fd = fds[1];
+    pthread_create(&thread, NULL, drain_func, &drain);
+
+    rng = 2;
+    start = now_ns();
+    for (ii = 0; ii < replays; ii++)
+    {
+      uint32_t entry = next_random(&rng) % aesd_magic_ring_count(&ring);
+      uint64_t offset;
+
+      if (aesd_magic_ring_seekto(&ring, entry, 0, &offset) != 0)
+      {
+        printf("Seek to entry %u failed\n", entry);
+        exit(EXIT_FAILURE);
+      }
+      calls += replay(&ring, fds[0], offset, mode);
+      expected += aesd_magic_ring_size(&ring) - offset;
+    }
+    shutdown(fds[0], SHUT_WR);
+    pthread_join(thread, NULL);
+    start = now_ns() - start;
+    close(fds[0]);
+    close(fds[1]);
+
+    printf("%-7s %10lu %12lu %10.2f %12.1f\n", mode_names[mode], replays, calls,
+           start / 1e3 / replays, expected * 1e3 / start);
+    if (drain.bytes != expected)
+    {
+      printf("%s received %llu of %llu bytes\n", mode_names[mode], (unsigned long long)drain.bytes,
+             (unsigned long long)expected);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* a window across the end of the ring reads the same through both mappings */
+  if (!window_ok(&ring, 0))
+  {
+    printf("The second mapping does not mirror the first\n");
+    exit(EXIT_FAILURE);
+  }
+
+  aesd_magic_ring_free(&ring);
+  return 0;
+}
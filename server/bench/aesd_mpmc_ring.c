@@ -0,0 +1,267 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "aesd_mpmc_ring.h"
+
+/* lookups that keep losing their entry to producers give up after this many restarts */
+#define FIND_RETRIES 64
+
+static inline struct aesd_mpmc_stamp *stamp_at(struct aesd_mpmc_ring *ring, uint64_t pos)
+{
+  return &ring->stamps[pos & ring->mask];
+}
+
+
+static inline char *data_at(struct aesd_mpmc_ring *ring, uint64_t pos)
+{
+  return ring->data + (pos & ring->mask) * ring->stride;
+}
+
+
+/* slot data goes in whole relaxed atomic words, see aesd_mpmc_ring.h, a slot is cache line
+ * aligned and its stride leaves room for the last word of an entry */
+static void slot_store(char *slot, const char *src, size_t size)
+{
+  _Atomic uint64_t *words = (_Atomic uint64_t *)slot;
+  size_t ii;
+
+  for (ii = 0; ii * sizeof(uint64_t) < size; ii++)
+  {
+    uint64_t word = 0;
+    size_t length = size - ii * sizeof(word);
+
+    memcpy(&word, src + ii * sizeof(word), length < sizeof(word) ? length : sizeof(word));
+    atomic_store_explicit(&words[ii], word, memory_order_relaxed);
+  }
+}
+
+
+static void slot_load(char *dst, const char *slot, size_t size)
+{
+  _Atomic uint64_t *words = (_Atomic uint64_t *)slot;
+  size_t ii;
+
+  for (ii = 0; ii * sizeof(uint64_t) < size; ii++)
+  {
+    uint64_t word = atomic_load_explicit(&words[ii], memory_order_relaxed);
+    size_t length = size - ii * sizeof(word);
+
+    memcpy(dst + ii * sizeof(word), &word, length < sizeof(word) ? length : sizeof(word));
+  }
+}
+
+
+/**
+ * Sets up an empty ring of 1 << order slots holding entries of up to slot_size bytes.
+ * Returns 0 on success, -ENOMEM if the slots could not be allocated
+ */
+int aesd_mpmc_ring_init(struct aesd_mpmc_ring *ring, unsigned int order, size_t slot_size)
+{
+  uint64_t pos;
+
+  ring->mask = (1ULL << order) - 1;
+  ring->slot_size = slot_size;
+  /* slot data doesn't share cache lines so producers copying neighbouring entries don't contend */
+  ring->stride = (slot_size + 63) & ~(size_t)63;
+  if (posix_memalign((void **)&ring->stamps, 64, (ring->mask + 1) * sizeof(*ring->stamps)) != 0)
+    return -ENOMEM;
+  if (posix_memalign((void **)&ring->data, 64, (ring->mask + 1) * ring->stride) != 0)
+  {
+    free(ring->stamps);
+    return -ENOMEM;
+  }
+
+  for (pos = 0; pos <= ring->mask; pos++)
+  {
+    atomic_init(&stamp_at(ring, pos)->seq, pos);
+    atomic_init(&stamp_at(ring, pos)->size, 0);
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->overwritten, 0);
+  return 0;
+}
+
+
+void aesd_mpmc_ring_free(struct aesd_mpmc_ring *ring)
+{
+  free(ring->stamps);
+  free(ring->data);
+  ring->stamps = NULL;
+  ring->data = NULL;
+}
+
+
+/**
+ * Consumes the entry at position pos, copying it to buf if not NULL, provided pos is still the
+ * oldest entry. Returns its size, -EAGAIN if pos is not published yet or -ESTALE if another
+ * consumer took it first
+ */
+static ssize_t take(struct aesd_mpmc_ring *ring, uint64_t pos, char *buf)
+{
+  struct aesd_mpmc_stamp *stamp = stamp_at(ring, pos);
+  uint64_t seq = atomic_load_explicit(&stamp->seq, memory_order_acquire);
+  int64_t diff = (int64_t)(seq - (pos + 1));
+  uint32_t size;
+
+  if (diff < 0)
+    return -EAGAIN;
+  if (diff > 0)
+    return -ESTALE;
+  if (!atomic_compare_exchange_strong_explicit(&ring->tail, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed))
+    return -ESTALE;
+
+  /* no producer writes the slot before the stamp below, but finds may read it */
+  size = atomic_load_explicit(&stamp->size, memory_order_relaxed);
+  if (buf)
+    slot_load(buf, data_at(ring, pos), size);
+  /* free for the producer of the next lap */
+  atomic_store_explicit(&stamp->seq, pos + ring->mask + 1, memory_order_release);
+  return size;
+}
+
+
+/**
+ * Appends a copy of the size bytes at data, dropping the oldest entry if the ring is full.
+ * Returns 0 on success, -EMSGSIZE if the entry is larger than a slot
+ */
+int aesd_mpmc_ring_push(struct aesd_mpmc_ring *ring, const char *data, size_t size)
+{
+  if (size > ring->slot_size)
+    return -EMSGSIZE;
+
+  for (;;)
+  {
+    uint64_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct aesd_mpmc_stamp *stamp = stamp_at(ring, pos);
+    uint64_t seq = atomic_load_explicit(&stamp->seq, memory_order_acquire);
+    int64_t diff = (int64_t)(seq - pos);
+
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+      {
+        atomic_store_explicit(&stamp->size, (uint32_t)size, memory_order_relaxed);
+        slot_store(data_at(ring, pos), data, size);
+        atomic_store_explicit(&stamp->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    }
+    else if (diff < 0)
+    {
+      /* full, the slot still holds the entry a lap behind: overwrite the oldest */
+      if (take(ring, pos - ring->mask - 1, NULL) >= 0)
+        atomic_fetch_add_explicit(&ring->overwritten, 1, memory_order_relaxed);
+    }
+    /* diff > 0: another producer claimed pos, try the next one */
+  }
+}
+
+
+/**
+ * Removes the oldest entry into buf, which must hold slot_size bytes.
+ * Returns the size of the entry, -EAGAIN if the ring is empty, -EINVAL if buf is too small
+ */
+ssize_t aesd_mpmc_ring_pop(struct aesd_mpmc_ring *ring, char *buf, size_t buf_size)
+{
+  if (buf && buf_size < ring->slot_size)
+    return -EINVAL;
+
+  for (;;)
+  {
+    uint64_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ssize_t result = take(ring, pos, buf);
+
+    if (result != -ESTALE)
+      return result;
+  }
+}
+
+
+/**
+ * Same semantics as aesd_circular_buffer_find_entry_offset_for_fpos: char_offset counts from the
+ * first byte of the oldest entry. Copies the entry holding it into buf, which must hold
+ * slot_size bytes, and stores the offset within the entry in entry_offset_byte_rtn. Entries are
+ * not consumed.
+ * Returns the size of the entry, -ENOENT if char_offset is past the published entries,
+ * -EAGAIN if producers kept overwriting the entries being walked, -EINVAL if buf is too small
+ */
+ssize_t aesd_mpmc_ring_find(struct aesd_mpmc_ring *ring, size_t char_offset, char *buf, size_t buf_size,
+                            size_t *entry_offset_byte_rtn)
+{
+  /* the ring geometry is constant, keep it out of the atomics in the walk */
+  const uint64_t mask = ring->mask;
+  const size_t stride = ring->stride;
+  const size_t slot_size = ring->slot_size;
+  struct aesd_mpmc_stamp *const stamps = ring->stamps;
+  char *const data = ring->data;
+  int attempt;
+
+  if (buf_size < slot_size)
+    return -EINVAL;
+
+  for (attempt = 0; attempt < FIND_RETRIES; attempt++)
+  {
+    uint64_t pos = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t remaining = char_offset;
+    bool restart = false;
+
+    for (; pos < head && !restart; pos++)
+    {
+      struct aesd_mpmc_stamp *stamp = &stamps[pos & mask];
+      uint64_t seq = atomic_load_explicit(&stamp->seq, memory_order_acquire);
+      uint32_t size;
+
+      if (seq != pos + 1)
+      {
+        /* behind pos + 1 the entry is still being written, the published history ends here */
+        if ((int64_t)(seq - (pos + 1)) < 0)
+          return -ENOENT;
+        restart = true; /* consumed or overwritten, the start of the history moved */
+        break;
+      }
+
+      size = atomic_load_explicit(&stamp->size, memory_order_relaxed);
+      if (size > slot_size)
+        size = slot_size;
+      if (remaining < size)
+        slot_load(buf, data + (pos & mask) * stride, size);
+
+      /* the copy only counts if the slot was not recycled meanwhile */
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&stamp->seq, memory_order_relaxed) != seq)
+      {
+        restart = true;
+        break;
+      }
+
+      if (remaining < size)
+      {
+        *entry_offset_byte_rtn = remaining;
+        return size;
+      }
+      remaining -= size;
+    }
+
+    if (!restart)
+      return -ENOENT;
+  }
+  return -EAGAIN;
+}
+
+
+/**
+ * Returns the number of entries in the ring, a snapshot that may already be stale
+ */
+uint64_t aesd_mpmc_ring_count(struct aesd_mpmc_ring *ring)
+{
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  return head - tail;
+}
@@ -0,0 +1,56 @@
+
+#ifndef _AESD_MPMC_RING_H_
+#define _AESD_MPMC_RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Bounded lock-free multi-producer/multi-consumer ring of entries, the user space counterpart of
+ * aesd_circular_buffer that needs no mutex. It lives with aesd-mpmc-ring-bench, which measures it
+ * against a mutex, and is not part of aesdsocket: its in-memory history (aesd_magic_ring)
+ * replays contiguous windows of lines of any length, which fixed-size slots can't give.
+ *
+ * Every slot carries a sequence stamp (Vyukov's bounded queue): a slot for position pos is free
+ * for a producer when its stamp is pos, holds the entry of pos when its stamp is pos + 1 and
+ * is free for the next lap once a consumer sets it to pos + capacity. When the ring is full a
+ * producer drops the oldest entry, like aesd_circular_buffer_add_entry overwrites it.
+ *
+ * The stamps are packed in their own array so lookups walk a few cache lines instead of every
+ * slot's data. Entries are copied into the slot, so no pointer ever outlives its slot. Readers that don't
+ * consume (aesd_mpmc_ring_find) copy an entry out and check the stamp did not move meanwhile,
+ * like a seqlock, and retry otherwise. As in a seqlock such a copy can overlap a producer
+ * recycling the slot, so producers and finds move slot data in relaxed atomic words, never with
+ * memcpy: the torn copy is then only stale data the stamp check throws away, not a data race.
+ */
+
+struct aesd_mpmc_stamp
+{
+  _Atomic uint64_t seq;  /* sequence stamp, see above */
+  _Atomic uint32_t size; /* bytes used in the slot's data */
+};
+
+struct aesd_mpmc_ring
+{
+  _Alignas(64) _Atomic uint64_t head; /* next position to produce */
+  _Alignas(64) _Atomic uint64_t tail; /* oldest position not consumed yet */
+  _Alignas(64) _Atomic uint64_t overwritten; /* entries dropped to make room */
+  uint64_t mask;    /* capacity - 1, the capacity is a power of two */
+  size_t slot_size; /* largest entry in bytes */
+  size_t stride;    /* bytes between slot data, a multiple of the cache line */
+  struct aesd_mpmc_stamp *stamps; /* packed apart from the data so lookups walk few lines */
+  char *data;
+};
+
+int aesd_mpmc_ring_init(struct aesd_mpmc_ring *ring, unsigned int order, size_t slot_size);
+void aesd_mpmc_ring_free(struct aesd_mpmc_ring *ring);
+int aesd_mpmc_ring_push(struct aesd_mpmc_ring *ring, const char *data, size_t size);
+ssize_t aesd_mpmc_ring_pop(struct aesd_mpmc_ring *ring, char *buf, size_t buf_size);
+ssize_t aesd_mpmc_ring_find(struct aesd_mpmc_ring *ring, size_t char_offset, char *buf, size_t buf_size,
+                            size_t *entry_offset_byte_rtn);
+uint64_t aesd_mpmc_ring_count(struct aesd_mpmc_ring *ring);
+
+#endif /* _AESD_MPMC_RING_H_ */
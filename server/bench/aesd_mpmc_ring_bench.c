@@ -0,0 +1,258 @@
+
+/*
+ * Contention benchmark of the lock-free aesd_mpmc_ring against the same history kept in an
+ * aesd_ring behind a mutex, the way aesdsocket guards its data today.
+ *
+ * For 1, 2, 4 .. max threads every thread runs its share of the operations, half of them
+ * appending a packet and half of them looking up a random offset in the history like a client
+ * replaying it. Packets are filled with a single byte value so torn copies are detected.
+ *
+ * Usage: aesd-mpmc-ring-bench [-n total operations] [-t max threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "aesd_mpmc_ring.h"
+#include "aesd-ring.h"
+
+#define RING_ORDER 10 /* 1024 entries */
+#define SLOT_SIZE 256 /* largest packet */
+#define MAX_THREADS 64
+
+struct locked_slot
+{
+  uint32_t size;
+  char data[SLOT_SIZE];
+};
+
+AESD_RING_DECLARE(locked_ring, struct locked_slot, RING_ORDER)
+AESD_RING_DECLARE_FIND(locked_ring, struct locked_slot, size)
+
+struct bench
+{
+  bool locked;  /* use the mutex baseline */
+  unsigned long ops_per_thread;
+  pthread_barrier_t start;
+  struct aesd_mpmc_ring mpmc;
+  struct locked_ring ring;
+  pthread_mutex_t mutex;
+  _Atomic unsigned long torn; /* lookups that returned a mixed up packet */
+  _Atomic unsigned long found; /* lookups that hit an entry */
+};
+
+struct worker
+{
+  struct bench *bench;
+  unsigned int id;
+  pthread_t thread;
+};
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint32_t next_random(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+/* every byte of a packet holds the same value, anything else is a torn copy */
+static bool packet_ok(const char *data, size_t size)
+{
+  size_t ii;
+
+  for (ii = 1; ii < size; ii++)
+    if (data[ii] != data[0])
+      return false;
+  return true;
+}
+
+
+static void *worker_func(void *arg)
+{
+  struct worker *worker = arg;
+  struct bench *bench = worker->bench;
+  uint32_t rng = 0x9e3779b9u * (worker->id + 1);
+  char packet[SLOT_SIZE];
+  char copy[SLOT_SIZE];
+  unsigned long ii;
+  unsigned long torn = 0;
+  unsigned long found = 0;
+
+  pthread_barrier_wait(&bench->start);
+  for (ii = 0; ii < bench->ops_per_thread; ii++)
+  {
+    uint32_t pick = next_random(&rng);
+
+    if (pick & 1)
+    {
+      size_t size = 16 + (pick >> 1) % (SLOT_SIZE - 16);
+
+      memset(packet, (int)(worker->id * 31 + ii), size);
+      if (bench->locked)
+      {
+        pthread_mutex_lock(&bench->mutex);
+        if (locked_ring_full(&bench->ring))
+          bench->ring.tail++; /* drop the oldest */
+        struct locked_slot *slot = locked_ring_at(&bench->ring, locked_ring_count(&bench->ring));
+        slot->size = size;
+        memcpy(slot->data, packet, size);
+        bench->ring.head++;
+        pthread_mutex_unlock(&bench->mutex);
+      }
+      else
+      {
+        aesd_mpmc_ring_push(&bench->mpmc, packet, size);
+      }
+    }
+    else
+    {
+      /* about half way into a full history */
+      size_t offset = (pick >> 1) % ((1U << RING_ORDER) * SLOT_SIZE / 2);
+      size_t entry_offset;
+      ssize_t size = -ENOENT;
+
+      if (bench->locked)
+      {
+        pthread_mutex_lock(&bench->mutex);
+        struct locked_slot *slot = locked_ring_find_offset(&bench->ring, offset, &entry_offset);
+        if (slot)
+        {
+          size = slot->size;
+          memcpy(copy, slot->data, size);
+        }
+        pthread_mutex_unlock(&bench->mutex);
+      }
+      else
+      {
+        size = aesd_mpmc_ring_find(&bench->mpmc, offset, copy, sizeof(copy), &entry_offset);
+      }
+
+      if (size > 0)
+      {
+        found++;
+        if (!packet_ok(copy, size))
+          torn++;
+      }
+    }
+  }
+
+  atomic_fetch_add(&bench->torn, torn);
+  atomic_fetch_add(&bench->found, found);
+  return NULL;
+}
+
+
+/**
+ * Runs total_ops operations over threads workers, returns the elapsed time in ns
+ */
+static uint64_t run(struct bench *bench, unsigned int threads, unsigned long total_ops)
+{
+  struct worker workers[MAX_THREADS];
+  uint64_t start;
+  unsigned int ii;
+
+  bench->ops_per_thread = total_ops / threads;
+  pthread_barrier_init(&bench->start, NULL, threads + 1);
+  for (ii = 0; ii < threads; ii++)
+  {
+    workers[ii].bench = bench;
+    workers[ii].id = ii;
+    if (pthread_create(&workers[ii].thread, NULL, worker_func, &workers[ii]) != 0)
+    {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_barrier_wait(&bench->start);
+  start = now_ns();
+  for (ii = 0; ii < threads; ii++)
+    pthread_join(workers[ii].thread, NULL);
+  start = now_ns() - start;
+
+  pthread_barrier_destroy(&bench->start);
+  return start ? start : 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned long total_ops = 4000000;
+  unsigned int max_threads = MAX_THREADS;
+  unsigned int threads;
+  struct bench *bench;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        total_ops = strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        max_threads = (unsigned int)strtoul(optarg, NULL, 0);
+        if (max_threads < 1 || max_threads > MAX_THREADS)
+        {
+          printf("Threads must be between 1 and %d\n", MAX_THREADS);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        printf("Usage: %s [-n total operations] [-t max threads]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  bench = calloc(1, sizeof(*bench));
+  if (!bench)
+    exit(EXIT_FAILURE);
+
+  printf("%7s %12s %10s %12s %10s %8s\n", "threads", "lockfree", "Mops/s", "mutex", "Mops/s", "speedup");
+  for (threads = 1; threads <= max_threads; threads *= 2)
+  {
+    uint64_t lockfree_ns, locked_ns;
+    unsigned long ops = total_ops / threads * threads;
+
+    if (aesd_mpmc_ring_init(&bench->mpmc, RING_ORDER, SLOT_SIZE) != 0)
+      exit(EXIT_FAILURE);
+    bench->locked = false;
+    lockfree_ns = run(bench, threads, total_ops);
+    aesd_mpmc_ring_free(&bench->mpmc);
+
+    locked_ring_init(&bench->ring);
+    pthread_mutex_init(&bench->mutex, NULL);
+    bench->locked = true;
+    locked_ns = run(bench, threads, total_ops);
+    pthread_mutex_destroy(&bench->mutex);
+
+    printf("%7u %9.1f ns %10.2f %9.1f ns %10.2f %7.2fx\n", threads,
+           (double)lockfree_ns / ops, ops * 1e3 / lockfree_ns,
+           (double)locked_ns / ops, ops * 1e3 / locked_ns,
+           (double)locked_ns / lockfree_ns);
+  }
+
+  printf("%lu lookups found an entry, %lu were torn\n", (unsigned long)bench->found, (unsigned long)bench->torn);
+  if (bench->torn)
+    exit(EXIT_FAILURE);
+  free(bench);
+  return 0;
+}
@@ -0,0 +1,371 @@
+
+/*
+ * Fan-out benchmark of aesdsocket's SUBSCRIBE feed: one publisher pushes batches of log lines
+ * to many subscriber threads, as the SUBSCRIBE clients of aesdsocket are served.
+ *
+ * - shared: aesd_pubsub, each batch copied once into a reference counted buffer that every
+ *           subscriber reads from a shared ring
+ * - copy:   a queue per subscriber, the publisher copying every batch into each of them
+ *
+ * The publish cost is the CPU time of the publisher, which does not count the time it waits for
+ * the CPU while subscribers run; total is the wall time until every subscriber got every batch.
+ *
+ * Every subscriber must receive every batch, in order and intact. A last run makes one
+ * subscriber stall so the feed laps it, and checks the batches it skipped are counted (or that
+ * it is disconnected with -k).
+ *
+ * Usage: aesd-pubsub-bench [-s subscribers] [-n batches] [-b batch bytes] [-k]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "aesd_pubsub.h"
+
+/* order of the shared ring, as HISTORY_FEED_ORDER of aesdsocket */
+#define FEED_ORDER 10
+
+/* batches a subscriber takes at a time, as FEED_BATCHES_PER_WAKEUP of aesdsocket */
+#define BATCHES_PER_WAKEUP 16
+
+/* slots of a per subscriber queue of the copy mode, the publisher waits when one is full */
+#define COPY_QUEUE 64
+
+struct copy_queue
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  char *batches[COPY_QUEUE];
+  size_t sizes[COPY_QUEUE];
+  unsigned long head;
+  unsigned long tail;
+  bool closed;
+};
+
+struct subscriber
+{
+  struct aesd_pubsub *pubsub;
+  struct copy_queue *queue;
+  struct aesd_subscription subscription;
+  unsigned long received;
+  uint64_t checksum;
+  bool in_order;
+  bool stall;       /* waits for the publisher to be done before reading */
+  pthread_barrier_t *done;
+};
+
+
+static uint64_t now_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* what a subscriber does with a batch instead of sending it, the batch starts with its number */
+static void deliver(struct subscriber *subscriber, const char *data, size_t size)
+{
+  unsigned long number = strtoul(data, NULL, 10);
+  size_t ii;
+
+  if (number != subscriber->received + subscriber->subscription.dropped)
+    subscriber->in_order = false;
+  for (ii = 0; ii < size; ii += 64)
+    subscriber->checksum += (unsigned char)data[ii];
+  subscriber->received++;
+}
+
+
+static void *shared_func(void *arg)
+{
+  struct subscriber *subscriber = arg;
+  struct aesd_batch *batches[BATCHES_PER_WAKEUP];
+  size_t count;
+  size_t ii;
+
+  if (subscriber->stall)
+    pthread_barrier_wait(subscriber->done);
+  while ((count = aesd_pubsub_next(subscriber->pubsub, &subscriber->subscription, batches, BATCHES_PER_WAKEUP)) > 0)
+    for (ii = 0; ii < count; ii++)
+    {
+      deliver(subscriber, batches[ii]->data, batches[ii]->size);
+      aesd_batch_put(batches[ii]);
+    }
+  aesd_pubsub_unsubscribe(subscriber->pubsub, &subscriber->subscription);
+  return NULL;
+}
+
+
+static void *copy_func(void *arg)
+{
+  struct subscriber *subscriber = arg;
+  struct copy_queue *queue = subscriber->queue;
+
+  for (;;)
+  {
+    char *batch;
+    size_t size;
+
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->closed && queue->head == queue->tail)
+      pthread_cond_wait(&queue->ready, &queue->lock);
+    if (queue->head == queue->tail)
+    {
+      pthread_mutex_unlock(&queue->lock);
+      break;
+    }
+    batch = queue->batches[queue->tail % COPY_QUEUE];
+    size = queue->sizes[queue->tail % COPY_QUEUE];
+    queue->tail++;
+    pthread_cond_broadcast(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    deliver(subscriber, batch, size);
+    free(batch);
+  }
+  return NULL;
+}
+
+
+/* the batch of number, a few log lines of size bytes in all */
+static void make_batch(char *batch, size_t size, unsigned long number)
+{
+  size_t ii;
+  int used = snprintf(batch, size, "%lu ", number);
+
+  for (ii = used; ii < size; ii++)
+    batch[ii] = (ii % 80 == 79) ? '\n' : 'a' + (number + ii) % 26;
+  batch[size - 1] = '\n';
+}
+
+
+/* runs a mode, returns false if a subscriber missed a batch it should have had */
+static bool run(const char *name, bool shared, unsigned long subscribers, unsigned long batches, size_t batch_size,
+                enum aesd_pubsub_policy policy, bool stall_one)
+{
+  struct aesd_pubsub pubsub;
+  struct copy_queue *queues = NULL;
+  struct subscriber *subs = calloc(subscribers, sizeof(*subs));
+  pthread_t *threads = calloc(subscribers, sizeof(*threads));
+  pthread_barrier_t done;
+  pthread_attr_t attr;
+  char *batch = malloc(batch_size);
+  uint64_t publish_ns = 0;
+  uint64_t start;
+  uint64_t expected_checksum = 0;
+  unsigned long ii;
+  unsigned long jj;
+  bool ok = true;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  pthread_barrier_init(&done, NULL, 2);
+  if (shared)
+    aesd_pubsub_init(&pubsub, FEED_ORDER, policy);
+  else
+  {
+    queues = calloc(subscribers, sizeof(*queues));
+    for (ii = 0; ii < subscribers; ii++)
+    {
+      pthread_mutex_init(&queues[ii].lock, NULL);
+      pthread_cond_init(&queues[ii].ready, NULL);
+    }
+  }
+
+  start = now_ns(CLOCK_MONOTONIC);
+  for (ii = 0; ii < subscribers; ii++)
+  {
+    subs[ii].pubsub = &pubsub;
+    subs[ii].queue = queues ? &queues[ii] : NULL;
+    subs[ii].in_order = true;
+    subs[ii].stall = stall_one && ii == 0;
+    subs[ii].done = &done;
+    if (shared)
+      aesd_pubsub_subscribe(&pubsub, &subs[ii].subscription);
+    if (pthread_create(&threads[ii], &attr, shared ? shared_func : copy_func, &subs[ii]) != 0)
+    {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (ii = 0; ii < batches; ii++)
+  {
+    uint64_t publish_start;
+    size_t jj_size;
+
+    make_batch(batch, batch_size, ii);
+    for (jj_size = 0; jj_size < batch_size; jj_size += 64)
+      expected_checksum += (unsigned char)batch[jj_size];
+
+    publish_start = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (shared)
+    {
+      struct iovec iov = { .iov_base = batch, .iov_len = batch_size };
+      aesd_pubsub_publish(&pubsub, &iov, 1);
+    }
+    else
+    {
+      for (jj = 0; jj < subscribers; jj++)
+      {
+        struct copy_queue *queue = &queues[jj];
+        char *copy = malloc(batch_size);
+
+        memcpy(copy, batch, batch_size);
+        pthread_mutex_lock(&queue->lock);
+        while (queue->head - queue->tail == COPY_QUEUE)
+          pthread_cond_wait(&queue->ready, &queue->lock);
+        queue->batches[queue->head % COPY_QUEUE] = copy;
+        queue->sizes[queue->head % COPY_QUEUE] = batch_size;
+        queue->head++;
+        pthread_cond_broadcast(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+      }
+    }
+    publish_ns += now_ns(CLOCK_THREAD_CPUTIME_ID) - publish_start;
+  }
+
+  /* the stalled subscriber starts reading now, then everybody is told the feed is over once the
+   * batches still kept are read */
+  if (stall_one)
+    pthread_barrier_wait(&done);
+  if (shared)
+  {
+    while (aesd_pubsub_has_subscribers(&pubsub))
+    {
+      bool drained = true;
+
+      pthread_mutex_lock(&pubsub.lock);
+      for (ii = 0; ii < subscribers; ii++)
+        if (!subs[ii].subscription.disconnected && subs[ii].subscription.next != pubsub.head)
+          drained = false;
+      pthread_mutex_unlock(&pubsub.lock);
+      if (drained)
+        break;
+      usleep(1000);
+    }
+    aesd_pubsub_close(&pubsub);
+  }
+  else
+    for (ii = 0; ii < subscribers; ii++)
+    {
+      pthread_mutex_lock(&queues[ii].lock);
+      queues[ii].closed = true;
+      pthread_cond_broadcast(&queues[ii].ready);
+      pthread_mutex_unlock(&queues[ii].lock);
+    }
+  for (ii = 0; ii < subscribers; ii++)
+    pthread_join(threads[ii], NULL);
+  start = now_ns(CLOCK_MONOTONIC) - start;
+
+  printf("%-8s %6lu %8lu %12.2f %12.1f %12.1f\n", name, subscribers, batches, publish_ns / 1e3 / batches,
+         start / 1e6, (double)batches * batch_size * (shared ? 1 : subscribers) / 1e6);
+
+  for (ii = 0; ii < subscribers; ii++)
+  {
+    if (!subs[ii].in_order)
+    {
+      printf("%s: subscriber %lu got batches out of order\n", name, ii);
+      ok = false;
+    }
+    if (stall_one)
+    {
+      /* the others may be lapped too when the publisher outruns them */
+      if (policy == AESD_PUBSUB_DROP &&
+          ((subs[ii].stall && subs[ii].subscription.dropped == 0) ||
+           subs[ii].received + subs[ii].subscription.dropped != batches))
+      {
+        printf("%s: subscriber %lu got %lu and skipped %llu of %lu batches\n", name, ii, subs[ii].received,
+               (unsigned long long)subs[ii].subscription.dropped, batches);
+        ok = false;
+      }
+      if (policy == AESD_PUBSUB_DISCONNECT && subs[ii].stall && !subs[ii].subscription.disconnected)
+      {
+        printf("%s: stalled subscriber was not disconnected\n", name);
+        ok = false;
+      }
+      continue;
+    }
+    if (subs[ii].received != batches || subs[ii].checksum != expected_checksum)
+    {
+      printf("%s: subscriber %lu got %lu of %lu batches\n", name, ii, subs[ii].received, batches);
+      ok = false;
+    }
+  }
+  if (stall_one)
+    printf("%-8s %llu batches skipped, %llu subscribers disconnected\n", "", (unsigned long long)pubsub.dropped,
+           (unsigned long long)pubsub.disconnected);
+
+  if (shared)
+    aesd_pubsub_free(&pubsub);
+  else
+  {
+    for (ii = 0; ii < subscribers; ii++)
+    {
+      pthread_mutex_destroy(&queues[ii].lock);
+      pthread_cond_destroy(&queues[ii].ready);
+    }
+    free(queues);
+  }
+  pthread_barrier_destroy(&done);
+  pthread_attr_destroy(&attr);
+  free(batch);
+  free(threads);
+  free(subs);
+  return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned long subscribers = 1000;
+  unsigned long batches = 1000;
+  size_t batch_size = 512;
+  enum aesd_pubsub_policy policy = AESD_PUBSUB_DROP;
+  bool ok = true;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:n:b:k")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        subscribers = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        batches = strtoul(optarg, NULL, 0);
+        break;
+      case 'b':
+        batch_size = strtoul(optarg, NULL, 0);
+        break;
+      case 'k':
+        policy = AESD_PUBSUB_DISCONNECT;
+        break;
+      default:
+        printf("Usage: %s [-s subscribers] [-n batches] [-b batch bytes] [-k]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (subscribers < 1 || batches > (1UL << FEED_ORDER) || batch_size < 32)
+  {
+    printf("Needs a subscriber, at most %lu batches and batches of 32 bytes or more\n", 1UL << FEED_ORDER);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-8s %6s %8s %12s %12s %12s\n", "mode", "subs", "batches", "cpu us/pub", "total ms", "MB copied");
+  ok &= run("shared", true, subscribers, batches, batch_size, policy, false);
+  ok &= run("copy", false, subscribers, batches, batch_size, policy, false);
+
+  /* a subscriber stalled for longer than the ring is lapped */
+  ok &= run("lapped", true, subscribers < 4 ? subscribers : 4, 4 << FEED_ORDER, batch_size, policy, true);
+
+  return ok ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,363 @@
+
+/*
+ * Benchmark of the GET, TAIL and GREP queries of aesdsocket over a generated history.
+ *
+ * - grep:  matching lines found with aesd_find_literal (SSE2 where available), with glibc's
+ *          memmem, and line by line the way a client filters a full replay
+ * - range: the bytes of a range of lines found with aesd_line_index_range, and by counting
+ *          '\n' from the start of the history
+ *
+ * Every method must find the same lines and ranges, and aesd_query_grep must send exactly the
+ * matching lines through a socket. An index in an anonymous mapping, set up for a history file
+ * already written and then kept up to date with its writes, must match the one on the heap.
+ *
+ * Usage: aesd-query-bench [-l lines] [-n queries]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "aesd_line_index.h"
+#include "aesd_query.h"
+
+enum grep_mode
+{
+  GREP_SIMD,
+  GREP_MEMMEM,
+  GREP_LINES,
+};
+
+struct drain
+{
+  int fd;
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint32_t next_random(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+static void *drain_func(void *arg)
+{
+  struct drain *drain = arg;
+  ssize_t received;
+
+  for (;;)
+  {
+    if (drain->capacity - drain->length < 65536)
+    {
+      drain->capacity = 2 * drain->capacity + 65536;
+      drain->data = realloc(drain->data, drain->capacity);
+    }
+    received = recv(drain->fd, drain->data + drain->length, drain->capacity - drain->length, 0);
+    if (received <= 0)
+      break;
+    drain->length += received;
+  }
+  return NULL;
+}
+
+
+/* counts the lines of history containing literal, adding their bytes to *bytes */
+static unsigned long grep_count(const char *history, size_t length, const char *literal, enum grep_mode mode,
+                                uint64_t *bytes)
+{
+  const char *end = history + length;
+  const char *line = history;
+  size_t literal_length = strlen(literal);
+  unsigned long lines = 0;
+
+  while (line < end)
+  {
+    const char *line_end = memchr(line, '\n', end - line) + 1;
+    const char *line_start;
+    const char *match;
+
+    if (mode == GREP_LINES)
+    {
+      if (memmem(line, line_end - line, literal, literal_length))
+      {
+        lines++;
+        *bytes += line_end - line;
+      }
+      line = line_end;
+      continue;
+    }
+
+    match = (mode == GREP_SIMD) ? aesd_find_literal(line, end - line, literal, literal_length)
+                                : memmem(line, end - line, literal, literal_length);
+    if (!match)
+      break;
+    line_start = memrchr(line, '\n', match - line);
+    line = line_start ? line_start + 1 : line;
+    line_end = memchr(match, '\n', end - match) + 1;
+    lines++;
+    *bytes += line_end - line;
+    line = line_end;
+  }
+  return lines;
+}
+
+
+/* the bytes [start, end) of count lines from first, by counting '\n' */
+static void range_scan(const char *history, size_t length, uint64_t first, uint64_t count,
+                       uint64_t *start, uint64_t *end)
+{
+  const char *pos = history;
+  const char *stop = history + length;
+  uint64_t line = 0;
+
+  while (line < first && pos < stop)
+  {
+    pos = memchr(pos, '\n', stop - pos) + 1;
+    line++;
+  }
+  *start = pos - history;
+  while (line < first + count && pos < stop)
+  {
+    pos = memchr(pos, '\n', stop - pos) + 1;
+    line++;
+  }
+  *end = pos - history;
+}
+
+
+int main(int argc, char *argv[])
+{
+  static const char *grep_names[] = { "simd", "memmem", "lines" };
+  static const char *literals[] = { "ERROR", "id=4242", "zz" };
+  unsigned long lines = 200000;
+  unsigned long queries = 20;
+  struct aesd_line_index index;
+  char *history;
+  size_t length = 0;
+  uint32_t rng = 1;
+  unsigned long expected_lines[3];
+  uint64_t expected_bytes[3];
+  unsigned long ii;
+  int mode;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:n:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l':
+        lines = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        queries = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        printf("Usage: %s [-l lines] [-n queries]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  /* log lines of 40 to 120 bytes, one in 64 of them an error */
+  history = malloc(lines * 128);
+  for (ii = 0; ii < lines; ii++)
+  {
+    uint32_t random = next_random(&rng);
+    int used = sprintf(history + length, "%s id=%lu ", (random % 64 == 0) ? "ERROR" : "INFO", ii);
+
+    memset(history + length + used, 'a' + random % 25, 30 + random % 80);
+    used += 30 + random % 80;
+    history[length + used] = '\n';
+    length += used + 1;
+  }
+
+  if (aesd_line_index_init(&index) != 0 || aesd_line_index_scan(&index, history, length) != 0 ||
+      index.count != lines)
+  {
+    printf("Line index of %lu lines failed\n", lines);
+    exit(EXIT_FAILURE);
+  }
+  printf("%lu lines, %zu bytes in the history\n", lines, length);
+  printf("%-7s %-8s %10s %12s %12s\n", "query", "mode", "matches", "us/query", "MB/s");
+
+  for (ii = 0; ii < sizeof(literals) / sizeof(literals[0]); ii++)
+  {
+    for (mode = GREP_SIMD; mode <= GREP_LINES; mode++)
+    {
+      uint64_t bytes = 0;
+      unsigned long matches = 0;
+      unsigned long query;
+      uint64_t start = now_ns();
+
+      for (query = 0; query < queries; query++)
+        matches = grep_count(history, length, literals[ii], mode, &bytes);
+      start = now_ns() - start;
+      bytes /= queries;
+
+      printf("%-7s %-8s %10lu %12.1f %12.1f\n", literals[ii], grep_names[mode], matches,
+             start / 1e3 / queries, (double)length * queries * 1e3 / start);
+      if (mode == GREP_SIMD)
+      {
+        expected_lines[ii] = matches;
+        expected_bytes[ii] = bytes;
+      }
+      else if (matches != expected_lines[ii] || bytes != expected_bytes[ii])
+      {
+        printf("%s found %lu lines for %s, simd found %lu\n", grep_names[mode], matches, literals[ii],
+               expected_lines[ii]);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* ranges of 100 lines anywhere in the history */
+  for (mode = 0; mode < 2; mode++)
+  {
+    unsigned long query;
+    unsigned long ranges = queries * 50;
+    uint64_t checksum = 0;
+    uint64_t start_ns = now_ns();
+
+    rng = 3;
+    for (query = 0; query < ranges; query++)
+    {
+      uint64_t first = next_random(&rng) % lines;
+      uint64_t start;
+      uint64_t end;
+
+      if (mode == 0)
+        aesd_line_index_range(&index, first, 100, &start, &end);
+      else
+        range_scan(history, length, first, 100, &start, &end);
+      checksum += end - start;
+    }
+    start_ns = now_ns() - start_ns;
+    printf("%-7s %-8s %10llu %12.3f\n", "GET", mode ? "scan" : "index", (unsigned long long)checksum / ranges,
+           start_ns / 1e3 / ranges);
+  }
+
+  /* the index agrees with counting '\n', also for ranges running past the last line */
+  rng = 4;
+  for (ii = 0; ii < 200; ii++)
+  {
+    uint64_t first = next_random(&rng) % (lines + 10);
+    uint64_t count = next_random(&rng) % 300;
+    uint64_t start;
+    uint64_t end;
+    uint64_t scan_start;
+    uint64_t scan_end;
+
+    aesd_line_index_range(&index, first, count, &start, &end);
+    range_scan(history, length, first, count, &scan_start, &scan_end);
+    if (scan_start != start || scan_end != end)
+    {
+      printf("Range of %llu lines from %llu is [%llu, %llu), expected [%llu, %llu)\n", (unsigned long long)count,
+             (unsigned long long)first, (unsigned long long)start, (unsigned long long)end,
+             (unsigned long long)scan_start, (unsigned long long)scan_end);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* the server side: matching lines go out through a socket, nothing else */
+  {
+    struct drain drain = { 0, NULL, 0, 0 };
+    pthread_t thread;
+    int fds[2];
+    ssize_t sent;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      perror("socketpair");
+      exit(EXIT_FAILURE);
+    }
+    drain.fd = fds[1];
+    pthread_create(&thread, NULL, drain_func, &drain);
+    sent = aesd_query_grep(fds[0], history, length, literals[0], strlen(literals[0]));
+    shutdown(fds[0], SHUT_WR);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (sent < 0 || (uint64_t)sent != expected_bytes[0] || drain.length != expected_bytes[0])
+    {
+      printf("GREP %s sent %zd bytes, expected %llu\n", literals[0], sent, (unsigned long long)expected_bytes[0]);
+      exit(EXIT_FAILURE);
+    }
+    for (ii = 0; ii < drain.length; ii = (char *)memchr(drain.data + ii, '\n', drain.length - ii) - drain.data + 1)
+      if (memcmp(drain.data + ii, literals[0], strlen(literals[0])) != 0)
+      {
+        printf("GREP %s sent a line without it\n", literals[0]);
+        exit(EXIT_FAILURE);
+      }
+    free(drain.data);
+  }
+
+  /* a mapped index scans the lines already in the history, then grows with the writes */
+  {
+    char data_path[] = "/tmp/aesd-query-bench-XXXXXX";
+    struct aesd_line_index mapped;
+    size_t half = index.starts[lines / 2] + 3;
+    uint64_t start_ns;
+    uint64_t offset;
+    int data_fd = mkstemp(data_path);
+
+    start_ns = now_ns();
+    if (data_fd < 0 || write(data_fd, history, half) != (ssize_t)half ||
+        aesd_line_index_map(&mapped, data_fd) != 0 || mapped.count != lines / 2)
+    {
+      printf("Mapped index of %zu bytes failed\n", half);
+      exit(EXIT_FAILURE);
+    }
+    start_ns = now_ns() - start_ns;
+    printf("%-7s %-8s %10zu %12.1f\n", "map", "scan", mapped.count, start_ns / 1e3);
+
+    /* appended in pieces that split lines, as packets do */
+    for (offset = half; offset < length; offset += 1000)
+    {
+      size_t piece = (length - offset < 1000) ? length - offset : 1000;
+      if (write(data_fd, history + offset, piece) != (ssize_t)piece ||
+          aesd_line_index_scan(&mapped, history + offset, piece) != 0)
+      {
+        printf("Mapped index cannot follow the history\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (mapped.count != index.count || mapped.scanned != length ||
+        memcmp(mapped.starts, index.starts, (index.count + 1) * sizeof(*index.starts)) != 0 ||
+        aesd_line_index_seekto(&mapped, lines - 1, 2, &offset) != 0 || offset != index.starts[lines - 1] + 2 ||
+        aesd_line_index_seekto(&mapped, lines, 0, &offset) != -EINVAL)
+    {
+      printf("Mapped index differs from the one on the heap\n");
+      exit(EXIT_FAILURE);
+    }
+    aesd_line_index_free(&mapped);
+    close(data_fd);
+    unlink(data_path);
+  }
+
+  aesd_line_index_free(&index);
+  free(history);
+  return 0;
+}
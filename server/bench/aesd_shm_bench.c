@@ -0,0 +1,378 @@
+
+/*
+ * Round-trip latency of the transports of aesdsocket for a client on the same host: a client
+ * sends a line and waits for the reply, as a client of aesdsocket waits for its replay.
+ *
+ * - tcp:  a loopback TCP connection, as a client of server_fd
+ * - unix: a unix socket, as a client of the -u socket that stays on it
+ * - shm:  an aesd_shm channel set up over a unix socket, as a client of the -u socket that asked
+ *         for SHM, the lines and replies going through the shared rings
+ *
+ * The server is a thread of this process that answers every line with reply bytes starting with
+ * the line. Every reply must start with the line it answers. A last check has the client corrupt
+ * the counters of both rings, which the server must refuse rather than copy past its mapping,
+ * and one sends a stray byte over the unix socket, which must not end the session.
+ *
+ * Usage: aesd-shm-bench [-n round trips] [-b line bytes] [-r reply bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "aesd_shm.h"
+
+/* bytes in each ring of a channel, as SHM_RING_SIZE of aesdsocket */
+#define SHM_RING_SIZE (1 << 20)
+
+enum transport
+{
+  TRANSPORT_TCP,
+  TRANSPORT_UNIX,
+  TRANSPORT_SHM,
+};
+
+struct endpoint
+{
+  enum transport transport;
+  int fd;
+  struct aesd_shm_channel channel;
+};
+
+struct server
+{
+  struct endpoint endpoint;
+  int listen_fd;      /* tcp only, accepted from in the server thread */
+  size_t line_bytes;
+  size_t reply_bytes;
+};
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* the whole of length bytes, or false once the peer is gone */
+static bool put_bytes(struct endpoint *endpoint, const char *data, size_t length)
+{
+  if (endpoint->transport == TRANSPORT_SHM)
+    return aesd_shm_write(&endpoint->channel, data, length) == (ssize_t)length;
+
+  while (length > 0)
+  {
+    ssize_t sent = send(endpoint->fd, data, length, MSG_NOSIGNAL);
+    if (sent <= 0)
+      return false;
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+
+static bool get_bytes(struct endpoint *endpoint, char *buffer, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t received;
+
+    if (endpoint->transport == TRANSPORT_SHM)
+      received = aesd_shm_read(&endpoint->channel, buffer, length);
+    else
+      received = recv(endpoint->fd, buffer, length, 0);
+    if (received <= 0)
+      return false;
+    buffer += received;
+    length -= received;
+  }
+  return true;
+}
+
+
+static void *server_thread(void *arg)
+{
+  struct server *server = arg;
+  char *line = malloc(server->line_bytes);
+  char *reply = malloc(server->reply_bytes);
+
+  if (server->listen_fd >= 0)
+  {
+    int one = 1;
+    server->endpoint.fd = accept(server->listen_fd, NULL, NULL);
+    setsockopt(server->endpoint.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  memset(reply, 'x', server->reply_bytes);
+  reply[server->reply_bytes - 1] = '\n';
+  while (get_bytes(&server->endpoint, line, server->line_bytes))
+  {
+    memcpy(reply, line, server->line_bytes);
+    if (!put_bytes(&server->endpoint, reply, server->reply_bytes))
+      break;
+  }
+
+  free(line);
+  free(reply);
+  return NULL;
+}
+
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+
+/* connects a client to a server thread over transport, exits on failure */
+static void connect_transport(enum transport transport, struct endpoint *client, struct server *server)
+{
+  int fds[2];
+  int ret;
+
+  client->transport = server->endpoint.transport = transport;
+  server->listen_fd = -1;
+
+  if (transport == TRANSPORT_TCP)
+  {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+    int one = 1;
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listen_fd < 0 || bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server->listen_fd, 1) != 0 ||
+        getsockname(server->listen_fd, (struct sockaddr *)&address, &length) != 0)
+    {
+      perror("tcp listen");
+      exit(EXIT_FAILURE);
+    }
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->fd < 0 || connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+      perror("tcp connect");
+      exit(EXIT_FAILURE);
+    }
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+  {
+    perror("socketpair");
+    exit(EXIT_FAILURE);
+  }
+  client->fd = fds[0];
+  server->endpoint.fd = fds[1];
+  if (transport == TRANSPORT_UNIX)
+    return;
+
+  /* the server side offers the channel, as aesdsocket answers AESD_SHM_OFFER */
+  ret = aesd_shm_channel_create(&server->endpoint.channel, SHM_RING_SIZE, server->endpoint.fd);
+  if (ret == 0)
+    ret = aesd_shm_channel_offer(&server->endpoint.channel);
+  if (ret == 0)
+    ret = aesd_shm_channel_accept(&client->channel, client->fd);
+  if (ret != 0)
+  {
+    printf("shm: channel cannot be set up: %s\n", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static bool run(const char *name, enum transport transport, unsigned long round_trips,
+                size_t line_bytes, size_t reply_bytes)
+{
+  struct endpoint client;
+  struct server server = { .line_bytes = line_bytes, .reply_bytes = reply_bytes };
+  pthread_t thread;
+  uint64_t *latencies = malloc(round_trips * sizeof(*latencies));
+  char *line = malloc(line_bytes);
+  char *reply = malloc(reply_bytes);
+  uint64_t total = 0;
+  unsigned long ii;
+  bool ok = true;
+
+  connect_transport(transport, &client, &server);
+  pthread_create(&thread, NULL, server_thread, &server);
+
+  memset(line, 'l', line_bytes);
+  line[line_bytes - 1] = '\n';
+  for (ii = 0; ii < round_trips && ok; ii++)
+  {
+    uint64_t start;
+
+    snprintf(line, line_bytes, "%lu", ii);
+    line[strlen(line)] = ' ';
+    start = now_ns();
+    if (!put_bytes(&client, line, line_bytes) || !get_bytes(&client, reply, reply_bytes))
+    {
+      printf("%s: connection lost after %lu round trips\n", name, ii);
+      ok = false;
+    }
+    else if (memcmp(reply, line, line_bytes) != 0)
+    {
+      printf("%s: reply %lu does not start with its line\n", name, ii);
+      ok = false;
+    }
+    latencies[ii] = now_ns() - start;
+    total += latencies[ii];
+  }
+
+  /* closing the client's socket tells the server, over shm too */
+  shutdown(client.fd, SHUT_RDWR);
+  pthread_join(thread, NULL);
+  if (transport == TRANSPORT_SHM)
+  {
+    aesd_shm_channel_free(&client.channel);
+    aesd_shm_channel_free(&server.endpoint.channel);
+  }
+  close(client.fd);
+  close(server.endpoint.fd);
+  if (server.listen_fd >= 0)
+    close(server.listen_fd);
+
+  if (ok)
+  {
+    qsort(latencies, round_trips, sizeof(*latencies), compare_u64);
+    printf("%-6s %8lu %8zu %10.2f %10.2f %10.2f\n", name, round_trips, reply_bytes,
+           total / 1e3 / round_trips, latencies[round_trips / 2] / 1e3,
+           latencies[round_trips * 99 / 100] / 1e3);
+  }
+
+  free(latencies);
+  free(line);
+  free(reply);
+  return ok;
+}
+
+
+/* the client of check_stray_byte: a byte over the unix socket while the server sleeps, a line later */
+static void *stray_client(void *arg)
+{
+  struct endpoint *client = arg;
+
+  usleep(50000);
+  send(client->fd, "x", 1, MSG_NOSIGNAL);
+  usleep(50000);
+  aesd_shm_write(&client->channel, "line\n", 5);
+  return NULL;
+}
+
+
+static bool check_stray_byte(void)
+{
+  struct endpoint client;
+  struct server server = { .line_bytes = 1 };
+  pthread_t thread;
+  char buffer[16];
+  ssize_t bytes_read;
+  bool ok;
+
+  connect_transport(TRANSPORT_SHM, &client, &server);
+  pthread_create(&thread, NULL, stray_client, &client);
+  bytes_read = aesd_shm_read(&server.endpoint.channel, buffer, sizeof(buffer));
+  pthread_join(thread, NULL);
+  ok = bytes_read == 5 && memcmp(buffer, "line\n", 5) == 0;
+  if (!ok)
+    printf("shm: a stray byte on the unix socket ended the session, read %zd\n", bytes_read);
+
+  aesd_shm_channel_free(&client.channel);
+  aesd_shm_channel_free(&server.endpoint.channel);
+  close(client.fd);
+  close(server.endpoint.fd);
+  return ok;
+}
+
+
+/* a client that moves the counters the server reads, over a ring or wrapped around, is refused */
+static bool check_corrupt_rings(void)
+{
+  struct endpoint client;
+  struct server server = { .line_bytes = 1 };
+  char buffer[64] = "corrupt";
+  ssize_t written;
+  ssize_t bytes_read;
+  bool ok;
+
+  connect_transport(TRANSPORT_SHM, &client, &server);
+
+  /* the reader of the replies says it consumed more than was written: the room would wrap */
+  atomic_store(&client.channel.replies.header->tail, SHM_RING_SIZE * 3ULL);
+  errno = 0;
+  written = aesd_shm_write(&server.endpoint.channel, buffer, sizeof(buffer));
+  ok = written == -1 && errno == EPROTO;
+
+  /* the writer of the requests says it produced more than the ring holds */
+  atomic_store(&client.channel.requests.header->head, SHM_RING_SIZE + 1ULL);
+  errno = 0;
+  bytes_read = aesd_shm_read(&server.endpoint.channel, buffer, sizeof(buffer));
+  ok = ok && bytes_read == -1 && errno == EPROTO;
+
+  if (!ok)
+    printf("shm: corrupt rings were not refused, write %zd read %zd\n", written, bytes_read);
+
+  aesd_shm_channel_free(&client.channel);
+  aesd_shm_channel_free(&server.endpoint.channel);
+  close(client.fd);
+  close(server.endpoint.fd);
+  return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned long round_trips = 20000;
+  size_t line_bytes = 64;
+  size_t reply_bytes = 256;
+  bool ok = true;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:b:r:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n':
+        round_trips = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':
+        line_bytes = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        reply_bytes = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        printf("Usage: %s [-n round trips] [-b line bytes] [-r reply bytes]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (round_trips == 0 || line_bytes < 24 || reply_bytes < line_bytes)
+  {
+    printf("Needs a round trip, lines of 24 bytes or more and replies no shorter than a line\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-6s %8s %8s %10s %10s %10s\n", "mode", "trips", "reply", "mean us", "p50 us", "p99 us");
+  ok &= run("tcp", TRANSPORT_TCP, round_trips, line_bytes, reply_bytes);
+  ok &= run("unix", TRANSPORT_UNIX, round_trips, line_bytes, reply_bytes);
+  ok &= run("shm", TRANSPORT_SHM, round_trips, line_bytes, reply_bytes);
+  ok &= check_corrupt_rings();
+  ok &= check_stray_byte();
+  return ok ? 0 : EXIT_FAILURE;
+}
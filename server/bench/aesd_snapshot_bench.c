@@ -0,0 +1,259 @@
+
+/*
+ * Replays of a history file the way aesdsocket's connection threads replay it, under the lock
+ * of the history, while writes keep making new generations of it.
+ *
+ * - copy:  every replay takes a snapshot with aesd_snapshot_get, a generation replayed once is
+ *          read into memory for nothing
+ * - share: replays take aesd_snapshot_share, the first replay of a generation is sent from the
+ *          file with sendfile under the lock and later ones share one snapshot sent without it
+ *
+ * Every thread takes the lock, writes a line every -r replays, then replays the history to
+ * /dev/null. The share run must serve every generation once from the file, read it once into a
+ * snapshot when it is replayed again and serve the remaining replays from that snapshot. Every
+ * snapshot must be as long as the history at its generation and the last one must match it.
+ *
+ * Usage: aesd-snapshot-bench [-l initial lines] [-n replays per thread] [-r replays per write]
+ *                            [-t threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+
+#include "aesd_snapshot.h"
+
+enum mode
+{
+  MODE_COPY,
+  MODE_SHARE,
+};
+
+struct history
+{
+  pthread_mutex_t mutex;
+  struct aesd_snapshot_cache cache;
+  int data_fd;
+  int sink_fd;
+  enum mode mode;
+  unsigned long replays_per_write;
+  unsigned long replays;    /* replays so far, under mutex */
+  unsigned long writes;     /* lines written so far, under mutex */
+  off_t size;               /* bytes in the file, under mutex */
+  unsigned long per_thread;
+  bool ok;
+};
+
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* a line of history, as a client of aesdsocket would send it */
+static bool write_line(struct history *history)
+{
+  char line[64];
+  int length = snprintf(line, sizeof(line), "line %08lu of the replayed history\n", history->writes);
+
+  if (write(history->data_fd, line, length) != length)
+    return false;
+  history->writes++;
+  history->size += length;
+  aesd_snapshot_cache_invalidate(&history->cache);
+  return true;
+}
+
+
+static void *replay_thread(void *arg)
+{
+  struct history *history = arg;
+  unsigned long ii;
+
+  for (ii = 0; ii < history->per_thread; ii++)
+  {
+    struct aesd_snapshot *snapshot;
+
+    pthread_mutex_lock(&history->mutex);
+    if (history->replays++ % history->replays_per_write == 0 && !write_line(history))
+      history->ok = false;
+
+    if (history->mode == MODE_COPY)
+      snapshot = aesd_snapshot_get(&history->cache, history->data_fd);
+    else
+      snapshot = aesd_snapshot_share(&history->cache, history->data_fd);
+
+    if (snapshot == NULL)
+    {
+      off_t offset = 0;
+      if (sendfile(history->sink_fd, history->data_fd, &offset, history->size) != history->size)
+        history->ok = false;
+      pthread_mutex_unlock(&history->mutex);
+      continue;
+    }
+
+    if (snapshot->size != (size_t)history->size)
+      history->ok = false;
+    pthread_mutex_unlock(&history->mutex);
+    if (write(history->sink_fd, snapshot->data, snapshot->size) != (ssize_t)snapshot->size)
+      history->ok = false;
+    aesd_snapshot_put(snapshot);
+  }
+  return NULL;
+}
+
+
+/* the snapshot of the current generation must be the file as it is */
+static bool check_contents(struct history *history)
+{
+  struct aesd_snapshot *snapshot = aesd_snapshot_get(&history->cache, history->data_fd);
+  char *data = malloc(history->size);
+  bool ok;
+
+  ok = snapshot != NULL && data != NULL &&
+       pread(history->data_fd, data, history->size, 0) == history->size &&
+       snapshot->size == (size_t)history->size && memcmp(snapshot->data, data, history->size) == 0;
+  if (snapshot)
+    aesd_snapshot_put(snapshot);
+  free(data);
+  return ok;
+}
+
+
+static bool run(const char *name, enum mode mode, unsigned long lines, unsigned long per_thread,
+                unsigned long replays_per_write, unsigned int threads)
+{
+  char path[] = "/tmp/aesd-snapshot-bench-XXXXXX";
+  struct history history = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .mode = mode,
+    .replays_per_write = replays_per_write,
+    .per_thread = per_thread,
+    .ok = true,
+  };
+  pthread_t *ids = malloc(threads * sizeof(*ids));
+  unsigned long generations;
+  unsigned long ii;
+  uint64_t start;
+  uint64_t elapsed;
+  bool ok;
+
+  history.data_fd = mkstemp(path);
+  history.sink_fd = open("/dev/null", O_WRONLY);
+  if (history.data_fd < 0 || history.sink_fd < 0)
+  {
+    perror("history");
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  aesd_snapshot_cache_init(&history.cache);
+  for (ii = 0; ii < lines; ii++)
+    write_line(&history);
+  history.writes = 0;
+
+  start = now_ns();
+  for (ii = 0; ii < threads; ii++)
+    pthread_create(&ids[ii], NULL, replay_thread, &history);
+  for (ii = 0; ii < threads; ii++)
+    pthread_join(ids[ii], NULL);
+  elapsed = now_ns() - start;
+
+  ok = history.ok;
+  if (!ok)
+    printf("%s: a replay did not send the whole history\n", name);
+
+  /* every generation is replayed replays_per_write times, the last one maybe fewer */
+  generations = history.writes;
+  if (ok && mode == MODE_SHARE)
+  {
+    unsigned long total = history.replays;
+    unsigned long shared = total - generations; /* replays after the first of their generation */
+    unsigned long last = total - (generations - 1) * replays_per_write;
+    unsigned long misses = (generations - 1) * (replays_per_write > 1) + (last > 1);
+
+    if (history.cache.direct != generations || history.cache.misses != misses ||
+        history.cache.hits != shared - misses)
+    {
+      printf("%s: %lu generations took %llu replays from the file, %llu misses and %llu hits\n", name,
+             generations, (unsigned long long)history.cache.direct,
+             (unsigned long long)history.cache.misses, (unsigned long long)history.cache.hits);
+      ok = false;
+    }
+    else if (replays_per_write > 2 && history.cache.hits == 0)
+    {
+      printf("%s: no replay was served from a snapshot\n", name);
+      ok = false;
+    }
+  }
+  if (ok)
+    printf("%-6s %8lu %8lu %8llu %8llu %8llu %10.2f\n", name, history.replays, generations,
+           (unsigned long long)history.cache.direct, (unsigned long long)history.cache.misses,
+           (unsigned long long)history.cache.hits, elapsed / 1e3 / history.replays);
+
+  if (ok && !check_contents(&history))
+  {
+    printf("%s: the snapshot does not hold the history\n", name);
+    ok = false;
+  }
+
+  aesd_snapshot_cache_free(&history.cache);
+  close(history.data_fd);
+  close(history.sink_fd);
+  free(ids);
+  return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+  unsigned long lines = 20000;
+  unsigned long per_thread = 2000;
+  unsigned long replays_per_write = 1;
+  unsigned int threads = 4;
+  bool ok = true;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:n:r:t:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l':
+        lines = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        per_thread = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        replays_per_write = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        threads = (unsigned int)strtoul(optarg, NULL, 10);
+        break;
+      default:
+        printf("Usage: %s [-l initial lines] [-n replays per thread] [-r replays per write] [-t threads]\n",
+               argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (per_thread == 0 || replays_per_write == 0 || threads == 0)
+  {
+    printf("Needs replays, a write every replay or less often and a thread\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-6s %8s %8s %8s %8s %8s %10s\n", "mode", "replays", "writes", "file", "misses", "hits",
+         "us/replay");
+  ok &= run("copy", MODE_COPY, lines, per_thread, replays_per_write, threads);
+  ok &= run("share", MODE_SHARE, lines, per_thread, replays_per_write, threads);
+  return ok ? 0 : EXIT_FAILURE;
+}
@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 #include <pthread.h>
+#include <stddef.h>
+
+struct aesd_snapshot_cache;
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -19,8 +22,17 @@ struct socket_thread_data
      * your thread implementation.
      */
     pthread_mutex_t *mutex;
+    struct aesd_snapshot_cache *snapshots; /* replay snapshots of data_path, guarded by mutex */
     int accepted_fd;
+    bool local; /* accepted on the unix socket, may ask for SHM */
     char ip_str[16];
+    char data_path[64]; /* file or aesdchar shard this client reads and writes */
+    char *pending; /* partial line written, published to subscribers with its '\n' */
+    size_t pending_length;
+    size_t pending_capacity;
+    bool pending_skipped; /* the partial line is not kept, it started with nobody subscribed */
+    char *replay; /* copy of the in-memory history being replayed, sent without the lock */
+    size_t replay_capacity;
 
     /**
      * Set to true if the thread completed with success, false